@@ -1,24 +1,23 @@
-#include <OpenGL/gl.h>
+#include "glinclude.h"
 #include <GLFW/glfw3.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <assert.h>
+#include <time.h>
+#include <string.h>
 
 #include "linmath.h"
 #include "ppmrw.h"
-
-typedef struct {
-    float Position[2];
-    float TexCoord[2];
-} Vertex;
-
-// 4 x 4 quad structure mapped to 4 corners of image texture
-Vertex vertexes[] = {
-        {{1, -1}, {0.99999, 0.99999}},
-        {{1, 1},  {0.99999, 0}},
-        {{-1, 1}, {0, 0}},
-        {{-1, -1}, {0, 0.99999}}
-};
+#include "tiles.h"
+#include "slides.h"
+#include "playback.h"
+#include "watch.h"
+#include "raster.h"
+#include "offscreen.h"
+#include "trace.h"
+#include "framestats.h"
+#include "replay.h"
+#include "transform.h"
 
 // global variables representing translations
 float rotation_angle_rad = 0;
@@ -36,6 +35,49 @@ float scale_incr = 0.05;
 float shear_incr = 0.1;
 float rotation_incr = 0.1;
 
+// how often the render loop wakes up to upload rows while an image loads
+#define LOAD_POLL_SECONDS (1.0 / 60)
+// width and height of the textures large images are split into
+#define TILE_SIZE 1024
+// GPU memory the images' textures may use unless --gpu-budget says otherwise
+#define DEFAULT_GPU_BUDGET_MB 512
+// memory decoded images may use unless --cache-budget says otherwise
+#define DEFAULT_CACHE_BUDGET_MB 1024
+// slides on each side of the one on screen that are decoded ahead
+#define PREFETCH_SLIDES 1
+// window size when the first image can't be read
+#define DEFAULT_WINDOW_SIZE 512
+// frame rate sequences are played at unless --fps says otherwise
+#define DEFAULT_FPS 24
+// frames --bench-minify draws per scale factor and filter
+#define BENCH_FRAMES 50
+
+// scale factors --bench-minify draws the image at
+static const float bench_scales[] = { 1, 0.5f, 0.25f, 0.125f, 0.0625f, 0.03125f };
+
+// set whenever the next frame would look different from the last one
+boolean needs_redraw = TRUE;
+
+// slides to move by, set by the next and previous keys
+int slide_step = 0;
+
+// frame times and key latency, measured around every frame drawn in the window
+frame_stats frame_timing;
+
+// draw the frame rate and frame time percentiles over the image
+boolean show_overlay = FALSE;
+
+// the transformation built from the variables above, kept between frames
+view_transform view;
+
+// where the shader program's inputs are
+typedef struct program_inputs_t {
+    GLint mvp;              // MVP uniform
+    GLint vpos;             // vPos attribute
+    GLint texcoord;         // TexCoordIn attribute
+    GLint channels;         // Channels uniform
+} program_inputs;
+
 /* GLSL code for vertex shader */
 static const char* vertex_shader_text =
         "uniform mat4 MVP;\n"
@@ -48,13 +90,21 @@ static const char* vertex_shader_text =
         "    TexCoordOut = TexCoordIn;\n"
         "}\n";
 
-/* GLSL code for fragment shader */
+/* GLSL code for fragment shader. Gray images are uploaded as one (or two,
+ * with alpha) channel textures and spread back out to RGB here. */
 static const char* fragment_shader_text =
         "varying vec2 TexCoordOut;\n"
         "uniform sampler2D Texture;\n"
+        "uniform int Channels;\n"
         "void main()\n"
         "{\n"
-        "    gl_FragColor = texture2D(Texture, TexCoordOut);\n"
+        "    vec4 texel = texture2D(Texture, TexCoordOut);\n"
+        "    if (Channels == 1)\n"
+        "        gl_FragColor = vec4(texel.rrr, 1.0);\n"
+        "    else if (Channels == 2)\n"
+        "        gl_FragColor = vec4(texel.rrr, texel.g);\n"
+        "    else\n"
+        "        gl_FragColor = texel;\n"
         "}\n";
 
 static void error_callback(int error, const char* description) {
@@ -65,6 +115,11 @@ static void error_callback(int error, const char* description) {
  * Setup key callbacks for the program to control movement of the image
  */
 static void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods) {
+    if (action == GLFW_PRESS) {
+        needs_redraw = TRUE;
+        frame_stats_key(&frame_timing);
+    }
+
     if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS)
         glfwSetWindowShouldClose(window, GLFW_TRUE);
 
@@ -130,6 +185,31 @@ static void key_callback(GLFWwindow* window, int key, int scancode, int action,
 
     if (key == GLFW_KEY_C && action == GLFW_PRESS)
         shear_y -= shear_incr;
+
+    if ((key == GLFW_KEY_N || key == GLFW_KEY_SPACE || key == GLFW_KEY_PAGE_DOWN) &&
+        action == GLFW_PRESS)
+        slide_step++;
+
+    if ((key == GLFW_KEY_P || key == GLFW_KEY_PAGE_UP) && action == GLFW_PRESS)
+        slide_step--;
+
+    if (key == GLFW_KEY_F && action == GLFW_PRESS)
+        show_overlay = !show_overlay;
+}
+
+/**
+ * Redraws after the window is resized
+ */
+static void framebuffer_size_callback(GLFWwindow* window, int width, int height) {
+    needs_redraw = TRUE;
+}
+
+/**
+ * Redraws when the window system has lost the window's contents, e.g. after
+ * it was uncovered
+ */
+static void refresh_callback(GLFWwindow* window) {
+    needs_redraw = TRUE;
 }
 
 /**
@@ -138,6 +218,7 @@ static void key_callback(GLFWwindow* window, int key, int scancode, int action,
  */
 void glCompileShaderOrDie(GLuint shader) {
     GLint compiled;
+    TRACE_SCOPE(span, "compile_shader");
     glCompileShader(shader);
     glGetShaderiv(shader,
                   GL_COMPILE_STATUS,
@@ -161,6 +242,7 @@ void glCompileShaderOrDie(GLuint shader) {
  */
 void glLinkProgramOrDie(GLuint program) {
     GLint linked;
+    TRACE_SCOPE(span, "link_program");
     glLinkProgram(program);
     glGetProgramiv(program, GL_LINK_STATUS, &linked);
 
@@ -173,11 +255,544 @@ void glLinkProgramOrDie(GLuint program) {
     }
 }
 
+/**
+ * @return a monotonic timestamp in seconds
+ */
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Builds the transformation from the current translation, scale, shear and
+ * rotation. Only the stages that changed since the last frame are
+ * multiplied out again.
+ * @param mvp set to the transformation
+ */
+void compose_mvp(mat4x4 mvp) {
+    view_params params = {
+            rotation_angle_rad,
+            shear_x, shear_y,
+            scale_factor,
+            x_pos, y_pos,
+            x_tilt, y_tilt
+    };
+    view_transform_set(&view, &params);
+    view_transform_get(&view, mvp);
+}
+
+/**
+ * Finishes timing a frame, draws the overlay over it if it's on and swaps it
+ * onto the screen
+ * @param window window the frame was drawn in
+ */
+void present_frame(GLFWwindow* window) {
+    int width, height;
+
+    frame_stats_end(&frame_timing);
+    if (show_overlay) {
+        glfwGetFramebufferSize(window, &width, &height);
+        frame_stats_draw_overlay(&frame_timing, height);
+    }
+    glfwSwapBuffers(window);
+    frame_stats_swapped(&frame_timing);
+}
+
+/**
+ * Draws the visible tiles of the image with the current transformation and
+ * presents the frame
+ * @param window window to draw into
+ * @param mvp_location location of the MVP uniform
+ * @param tiles tiles of the image, NULL to draw just the background
+ */
+void draw_image(GLFWwindow* window, GLint mvp_location, tile_cache *tiles) {
+    int width, height;
+    mat4x4 mvp;
+    TRACE_SCOPE(span, "draw");
+
+    frame_stats_begin(&frame_timing);
+    glfwGetFramebufferSize(window, &width, &height);
+
+    glViewport(0, 0, width, height);
+    glClear(GL_COLOR_BUFFER_BIT);
+
+    compose_mvp(mvp);
+    glUniformMatrix4fv(mvp_location, 1, GL_FALSE, (const GLfloat*) mvp);
+    if (tiles != NULL)
+        tile_cache_draw(tiles, mvp);
+
+    present_frame(window);
+}
+
+/**
+ * Draws a slide on the CPU with the current transformation and blits the
+ * frame to the window, which needs nothing from GL but glDrawPixels
+ * @param window window to draw into
+ * @param fb framebuffer to draw in, resized to the window
+ * @param s slide to draw
+ * @param filter how texels are looked up once the slide is fully decoded
+ */
+void draw_software(GLFWwindow* window, framebuffer *fb, slide *s, enum raster_filter filter) {
+    int width, height;
+    mat4x4 mvp;
+    TRACE_SCOPE(span, "draw");
+
+    glfwGetFramebufferSize(window, &width, &height);
+    if (framebuffer_resize(fb, width, height) < 0)
+        return;
+    frame_stats_begin(&frame_timing);
+
+    compose_mvp(mvp);
+    if (!s->opened || s->rows_uploaded == 0)
+        memset(fb->pixels, 0, (size_t)width * height * 4);
+    else if (!s->mipmapped)
+        // rows past the decoded ones are still being written, and bilinear
+        // filtering would read into them
+        raster_draw_image(fb, mvp, &s->load.img, 1, s->rows_uploaded, RASTER_NEAREST);
+    else if (s->load.mips.levels > 1)
+        raster_draw_image(fb, mvp, s->load.mips.level, s->load.mips.levels, s->load.img.height,
+                          filter);
+    else
+        raster_draw_image(fb, mvp, &s->load.img, 1, s->load.img.height, filter);
+
+    glViewport(0, 0, width, height);
+    glDrawPixels(width, height, GL_RGBA, GL_UNSIGNED_BYTE, fb->pixels);
+    present_frame(window);
+}
+
+/**
+ * Measures fragment throughput with the image zoomed out, drawing it with
+ * nearest and with trilinear minification at each of bench_scales. The
+ * image covers scale^2 of the window, so fragments drawn per frame shrink
+ * while each one covers more texels; without mipmaps those texels are
+ * scattered and texture cache misses dominate.
+ * @param window window to draw into
+ * @param mvp_location location of the MVP uniform
+ * @param tiles tiles of the image, with their mip levels set
+ */
+void bench_minify(GLFWwindow* window, GLint mvp_location, tile_cache *tiles) {
+    int width, height, frame;
+    size_t i;
+    int trilinear;
+
+    glfwGetFramebufferSize(window, &width, &height);
+    glfwSwapInterval(0);
+    printf("scale\tnearest Mfrag/s\ttrilinear Mfrag/s\n");
+    for (i=0; i<sizeof(bench_scales) / sizeof(bench_scales[0]); i++) {
+        double fragments = (double)width * height * bench_scales[i] * bench_scales[i];
+        double rate[2];
+
+        scale_factor = bench_scales[i];
+        for (trilinear=0; trilinear<2; trilinear++) {
+            double start;
+
+            tile_cache_use_mipmaps(tiles, trilinear);
+            // the first frame uploads whatever tiles came into view
+            draw_image(window, mvp_location, tiles);
+            glFinish();
+            start = now();
+            for (frame=0; frame<BENCH_FRAMES; frame++)
+                draw_image(window, mvp_location, tiles);
+            glFinish();
+            rate[trilinear] = fragments * BENCH_FRAMES / (now() - start) / 1e6;
+        }
+        printf("%g\t%.1f\t\t%.1f\n", bench_scales[i], rate[0], rate[1]);
+    }
+    tile_cache_use_mipmaps(tiles, TRUE);
+    scale_factor = 1;
+    glfwSwapInterval(1);
+}
+
+/**
+ * Applies an event of a replayed script: a key is pressed through the same
+ * callback as the keyboard, and a view sets the parts of the
+ * transformation it names
+ * @param window window the script is replayed in
+ * @param event event to apply
+ */
+void apply_replay_event(GLFWwindow* window, const replay_event *event) {
+    if (event->type == REPLAY_KEY)
+        key_callback(window, event->key, 0, GLFW_PRESS, 0);
+    if (event->type != REPLAY_VIEW)
+        return;
+    if (event->fields & VIEW_ROTATE)
+        rotation_angle_rad = event->rotate;
+    if (event->fields & VIEW_SCALE)
+        scale_factor = event->scale;
+    if (event->fields & VIEW_TRANSLATE) {
+        x_pos = event->x_pos;
+        y_pos = event->y_pos;
+    }
+    if (event->fields & VIEW_SHEAR) {
+        shear_x = event->shear_x;
+        shear_y = event->shear_y;
+    }
+    if (event->fields & VIEW_TILT) {
+        x_tilt = event->x_tilt;
+        y_tilt = event->y_tilt;
+    }
+    needs_redraw = TRUE;
+}
+
+/**
+ * Prints how fast a replayed script was drawn
+ * @param script script that was replayed
+ */
+void report_replay(const replay_script *script) {
+    double seconds = script->finish - script->start;
+    printf("Replayed %d events in %.2f s: %d frames, %.1f fps\n", script->next, seconds,
+           script->frames, seconds > 0 ? script->frames / seconds : 0);
+}
+
+/**
+ * Gets the GL state ready to draw a set of tiles: their vertex buffer and
+ * attributes, their channel count and blending
+ * @param tiles tiles to draw
+ * @param format pixel format of their image
+ * @param inputs where the shader program's inputs are
+ */
+void use_tiles(tile_cache *tiles, enum pixel_format format, const program_inputs *inputs) {
+    glBindBuffer(GL_ARRAY_BUFFER, tiles->vertex_buffer);
+    glVertexAttribPointer(inputs->vpos,
+                          2,
+                          GL_FLOAT,
+                          GL_FALSE,
+                          sizeof(Vertex),
+                          (void*) 0);
+    glVertexAttribPointer(inputs->texcoord,
+                          2,
+                          GL_FLOAT,
+                          GL_FALSE,
+                          sizeof(Vertex),
+                          (void*) (sizeof(float) * 2));
+
+    glUniform1i(inputs->channels, PPM_CHANNELS(format));
+
+    // images with an alpha channel are drawn over the background
+    if (format == PIXEL_GRAY_ALPHA || format == PIXEL_RGBA) {
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    }
+    else
+        glDisable(GL_BLEND);
+}
+
+/**
+ * Gets ready to draw a slide that was just put on screen and shows its
+ * name in the window title
+ * @param window window the slides are drawn in
+ * @param show slideshow
+ * @param inputs where the shader program's inputs are
+ */
+void use_slide(GLFWwindow* window, slideshow *show, const program_inputs *inputs) {
+    slide *s = slideshow_current(show);
+    char title[512];
+
+    snprintf(title, sizeof(title), "ezview - %s (%d/%d)", s->path, show->current + 1, show->count);
+    glfwSetWindowTitle(window, title);
+    if (s->has_tiles)
+        use_tiles(&s->tiles, s->load.img.format, inputs);
+}
+
+/**
+ * Prints how well a sequence played
+ * @param frames frames played, shown or dropped
+ * @param seconds time from the first frame to the last
+ * @param fps frames per second it was played at
+ * @param dropped frames that were never shown
+ */
+void report_playback(int frames, double seconds, double fps, int dropped) {
+    printf("Played %d frames in %.2f s (%.1f fps, target %.1f), %d dropped\n", frames, seconds,
+           seconds > 0 ? (frames - 1) / seconds : 0, fps, dropped);
+}
+
+/**
+ * Plays a sequence of frames at a fixed rate until it ends or the window
+ * is closed. A frame is shown once it's due; when decoding or drawing
+ * falls behind, the frames that are already late are skipped and counted
+ * as dropped.
+ * @param window window to draw into
+ * @param play player opened on the sequence
+ * @param fps frames per second to play at
+ * @param budget most texture memory the frame's tiles may use
+ * @param force_8bit store 16-bit frames with 8 bits per channel
+ * @param inputs where the shader program's inputs are
+ * @return 0 on success, -1 if a frame couldn't be read
+ */
+int play_frames(GLFWwindow* window, player *play, double fps, size_t budget,
+                boolean force_8bit, const program_inputs *inputs) {
+    image shape;
+    tile_cache tiles;
+    int shown = -1, dropped = 0;
+    boolean ended = FALSE, reported = FALSE;
+    double start = 0, finish = 0;
+
+    // every frame has the size and format of the first, so one set of
+    // tiles is refilled for each of them
+    shape.width = play->first_header.width;
+    shape.height = play->first_header.height;
+    shape.max_color_val = play->first_header.max_color_val;
+    shape.format = play->first_header.format;
+    shape.bit_depth = 8 * PPM_SAMPLE_BYTES(shape.max_color_val);
+    shape.pixels = NULL;
+    if (tile_cache_init(&tiles, &shape, TILE_SIZE, budget, force_8bit) < 0)
+        return -1;
+    use_tiles(&tiles, shape.format, inputs);
+
+    while (!glfwWindowShouldClose(window)) {
+        int due = shown < 0 ? 0 : (int)((now() - start) * fps);
+        int newest = -1;
+        int number;
+        image *frame = NULL;
+        double wait;
+
+        // show the newest frame that is due and decoded; the ones it skips are dropped
+        for (number=shown+1; number<=due; number++) {
+            image *img = player_frame(play, number, &ended);
+            if (img == NULL)
+                break;
+            frame = img;
+            newest = number;
+        }
+        if (frame != NULL) {
+            if (shown < 0)
+                start = now();
+            dropped += newest - shown - 1;
+            tile_cache_replace(&tiles, frame);
+            if (newest > 0)
+                player_release(play, newest - 1);
+            shown = newest;
+            finish = now();
+            needs_redraw = TRUE;
+        }
+        else if (shown >= 0)
+            player_frame(play, shown + 1, &ended);
+
+        if (ended && !reported) {
+            report_playback(shown + 1, finish - start, fps, dropped);
+            reported = TRUE;
+        }
+
+        if (needs_redraw) {
+            needs_redraw = FALSE;
+            draw_image(window, inputs->mvp, &tiles);
+        }
+
+        // sleep until the next frame is due; a decoder finishing a frame
+        // that is already late wakes the loop up early
+        wait = start + (shown + 1) / fps - now();
+        if (ended)
+            glfwWaitEvents();
+        else
+            glfwWaitEventsTimeout(shown < 0 || wait <= 0 ? LOAD_POLL_SECONDS : wait);
+    }
+
+    if (!reported && shown >= 0)
+        report_playback(shown + 1, finish - start, fps, dropped);
+    tile_cache_free(&tiles);
+    return play->failed ? -1 : 0;
+}
+
+/**
+ * Compiles and links the shader program, starts using it and finds its
+ * inputs
+ * @param inputs set to where the program's inputs are
+ */
+void setup_program(program_inputs *inputs) {
+    GLuint vertex_shader, fragment_shader, program;
+
+    vertex_shader = glCreateShader(GL_VERTEX_SHADER);
+    glShaderSource(vertex_shader, 1, &vertex_shader_text, NULL);
+    glCompileShaderOrDie(vertex_shader);
+
+    fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
+    glShaderSource(fragment_shader, 1, &fragment_shader_text, NULL);
+    glCompileShaderOrDie(fragment_shader);
+
+    program = glCreateProgram();
+    glAttachShader(program, vertex_shader);
+    glAttachShader(program, fragment_shader);
+    glLinkProgramOrDie(program);
+
+    inputs->mvp = glGetUniformLocation(program, "MVP");
+    assert(inputs->mvp != -1);
+
+    inputs->vpos = glGetAttribLocation(program, "vPos");
+    assert(inputs->vpos != -1);
+
+    inputs->texcoord = glGetAttribLocation(program, "TexCoordIn");
+    assert(inputs->texcoord != -1);
+
+    GLuint tex_location = glGetUniformLocation(program, "Texture");
+    assert(tex_location != -1);
+
+    inputs->channels = glGetUniformLocation(program, "Channels");
+    assert(inputs->channels != -1);
+
+    glEnableVertexAttribArray(inputs->vpos);
+    glEnableVertexAttribArray(inputs->texcoord);
+
+    glUseProgram(program);
+    glUniform1i(tex_location, 0);
+}
+
+/**
+ * Reads an image and its mipmaps for render_batch()
+ * @param path file to read, "-" for stdin
+ * @param img set to the image
+ * @param mips set to its pyramid, just level 0 if it couldn't be built
+ * @return 0 on success, -1 on error
+ */
+int read_render_input(const char *path, image *img, mip_pyramid *mips) {
+    FILE *fh = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+    header hdr;
+    int ret_val;
+
+    if (fh == NULL) {
+        fprintf(stderr, "Error: read_render_input: %s can't be opened\n", path);
+        return -1;
+    }
+    ret_val = read_header(fh, &hdr);
+    if (ret_val == 0)
+        ret_val = read_pnm_data(fh, &hdr, img);
+    if (fh != stdin)
+        fclose(fh);
+    if (ret_val < 0) {
+        fprintf(stderr, "Error: read_render_input: Problem reading %s\n", path);
+        return -1;
+    }
+    // zoomed out views are filtered from the pyramid, as on screen
+    if (mip_pyramid_build(mips, img) < 0)
+        fprintf(stderr, "Warning: Unable to build mipmaps for %s\n", path);
+    return 0;
+}
+
+/**
+ * Draws every image of a slideshow with the transformation from the command
+ * line and writes the frames out as PPM files, without opening a window.
+ * One context, shader program and framebuffer object serve all of the
+ * images; drawing on the CPU needs no context at all.
+ * @param show slideshow with the images to draw
+ * @param pattern file to write, with a printf %d for the image number
+ *                (from 1) when there are several; "-" writes the frames
+ *                one after another to stdout
+ * @param width width of the frames, 0 for the width of each image
+ * @param height height of the frames, 0 for the height of each image
+ * @param software draw on the CPU instead of with shaders and textures
+ * @param filter how texels are looked up on the CPU
+ * @param budget most texture memory an image's tiles may use
+ * @param force_8bit store 16-bit images with 8 bits per channel
+ * @return number of images that couldn't be drawn, -1 if there's no context
+ */
+int render_batch(slideshow *show, const char *pattern, int width, int height,
+                 boolean software, enum raster_filter filter, size_t budget,
+                 boolean force_8bit) {
+    offscreen off;
+    program_inputs inputs;
+    framebuffer fb = { 0, 0, NULL };
+    double start = now(), seconds;
+    int failed = 0;
+    int i;
+
+    if (!software) {
+        if (offscreen_init(&off) < 0)
+            return -1;
+        setup_program(&inputs);
+    }
+
+    for (i=0; i<show->count; i++) {
+        const char *path = show->slides[i].path;
+        char out[4096];
+        image img;
+        mip_pyramid mips;
+        mat4x4 mvp;
+        int w, h;
+        int ret_val;
+        TRACE_SCOPE(span, "render_image");
+
+        if (read_render_input(path, &img, &mips) < 0) {
+            failed++;
+            continue;
+        }
+        w = width > 0 ? width : img.width;
+        h = height > 0 ? height : img.height;
+        compose_mvp(mvp);
+
+        if (software) {
+            ret_val = framebuffer_resize(&fb, w, h);
+            if (ret_val == 0 && mips.levels > 1)
+                raster_draw_image(&fb, mvp, mips.level, mips.levels, img.height, filter);
+            else if (ret_val == 0)
+                raster_draw_image(&fb, mvp, &img, 1, img.height, filter);
+        }
+        else {
+            tile_cache tiles;
+            ret_val = offscreen_resize(&off, w, h);
+            if (ret_val == 0)
+                ret_val = tile_cache_init(&tiles, &img, TILE_SIZE, budget, force_8bit);
+            if (ret_val == 0) {
+                glClear(GL_COLOR_BUFFER_BIT);
+                use_tiles(&tiles, img.format, &inputs);
+                tile_cache_rows_ready(&tiles, img.height);
+                if (mips.levels > 1)
+                    tile_cache_set_mipmaps(&tiles, &mips);
+                glUniformMatrix4fv(inputs.mvp, 1, GL_FALSE, (const GLfloat*) mvp);
+                tile_cache_draw(&tiles, mvp);
+                offscreen_read(&off, &fb);
+                tile_cache_free(&tiles);
+                if (fb.width != w || fb.height != h)
+                    ret_val = -1;
+            }
+        }
+        mip_pyramid_free(&mips);
+        free_image(&img);
+
+        snprintf(out, sizeof(out), pattern, i + 1);
+        if (ret_val < 0 || framebuffer_write(&fb, out) < 0)
+            failed++;
+    }
+
+    seconds = now() - start;
+    if (show->count > failed)
+        fprintf(stderr, "Rendered %d images in %.2f s (%.1f ms each)\n", show->count - failed,
+                seconds, seconds * 1000 / (show->count - failed));
+    framebuffer_free(&fb);
+    if (!software)
+        offscreen_free(&off);
+    return failed;
+}
+
 /**
  * help() - prints out program info and instructions
  */
 void help() {
-    printf("Usage: \tezview <filename.ppm>\n"
+    printf("Usage: \tezview [--8bit] [--continuous] [--gpu-budget MB] [--cache-budget MB]\n"
+                   "\t\t[--bench-minify] [--trace out.json] [--frame-stats] [--replay script]\n"
+                   "\t\t<filename.ppm|pgm|pbm|pam | directory>... | -\n"
+                   "\tezview --watch [--8bit] [--gpu-budget MB] <filename.ppm|pgm|pbm|pam>\n"
+                   "\tezview --software [--bilinear] [--watch] [--cache-budget MB] <filename>...\n"
+                   "\tezview --play [--fps N] [--8bit] [--gpu-budget MB] <frame_%%05d.ppm | ->\n"
+                   "\tezview --render-to <out.ppm | out_%%03d.ppm | -> [--size WxH] [--software]\n"
+                   "\t\t[--rotate R] [--scale S] [--translate X,Y] [--shear X,Y] [--tilt X,Y]\n"
+                   "\t\t<filename | directory>...\n"
+                   "\t--8bit\tconvert 16-bit images to 8 bits before display\n"
+                   "\t--continuous\tredraw every frame instead of only on changes\n"
+                   "\t--gpu-budget\tmost texture memory to use, in MB (default %d)\n"
+                   "\t--cache-budget\tmost memory decoded images may use, in MB (default %d)\n"
+                   "\t--bench-minify\tprint fragment throughput zoomed out, then exit\n"
+                   "\t--software\tdraw on the CPU instead of with shaders and textures\n"
+                   "\t--bilinear\twith --software, filter bilinearly from the mipmaps\n"
+                   "\t--watch\treload the image whenever the file is rewritten\n"
+                   "\t--play\tplay numbered files, or concatenated images from stdin\n"
+                   "\t--fps\tframe rate to play at (default %d)\n"
+                   "\t--frame-stats\tprint histograms of frame times and key latency on exit\n"
+                   "\t--replay\tplay back a script of keys and views without vsync, then exit\n"
+                   "\t--trace\twrite how long each stage took to a Chrome trace file\n"
+                   "\t--render-to\tdraw each image into a PPM file without a window, then exit\n"
+                   "\t--size\tsize of the rendered frames (default the image's size)\n"
+                   "\t--rotate, --scale, --translate, --shear, --tilt\n"
+                   "\t\tview to start with, or to render; rotation is in radians\n"
                    "Controls:\n"
                    "\t\tTranslate XY:  \tw,a,s,d\n"
                    "\t\tTranslate Z:  \tup,down,left,right\n"
@@ -186,215 +801,424 @@ void help() {
                    "\t\tShear Y:  \tz,x\n"
                    "\t\tRotate:  \tr,e\n"
                    "\t\tReset:  \tENTER\n"
-                   "\t\tQuit:  \t\tESC\n");
+                   "\t\tNext image:  \tn,SPACE,PAGE DOWN\n"
+                   "\t\tPrevious image:\tp,PAGE UP\n"
+                   "\t\tFrame stats:  \tf\n"
+                   "\t\tQuit:  \t\tESC\n", DEFAULT_GPU_BUDGET_MB, DEFAULT_CACHE_BUDGET_MB, DEFAULT_FPS);
+}
+
+/**
+ * Parses the value of a budget option
+ * @param option name of the option, for the error message
+ * @param value text of the value
+ * @return the budget in bytes; exits on a bad value
+ */
+size_t parse_budget(const char *option, const char *value) {
+    long mb = strtol(value, NULL, 10);
+    if (mb <= 0) {
+        fprintf(stderr, "Error: main: %s must be a positive number of MB\n", option);
+        exit(1);
+    }
+    return (size_t)mb << 20;
+}
+
+/**
+ * Parses the value of an option that takes two numbers, like "0.5,-0.25"
+ * @param option name of the option, for the error message
+ * @param value text of the value
+ * @param x set to the first number
+ * @param y set to the second number
+ */
+void parse_pair(const char *option, const char *value, float *x, float *y) {
+    if (sscanf(value, "%f,%f", x, y) != 2) {
+        fprintf(stderr, "Error: main: %s takes X,Y\n", option);
+        exit(1);
+    }
 }
 
 
 /************************************************
- * Main function - loads image and starts loop
+ * Main function - loads images and starts loop
  ************************************************/
 int main(int argc, char *argv[]) {
 
-    if (argc != 2) {
-        fprintf(stderr, "Error: main: There must be 1 argument\n");
+    boolean force_8bit = FALSE;
+    boolean continuous = FALSE;
+    boolean bench = FALSE;
+    boolean play = FALSE;
+    boolean watching = FALSE;
+    boolean software = FALSE;
+    boolean print_frame_stats = FALSE;
+    enum raster_filter filter = RASTER_TRILINEAR;
+    const char *render_to = NULL;
+    const char *trace_to = NULL;
+    const char *replay_from = NULL;
+    replay_script replay;
+    int render_width = 0, render_height = 0;
+    double fps = DEFAULT_FPS;
+    size_t gpu_budget = (size_t)DEFAULT_GPU_BUDGET_MB << 20;
+    size_t cache_budget = (size_t)DEFAULT_CACHE_BUDGET_MB << 20;
+    char **names = malloc(sizeof(char *) * argc);
+    int name_count = 0;
+    int i;
+
+    for (i=1; i<argc; i++) {
+        if (strcmp(argv[i], "--8bit") == 0)
+            force_8bit = TRUE;
+        else if (strcmp(argv[i], "--continuous") == 0)
+            continuous = TRUE;
+        else if (strcmp(argv[i], "--bench-minify") == 0)
+            bench = TRUE;
+        else if (strcmp(argv[i], "--play") == 0)
+            play = TRUE;
+        else if (strcmp(argv[i], "--watch") == 0)
+            watching = TRUE;
+        else if (strcmp(argv[i], "--software") == 0)
+            software = TRUE;
+        else if (strcmp(argv[i], "--bilinear") == 0)
+            filter = RASTER_BILINEAR;
+        else if (strcmp(argv[i], "--frame-stats") == 0)
+            print_frame_stats = TRUE;
+        else if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc) {
+            fps = strtod(argv[++i], NULL);
+            if (fps <= 0) {
+                fprintf(stderr, "Error: main: --fps must be a positive number\n");
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+            trace_to = argv[++i];
+        else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc)
+            replay_from = argv[++i];
+        else if (strcmp(argv[i], "--render-to") == 0 && i + 1 < argc)
+            render_to = argv[++i];
+        else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%dx%d", &render_width, &render_height) != 2 ||
+                render_width <= 0 || render_height <= 0) {
+                fprintf(stderr, "Error: main: --size takes WIDTHxHEIGHT\n");
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--rotate") == 0 && i + 1 < argc)
+            rotation_angle_rad = strtof(argv[++i], NULL);
+        else if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc)
+            scale_factor = strtof(argv[++i], NULL);
+        else if (strcmp(argv[i], "--translate") == 0 && i + 1 < argc) {
+            parse_pair(argv[i], argv[i + 1], &x_pos, &y_pos);
+            i++;
+        }
+        else if (strcmp(argv[i], "--shear") == 0 && i + 1 < argc) {
+            parse_pair(argv[i], argv[i + 1], &shear_x, &shear_y);
+            i++;
+        }
+        else if (strcmp(argv[i], "--tilt") == 0 && i + 1 < argc) {
+            parse_pair(argv[i], argv[i + 1], &x_tilt, &y_tilt);
+            i++;
+        }
+        else if (strcmp(argv[i], "--gpu-budget") == 0 && i + 1 < argc) {
+            gpu_budget = parse_budget(argv[i], argv[i + 1]);
+            i++;
+        }
+        else if (strcmp(argv[i], "--cache-budget") == 0 && i + 1 < argc) {
+            cache_budget = parse_budget(argv[i], argv[i + 1]);
+            i++;
+        }
+        else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+            fprintf(stderr, "Error: main: Unexpected argument %s\n", argv[i]);
+            help();
+            exit(1);
+        }
+        else
+            names[name_count++] = argv[i];
+    }
+    if (name_count == 0 || (play && name_count != 1)) {
+        fprintf(stderr, play ? "Error: main: --play takes 1 pattern or -\n"
+                             : "Error: main: There must be at least 1 filename argument\n");
         help();
         exit(1);
     }
-
-    FILE *in_ptr;
-    int ret_val;
-    char c;
-
-    in_ptr = fopen(argv[1], "rb");  // input file pointer
-
-    // error check the file pointers
-    if (in_ptr == NULL) {
-        fprintf(stderr, "Error: main: Input file can't be opened\n");
-        return 1;
+    if (software && (play || bench)) {
+        fprintf(stderr, "Error: main: --software can't be used with --play or --bench-minify\n");
+        help();
+        exit(1);
+    }
+    if (render_to != NULL && (play || bench || watching)) {
+        fprintf(stderr, "Error: main: --render-to can't be used with --play, --watch or "
+                        "--bench-minify\n");
+        help();
+        exit(1);
+    }
+    if (replay_from != NULL && (play || bench || render_to != NULL)) {
+        fprintf(stderr, "Error: main: --replay can't be used with --play, --render-to or "
+                        "--bench-minify\n");
+        help();
+        exit(1);
+    }
+    if (watching && (play || name_count != 1 || strcmp(names[0], "-") == 0)) {
+        fprintf(stderr, "Error: main: --watch takes 1 image file\n");
+        help();
+        exit(1);
     }
-    // allocate space for header information
-    header *hdr = (header *)malloc(sizeof(header));
 
 
     /*********************************
-     * read data from input file
+     * read data from input files
      *********************************/
 
-    // read header of input file
-    ret_val = read_header(in_ptr, hdr);
+    view_transform_init(&view);
 
-    if (ret_val < 0) {
-        fprintf(stderr, "Error: main: Problem reading header\n");
-        return 1;
+    // spans are recorded from here on and written out however main exits
+    if (trace_to != NULL) {
+        if (trace_start(trace_to) < 0)
+            exit(1);
+        atexit(trace_stop);
     }
 
-    // store the file type of the origin file so we know what we're converting from
-    int origin_file_type = hdr->file_type;
-
-    // create img struct to store relevant image info
-    image image;
-    image.width = hdr->width;
-    image.height = hdr->height;
-    image.max_color_val = hdr->max_color_val;
-    image.pixmap = malloc(sizeof(RGBPixel) * image.width * image.height);
-
-    // read image data (pixels)
-    if (origin_file_type == 3)
-        ret_val = read_p3_data(in_ptr, &image);
-    else
-        ret_val = read_p6_data(in_ptr, &image);
+    // a replay draws as fast as it can and reports how fast that was
+    if (replay_from != NULL) {
+        if (replay_load(&replay, replay_from) < 0)
+            exit(1);
+        continuous = TRUE;
+        print_frame_stats = TRUE;
+    }
 
-    if (ret_val < 0) {
-        fprintf(stderr, "Error: main: Problem reading image data\n");
-        return -1;
+    // low max color values would otherwise display dark
+    ppm_set_normalize(TRUE);
+
+    // batches are drawn straight into files and never open a window
+    if (render_to != NULL) {
+        slideshow batch;
+        int failed, numbers;
+        if (slideshow_init(&batch, names, name_count) < 0)
+            return 1;
+        free(names);
+        // the name is an snprintf() format given the image number and nothing else
+        numbers = strcmp(render_to, "-") == 0 ? 1 : pattern_numbers(render_to);
+        if (numbers < 0 || numbers > 1) {
+            fprintf(stderr, "Error: main: --render-to takes at most one %%d in the name, "
+                            "and %%%% for a percent sign\n");
+            slideshow_free(&batch);
+            return 1;
+        }
+        if (batch.count > 1 && numbers == 0) {
+            fprintf(stderr, "Error: main: --render-to needs a %%d in the name for %d images\n",
+                    batch.count);
+            slideshow_free(&batch);
+            return 1;
+        }
+        failed = render_batch(&batch, render_to, render_width, render_height, software, filter,
+                              gpu_budget, force_8bit);
+        slideshow_free(&batch);
+        return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
     }
 
-    // file cleanup
-    free(hdr);
-    fclose(in_ptr);
+    // images are decoded in the background; the window opens as soon as
+    // the first header has been read
+    double start_time = now();
+    slideshow show;
+    player frames;
+    file_watch watcher;
+    framebuffer fb = { 0, 0, NULL };
+    int window_width = DEFAULT_WINDOW_SIZE, window_height = DEFAULT_WINDOW_SIZE;
+    if (play) {
+        if (player_open(&frames, names[0]) < 0)
+            return 1;
+        window_width = frames.first_header.width;
+        window_height = frames.first_header.height;
+        // the slideshow stays empty
+        show.count = 0;
+        show.slides = NULL;
+    }
+    else {
+        TRACE_BEGIN(find_span, "find_images");
+        if (slideshow_init(&show, names, name_count) < 0)
+            return 1;
+        TRACE_END(find_span, 0);
+        show.prefetch = PREFETCH_SLIDES;
+        show.tile_size = TILE_SIZE;
+        show.cpu_budget = cache_budget;
+        show.gpu_budget = gpu_budget;
+        show.force_8bit = force_8bit;
+        show.watch = watching;
+        show.software = software;
+        if (watching && (show.count != 1 || watch_start(&watcher, show.slides[0].path) < 0)) {
+            fprintf(stderr, "Error: main: --watch takes 1 image file\n");
+            return 1;
+        }
+
+        slideshow_show(&show, 0);
+        slide *first = slideshow_current(&show);
+        // a watched file may just be half written; it's read again when done
+        if (first->failed && show.count == 1 && !watching)
+            return 1;
+        if (!first->failed) {
+            window_width = first->load.img.width;
+            window_height = first->load.img.height;
+        }
+    }
+    free(names);
+    boolean first_pixels = FALSE;
+    boolean switched = TRUE;
+    int exit_status = EXIT_SUCCESS;
 
     /***********************************
      * OpenGL setup
      ***********************************/
     GLFWwindow* window;
-    GLuint vertex_buffer, vertex_shader, fragment_shader, program;
-    GLuint mvp_location, vpos_location;
+    program_inputs inputs;
 
     glfwSetErrorCallback(error_callback);
 
+    TRACE_BEGIN(init_span, "glfw_init");
     if (!glfwInit())
         exit(EXIT_FAILURE);
+    TRACE_END(init_span, 0);
 
     glfwDefaultWindowHints();
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 2);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 0);
+    // drawing on the CPU only needs glDrawPixels, which any context has
+    if (!software) {
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 2);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 0);
+    }
 
-    window = glfwCreateWindow(image.width, image.height, "ezview", NULL, NULL);
+    TRACE_BEGIN(window_span, "create_window");
+    window = glfwCreateWindow(window_width, window_height, "ezview", NULL, NULL);
+    TRACE_END(window_span, 0);
     if (!window) {
+        if (play)
+            player_close(&frames);
+        else
+            slideshow_free(&show);
+        if (watching)
+            watch_stop(&watcher);
         glfwTerminate();
         exit(EXIT_FAILURE);
     }
 
     glfwSetKeyCallback(window, key_callback);
+    glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
+    glfwSetWindowRefreshCallback(window, refresh_callback);
 
     glfwMakeContextCurrent(window);
-    glfwSwapInterval(1);
+    // without vsync a replay measures the renderer, not the display
+    glfwSwapInterval(replay_from != NULL ? 0 : 1);
 
     glPixelStorei(GL_UNPACK_ALIGNMENT, 1);      // fixes tilted image problem
 
-    glGenBuffers(1, &vertex_buffer);
-    glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(vertexes), vertexes, GL_STATIC_DRAW);
-
-    vertex_shader = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(vertex_shader, 1, &vertex_shader_text, NULL);
-    glCompileShaderOrDie(vertex_shader);
-
-    fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(fragment_shader, 1, &fragment_shader_text, NULL);
-    glCompileShaderOrDie(fragment_shader);
-
-    program = glCreateProgram();
-    glAttachShader(program, vertex_shader);
-    glAttachShader(program, fragment_shader);
-    glLinkProgramOrDie(program);
-
-    mvp_location = glGetUniformLocation(program, "MVP");
-    assert(mvp_location != -1);
+    frame_stats_init(&frame_timing);
+    frame_timing.continuous = continuous;
 
-    vpos_location = glGetAttribLocation(program, "vPos");
-    assert(vpos_location != -1);
+    // the CPU path draws without shaders
+    if (!software)
+        setup_program(&inputs);
 
-    GLuint texcoord_location = glGetAttribLocation(program, "TexCoordIn");
-    assert(texcoord_location != -1);
-
-    GLuint tex_location = glGetUniformLocation(program, "Texture");
-    assert(tex_location != -1);
-
-    glEnableVertexAttribArray(vpos_location);
-    glVertexAttribPointer(vpos_location,
-                          2,
-                          GL_FLOAT,
-                          GL_FALSE,
-                          sizeof(Vertex),
-                          (void*) 0);
-
-    glEnableVertexAttribArray(texcoord_location);
-    glVertexAttribPointer(texcoord_location,
-                          2,
-                          GL_FLOAT,
-                          GL_FALSE,
-                          sizeof(Vertex),
-                          (void*) (sizeof(float) * 2));
-
-    GLuint texID;
-    glGenTextures(1, &texID);
-    glBindTexture(GL_TEXTURE_2D, texID);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, image.width, image.height, 0, GL_RGB,
-                 GL_UNSIGNED_BYTE, image.pixmap);
-
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, texID);
-    glUniform1i(tex_location, 0);
-    glUseProgram(program);
+    if (play) {
+        exit_status = play_frames(window, &frames, fps, gpu_budget, force_8bit, &inputs) < 0
+                          ? EXIT_FAILURE : EXIT_SUCCESS;
+        player_close(&frames);
+    }
 
     /* main program loop */
-    while (!glfwWindowShouldClose(window))
+    while (!play && !glfwWindowShouldClose(window))
     {
-        int width, height;
-        mat4x4 mvp;
-
-        glfwGetFramebufferSize(window, &width, &height);
-
-        glViewport(0, 0, width, height);
-        glClear(GL_COLOR_BUFFER_BIT);
-
-        // starting matrix
-        mat4x4_identity(mvp);
-
-        // scale matrix
-        mat4x4 s = {
-                {scale_factor, 0,            0, 0},
-                {0,            scale_factor, 0, 0},
-                {0,            0,            0, 0},
-                {0,            0,            0, 1}
-        };
-
-        // shear matrix
-        mat4x4 h = {
-                {1,       shear_x, 0, 0},
-                {shear_y, 1,       0, 0},
-                {0,       0,       1, 0},
-                {0,       0,       0, 1}
-        };
-
-        // translation matrix (handles tilting toward viewer and movement left/right/up/down)
-        mat4x4 t = {
-                {1,     0,     0, x_tilt},
-                {0,     1,     0, y_tilt},
-                {0,     0,     1, 0},
-                {x_pos, y_pos, 0, 1}
-        };
-
-        // perform transformations
-        mat4x4_rotate_Z(mvp, mvp, rotation_angle_rad);  // rotation
-        mat4x4_mul(mvp, h, mvp);                        // shear
-        mat4x4_mul(mvp, s, mvp);                        // scale
-        mat4x4_mul(mvp, t, mvp);                        // translate
-
-        glUniformMatrix4fv(mvp_location, 1, GL_FALSE, (const GLfloat*) mvp);
-        glDrawArrays(GL_QUADS, 0, 4);
-
-        glfwSwapBuffers(window);
-        glfwPollEvents();
+        slide *s;
+        boolean changed = FALSE;
+
+        if (slide_step != 0) {
+            int next = ((show.current + slide_step) % show.count + show.count) % show.count;
+            slide_step = 0;
+            if (next != show.current) {
+                slideshow_show(&show, next);
+                switched = TRUE;
+            }
+        }
+        // a rewrite that lands during a reload waits for it to finish
+        if (watching && !slideshow_current(&show)->reloading && watch_changed(&watcher)) {
+            slideshow_reload(&show);
+            // a reload from scratch sets the tiles up again
+            switched = TRUE;
+        }
+        if (switched)
+            slideshow_prefetch(&show);
+
+        // stream whatever the decoder has finished into the tiles; the
+        // tiles of a slide are set up the first time it's updated
+        s = slideshow_current(&show);
+        if (slideshow_update(&show, &changed) < 0 && show.count == 1 && !watching) {
+            exit_status = EXIT_FAILURE;
+            break;
+        }
+        if (changed)
+            needs_redraw = TRUE;
+        if (switched) {
+            use_slide(window, &show, &inputs);
+            needs_redraw = TRUE;
+            switched = FALSE;
+        }
+        slideshow_trim(&show);
+
+        // the script starts once the image is loaded, so decoding isn't measured
+        if (replay_from != NULL && replay.start == 0 && (s->mipmapped || s->failed)) {
+            replay_start(&replay, now());
+            frame_stats_reset(&frame_timing);
+        }
+        if (replay_from != NULL) {
+            const replay_event *event;
+            while ((event = replay_next(&replay, now())) != NULL)
+                apply_replay_event(window, event);
+        }
+
+        if (bench && s->mipmapped) {
+            bench_minify(window, inputs.mvp, &s->tiles);
+            break;
+        }
+
+        if (needs_redraw || continuous) {
+            needs_redraw = FALSE;
+            if (software)
+                draw_software(window, &fb, s, filter);
+            else
+                draw_image(window, inputs.mvp, s->has_tiles ? &s->tiles : NULL);
+            if (!first_pixels && s->rows_uploaded > 0) {
+                printf("Time to first pixel: %.1f ms\n", (now() - start_time) * 1000);
+                first_pixels = TRUE;
+            }
+            if (replay_from != NULL && replay.start != 0) {
+                replay.frames++;
+                // the frame showing the last event ends the replay
+                if (replay_finished(&replay)) {
+                    replay.finish = now();
+                    glfwSetWindowShouldClose(window, GLFW_TRUE);
+                }
+            }
+        }
+
+        // sleep until something changes; while loading, wake up regularly
+        // to upload the rows decoded in the meantime
+        if (continuous)
+            glfwPollEvents();
+        else if (s->opened && !s->mipmapped)
+            glfwWaitEventsTimeout(LOAD_POLL_SECONDS);
+        else
+            glfwWaitEvents();
     }
 
     // cleanup and exit
+    if (replay_from != NULL) {
+        if (replay.finish != 0)
+            report_replay(&replay);
+        else
+            fprintf(stderr, "Warning: main: The window was closed before the replay ended\n");
+        replay_free(&replay);
+    }
+    if (print_frame_stats)
+        frame_stats_print(&frame_timing);
+    frame_stats_free(&frame_timing);
+    if (watching)
+        watch_stop(&watcher);
+    slideshow_free(&show);
+    framebuffer_free(&fb);
     glfwDestroyWindow(window);
     glfwTerminate();
-    free(image.pixmap);
-    exit(EXIT_SUCCESS);
+    exit(exit_status);
 }
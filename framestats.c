@@ -0,0 +1,493 @@
+/** framestats - frame times and input latency
+ * Each frame records the CPU time from when drawing starts until the frame
+ * is handed to glfwSwapBuffers(), the GPU time of its commands from a
+ * GL_TIME_ELAPSED timer query where the driver has them, and, if a key was
+ * pressed since the last frame, the time from that key press until the
+ * swap. Queries are read back a few frames later, once their results are
+ * available, so measuring never stalls the pipeline.
+ *
+ * Recent samples go into lock-free rings that the overlay takes
+ * percentiles from; every sample also lands in a histogram with
+ * logarithmic buckets that is printed on exit.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "framestats.h"
+
+#ifndef GL_TIME_ELAPSED
+#define GL_TIME_ELAPSED 0x88BF
+#endif
+
+// pixels per font pixel in the overlay
+#define OVERLAY_SCALE 2
+// space around the overlay's text and between it and the window edge, in pixels
+#define OVERLAY_MARGIN 6
+// longest line of the overlay
+#define OVERLAY_COLUMNS 32
+#define OVERLAY_LINES 4
+// widest bar of a printed histogram
+#define HISTOGRAM_BAR 40
+
+// a 5x7 character of the overlay's font, top row first, bit 4 leftmost
+typedef struct glyph_t {
+    char c;
+    unsigned char rows[7];
+} glyph;
+
+// just the characters the overlay uses; anything else is left blank
+static const glyph font[] = {
+    { '0', { 0x0E, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0E } },
+    { '1', { 0x04, 0x0C, 0x04, 0x04, 0x04, 0x04, 0x0E } },
+    { '2', { 0x0E, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1F } },
+    { '3', { 0x1F, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0E } },
+    { '4', { 0x02, 0x06, 0x0A, 0x12, 0x1F, 0x02, 0x02 } },
+    { '5', { 0x1F, 0x10, 0x1E, 0x01, 0x01, 0x11, 0x0E } },
+    { '6', { 0x06, 0x08, 0x10, 0x1E, 0x11, 0x11, 0x0E } },
+    { '7', { 0x1F, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08 } },
+    { '8', { 0x0E, 0x11, 0x11, 0x0E, 0x11, 0x11, 0x0E } },
+    { '9', { 0x0E, 0x11, 0x11, 0x0F, 0x01, 0x02, 0x0C } },
+    { '.', { 0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C } },
+    { '-', { 0x00, 0x00, 0x00, 0x1F, 0x00, 0x00, 0x00 } },
+    { '/', { 0x01, 0x01, 0x02, 0x04, 0x08, 0x10, 0x10 } },
+    { 'A', { 0x0E, 0x11, 0x11, 0x1F, 0x11, 0x11, 0x11 } },
+    { 'C', { 0x0E, 0x11, 0x10, 0x10, 0x10, 0x11, 0x0E } },
+    { 'E', { 0x1F, 0x10, 0x10, 0x1E, 0x10, 0x10, 0x1F } },
+    { 'F', { 0x1F, 0x10, 0x10, 0x1E, 0x10, 0x10, 0x10 } },
+    { 'G', { 0x0E, 0x11, 0x10, 0x17, 0x11, 0x11, 0x0F } },
+    { 'K', { 0x11, 0x12, 0x14, 0x18, 0x14, 0x12, 0x11 } },
+    { 'M', { 0x11, 0x1B, 0x15, 0x15, 0x11, 0x11, 0x11 } },
+    { 'N', { 0x11, 0x11, 0x19, 0x15, 0x13, 0x11, 0x11 } },
+    { 'P', { 0x1E, 0x11, 0x11, 0x1E, 0x10, 0x10, 0x10 } },
+    { 'S', { 0x0F, 0x10, 0x10, 0x0E, 0x01, 0x01, 0x1E } },
+    { 'U', { 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0E } },
+    { 'Y', { 0x11, 0x11, 0x0A, 0x04, 0x04, 0x04, 0x04 } },
+};
+
+static double seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/*******************************************************//**
+ * Samples
+ * ********************************************************/
+
+/**
+ * Adds a value to a ring, overwriting the oldest once it's full. Only one
+ * thread may push to a ring.
+ */
+static void ring_push(sample_ring *ring, double value) {
+    unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    ring->values[head % STATS_RING_SIZE] = value;
+    // readers that see the new head see the value too
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/**
+ * Copies the values in a ring, oldest first. Safe on any thread: values
+ * the writer overwrote during the copy are dropped.
+ * @param ring ring to read
+ * @param out room for STATS_RING_SIZE values
+ * @return number of values copied
+ */
+static int ring_snapshot(const sample_ring *ring, double *out) {
+    unsigned long head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    unsigned long first = head > STATS_RING_SIZE ? head - STATS_RING_SIZE : 0;
+    unsigned long i, end, oldest;
+
+    for (i=first; i<head; i++)
+        out[i - first] = ring->values[i % STATS_RING_SIZE];
+    atomic_thread_fence(memory_order_acquire);
+
+    // the writer may be overwriting the slot after the last one it published
+    end = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    oldest = end + 1 > STATS_RING_SIZE ? end + 1 - STATS_RING_SIZE : 0;
+    if (oldest <= first)
+        return (int)(head - first);
+    if (oldest >= head)
+        return 0;
+    memmove(out, out + (oldest - first), sizeof(double) * (head - oldest));
+    return (int)(head - oldest);
+}
+
+/**
+ * @return the histogram bucket of a time
+ */
+static int bucket_of(double ms) {
+    int i;
+    if (ms <= STATS_FIRST_BUCKET_MS)
+        return 0;
+    i = (int)ceil(log2(ms / STATS_FIRST_BUCKET_MS) * STATS_BUCKETS_PER_OCTAVE);
+    return i < STATS_BUCKETS ? i : STATS_BUCKETS - 1;
+}
+
+/**
+ * @return the upper end of a histogram bucket, in milliseconds
+ */
+static double bucket_limit(int i) {
+    return STATS_FIRST_BUCKET_MS * pow(2, (double)i / STATS_BUCKETS_PER_OCTAVE);
+}
+
+/**
+ * Records a sample of a metric
+ */
+static void record(frame_metric *metric, double ms) {
+    ring_push(&metric->recent, ms);
+    metric->histogram[bucket_of(ms)]++;
+    metric->count++;
+    if (ms > metric->max)
+        metric->max = ms;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Takes percentiles of the recent samples of a metric
+ * @param metric metric to look at
+ * @param p50 set to the median
+ * @param p99 set to the 99th percentile
+ * @return number of samples they were taken over
+ */
+static int recent_percentiles(const frame_metric *metric, double *p50, double *p99) {
+    double values[STATS_RING_SIZE];
+    int n = ring_snapshot(&metric->recent, values);
+
+    if (n == 0)
+        return 0;
+    qsort(values, n, sizeof(double), compare_doubles);
+    *p50 = values[(n - 1) / 2];
+    *p99 = values[(int)ceil(n * 0.99) - 1];
+    return n;
+}
+
+
+/*******************************************************//**
+ * Measuring
+ * ********************************************************/
+
+/**
+ * Starts collecting; the GL context must be current so timer query
+ * support can be checked
+ * @param stats stats to initialize
+ */
+void frame_stats_init(frame_stats *stats) {
+    memset(stats, 0, sizeof(frame_stats));
+
+    // GL 3.3 made timer queries core; older contexts may have either extension
+    if (glfwExtensionSupported("GL_ARB_timer_query"))
+        stats->get_query_result = (void (*)(GLuint, GLenum, uint64_t *))
+                glfwGetProcAddress("glGetQueryObjectui64v");
+    else if (glfwExtensionSupported("GL_EXT_timer_query"))
+        stats->get_query_result = (void (*)(GLuint, GLenum, uint64_t *))
+                glfwGetProcAddress("glGetQueryObjectui64vEXT");
+    if (stats->get_query_result != NULL) {
+        glGenQueries(STATS_GPU_QUERIES, stats->queries);
+        stats->gpu_timing = TRUE;
+    }
+    stats->since = seconds();
+}
+
+/**
+ * Forgets every sample so far, e.g. once loading is over and only the
+ * frames after it should be measured. GPU times of frames begun before the
+ * reset are thrown away when they arrive.
+ * @param stats stats to reset
+ */
+void frame_stats_reset(frame_stats *stats) {
+    memset(&stats->cpu, 0, sizeof(frame_metric));
+    memset(&stats->gpu, 0, sizeof(frame_metric));
+    memset(&stats->latency, 0, sizeof(frame_metric));
+    memset(&stats->interval, 0, sizeof(frame_metric));
+    stats->key_time = 0;
+    stats->last_swap = 0;
+    stats->since = seconds();
+}
+
+/**
+ * Notes a key press; the next swapped frame is the one that shows it
+ * @param stats stats to update
+ */
+void frame_stats_key(frame_stats *stats) {
+    if (stats->key_time == 0)
+        stats->key_time = seconds();
+}
+
+/**
+ * Marks the start of a frame's drawing
+ * @param stats stats to update
+ */
+void frame_stats_begin(frame_stats *stats) {
+    stats->frame_start = seconds();
+    // with every query still in flight this frame goes untimed rather than waiting
+    if (stats->gpu_timing && stats->query_count < STATS_GPU_QUERIES) {
+        int q = (stats->query_first + stats->query_count) % STATS_GPU_QUERIES;
+        glBeginQuery(GL_TIME_ELAPSED, stats->queries[q]);
+        stats->query_start[q] = stats->frame_start;
+        stats->query_active = TRUE;
+    }
+}
+
+/**
+ * Marks the end of a frame's drawing, just before it's swapped
+ * @param stats stats to update
+ */
+void frame_stats_end(frame_stats *stats) {
+    if (stats->frame_start == 0)
+        return;
+    record(&stats->cpu, (seconds() - stats->frame_start) * 1000);
+    stats->frame_start = 0;
+    if (stats->query_active) {
+        glEndQuery(GL_TIME_ELAPSED);
+        stats->query_count++;
+        stats->query_active = FALSE;
+    }
+}
+
+/**
+ * Records that a frame was swapped, and the GPU times of earlier frames
+ * that have become available since
+ * @param stats stats to update
+ */
+void frame_stats_swapped(frame_stats *stats) {
+    double now = seconds();
+
+    ring_push(&stats->swaps, now);
+    if (stats->continuous && stats->last_swap != 0)
+        record(&stats->interval, (now - stats->last_swap) * 1000);
+    stats->last_swap = now;
+    if (stats->key_time != 0) {
+        record(&stats->latency, (now - stats->key_time) * 1000);
+        stats->key_time = 0;
+    }
+
+    while (stats->query_count > 0) {
+        GLuint query = stats->queries[stats->query_first];
+        GLint available = 0;
+        uint64_t elapsed;
+
+        glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available)
+            break;
+        stats->get_query_result(query, GL_QUERY_RESULT, &elapsed);
+        // llvmpipe returns garbage for a query with nothing but a clear in it,
+        // and no frame can take longer on the GPU than it has been around
+        if (elapsed / 1e9 <= now - stats->query_start[stats->query_first] &&
+            stats->query_start[stats->query_first] >= stats->since)
+            record(&stats->gpu, elapsed / 1e6);
+        stats->query_first = (stats->query_first + 1) % STATS_GPU_QUERIES;
+        stats->query_count--;
+    }
+}
+
+
+/*******************************************************//**
+ * Overlay
+ * ********************************************************/
+
+/**
+ * @return frames swapped per second over the last second, 0 if fewer than
+ *         two were
+ */
+static double recent_fps(const frame_stats *stats) {
+    double times[STATS_RING_SIZE];
+    int n = ring_snapshot(&stats->swaps, times);
+    int first = n - 1;
+
+    while (first > 0 && times[n - 1] - times[first - 1] <= 1)
+        first--;
+    if (n - first < 2)
+        return 0;
+    return (n - first - 1) / (times[n - 1] - times[first]);
+}
+
+/**
+ * Formats a line of the overlay for a metric
+ */
+static void format_metric(char *line, const char *label, const frame_metric *metric,
+                          boolean supported) {
+    double p50, p99;
+
+    if (!supported)
+        snprintf(line, OVERLAY_COLUMNS + 1, "%s N/A", label);
+    else if (recent_percentiles(metric, &p50, &p99) == 0)
+        snprintf(line, OVERLAY_COLUMNS + 1, "%s -", label);
+    else
+        snprintf(line, OVERLAY_COLUMNS + 1, "%s P50 %.2f P99 %.2f MS", label, p50, p99);
+}
+
+/**
+ * Draws a character into the overlay's pixels
+ * @param pixels RGBA pixels, bottom row first
+ * @param width pixels per row
+ * @param x left edge of the character
+ * @param y top edge of the character, counted from the bottom row
+ * @param c character to draw
+ */
+static void draw_glyph(unsigned char *pixels, int width, int x, int y, char c) {
+    size_t i;
+    int row, col;
+
+    for (i=0; i<sizeof(font) / sizeof(font[0]); i++) {
+        if (font[i].c != c)
+            continue;
+        for (row=0; row<7 * OVERLAY_SCALE; row++) {
+            for (col=0; col<5 * OVERLAY_SCALE; col++) {
+                unsigned char *p;
+                if (!(font[i].rows[row / OVERLAY_SCALE] & (0x10 >> (col / OVERLAY_SCALE))))
+                    continue;
+                p = pixels + ((size_t)(y - row) * width + x + col) * 4;
+                p[0] = p[1] = p[2] = p[3] = 255;
+            }
+        }
+        return;
+    }
+}
+
+/**
+ * Draws the frame rate and the recent frame and key latency percentiles in
+ * the top left corner of the frame being drawn. Goes between
+ * frame_stats_end() and the swap, so it isn't counted in the frame's time.
+ * @param stats stats to show
+ * @param height height of the window's framebuffer
+ */
+void frame_stats_draw_overlay(frame_stats *stats, int height) {
+    char lines[OVERLAY_LINES][OVERLAY_COLUMNS + 1];
+    int cell_width = 6 * OVERLAY_SCALE, cell_height = 9 * OVERLAY_SCALE;
+    int columns = 0, box_width, box_height, size;
+    double fps = recent_fps(stats);
+    GLint program;
+    GLboolean blend;
+    int i, j;
+
+    if (fps > 0)
+        snprintf(lines[0], OVERLAY_COLUMNS + 1, "FPS %.1f", fps);
+    else
+        snprintf(lines[0], OVERLAY_COLUMNS + 1, "FPS -");
+    format_metric(lines[1], "CPU", &stats->cpu, TRUE);
+    format_metric(lines[2], "GPU", &stats->gpu, stats->gpu_timing);
+    format_metric(lines[3], "KEY", &stats->latency, TRUE);
+    for (i=0; i<OVERLAY_LINES; i++) {
+        int length = (int)strlen(lines[i]);
+        if (length > columns)
+            columns = length;
+    }
+
+    box_width = columns * cell_width + 2 * OVERLAY_MARGIN;
+    box_height = OVERLAY_LINES * cell_height + 2 * OVERLAY_MARGIN;
+    size = box_width * box_height * 4;
+    if (size > stats->overlay_size) {
+        unsigned char *grown = realloc(stats->overlay, size);
+        if (grown == NULL)
+            return;
+        stats->overlay = grown;
+        stats->overlay_size = size;
+    }
+    // a translucent backing keeps the text readable over any image
+    for (i=0; i<box_width * box_height; i++) {
+        stats->overlay[i * 4] = stats->overlay[i * 4 + 1] = stats->overlay[i * 4 + 2] = 0;
+        stats->overlay[i * 4 + 3] = 160;
+    }
+    for (i=0; i<OVERLAY_LINES; i++) {
+        int top = box_height - 1 - OVERLAY_MARGIN - i * cell_height;
+        for (j=0; lines[i][j] != '\0'; j++)
+            draw_glyph(stats->overlay, box_width, OVERLAY_MARGIN + j * cell_width, top,
+                       lines[i][j]);
+    }
+
+    // pixels go through the fragment shader, so it's set aside meanwhile
+    glGetIntegerv(GL_CURRENT_PROGRAM, &program);
+    blend = glIsEnabled(GL_BLEND);
+    glUseProgram(0);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glWindowPos2i(OVERLAY_MARGIN, height - box_height - OVERLAY_MARGIN);
+    glDrawPixels(box_width, box_height, GL_RGBA, GL_UNSIGNED_BYTE, stats->overlay);
+    if (!blend)
+        glDisable(GL_BLEND);
+    glUseProgram(program);
+}
+
+
+/*******************************************************//**
+ * Report
+ * ********************************************************/
+
+/**
+ * Prints the histogram of a metric with its percentiles
+ */
+static void print_metric(const char *title, const frame_metric *metric) {
+    unsigned long most = 0, seen = 0;
+    double p50 = 0, p90 = 0, p99 = 0;
+    int first = -1, last = 0;
+    int i;
+
+    if (metric->count == 0)
+        return;
+    for (i=0; i<STATS_BUCKETS; i++) {
+        unsigned long n = metric->histogram[i];
+        if (n == 0)
+            continue;
+        if (first < 0)
+            first = i;
+        last = i;
+        if (n > most)
+            most = n;
+        // a percentile is reported as the top of the bucket it falls in
+        seen += n;
+        if (p50 == 0 && seen * 2 >= metric->count)
+            p50 = bucket_limit(i);
+        if (p90 == 0 && seen * 10 >= metric->count * 9)
+            p90 = bucket_limit(i);
+        if (p99 == 0 && seen * 100 >= metric->count * 99)
+            p99 = bucket_limit(i);
+    }
+    printf("%s: %lu samples, p50 <= %.3f ms, p90 <= %.3f ms, p99 <= %.3f ms, max %.3f ms\n",
+           title, metric->count, fmin(p50, metric->max), fmin(p90, metric->max),
+           fmin(p99, metric->max), metric->max);
+    for (i=first; i<=last; i++) {
+        int bar;
+        if (metric->histogram[i] == 0)
+            continue;
+        bar = (int)((metric->histogram[i] * HISTOGRAM_BAR + most - 1) / most);
+        printf("  %9.3f - %9.3f ms %8lu %.*s\n", i > 0 ? bucket_limit(i - 1) : 0.0,
+               bucket_limit(i), metric->histogram[i], bar,
+               "########################################");
+    }
+}
+
+/**
+ * Prints histograms of every frame's CPU and GPU times and of key latency,
+ * and of the time between frames when they were drawn continuously
+ * @param stats stats to print
+ */
+void frame_stats_print(frame_stats *stats) {
+    print_metric("Frame CPU time", &stats->cpu);
+    if (stats->gpu_timing)
+        print_metric("Frame GPU time", &stats->gpu);
+    else
+        printf("Frame GPU time: timer queries aren't supported\n");
+    print_metric("Key to swap latency", &stats->latency);
+    print_metric("Frame interval", &stats->interval);
+}
+
+/**
+ * Releases the timer queries and the overlay
+ * @param stats stats to free
+ */
+void frame_stats_free(frame_stats *stats) {
+    if (stats->gpu_timing)
+        glDeleteQueries(STATS_GPU_QUERIES, stats->queries);
+    free(stats->overlay);
+    stats->overlay = NULL;
+    stats->overlay_size = 0;
+}
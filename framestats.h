@@ -0,0 +1,71 @@
+/* framestats header file - frame times and input latency, with an overlay to show them */
+#ifndef FRAMESTATS_H
+#define FRAMESTATS_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include "glinclude.h"
+#include <GLFW/glfw3.h>
+
+#include "ppmrw.h"
+
+// recent samples the overlay's percentiles are taken over; a power of two
+#define STATS_RING_SIZE 512
+// histogram buckets, STATS_BUCKETS_PER_OCTAVE to each doubling of the time
+#define STATS_BUCKETS 64
+#define STATS_BUCKETS_PER_OCTAVE 4
+// upper end of the first bucket, in milliseconds
+#define STATS_FIRST_BUCKET_MS 0.0625
+// GPU timer queries in flight; results are picked up a few frames late
+#define STATS_GPU_QUERIES 4
+
+// last STATS_RING_SIZE values pushed, written by one thread and readable
+// from any without a lock
+typedef struct sample_ring_t {
+    double values[STATS_RING_SIZE];
+    atomic_ulong head;          // values pushed so far
+} sample_ring;
+
+// one thing being measured
+typedef struct frame_metric_t {
+    sample_ring recent;
+    unsigned long histogram[STATS_BUCKETS];     // every sample since the start
+    unsigned long count;
+    double max;
+} frame_metric;
+
+// what it costs to draw frames and how long a key press takes to show
+typedef struct frame_stats_t {
+    frame_metric cpu;           // from the start of a frame until it's handed to swap, ms
+    frame_metric gpu;           // GL_TIME_ELAPSED of the frame's commands, ms
+    frame_metric latency;       // from a key press until the frame after it was swapped, ms
+    frame_metric interval;      // between consecutive swaps when continuous, ms
+    sample_ring swaps;          // when frames were swapped, in seconds
+    boolean continuous;         // frames are drawn back to back, so the time
+                                // between swaps is how long a frame takes
+    double last_swap;           // when the last frame was swapped, 0 before any
+    double since;               // when the metrics were last reset
+    double frame_start;         // when the frame being drawn was started, 0 between frames
+    double key_time;            // first key press not on screen yet, 0 if none
+    boolean gpu_timing;         // timer queries are supported
+    GLuint queries[STATS_GPU_QUERIES];
+    double query_start[STATS_GPU_QUERIES];  // when each query was begun, in seconds
+    int query_first;            // oldest query in flight
+    int query_count;            // queries in flight
+    boolean query_active;       // a query was begun for the current frame
+    void (*get_query_result)(GLuint id, GLenum pname, uint64_t *result);
+    unsigned char *overlay;     // RGBA pixels of the overlay
+    int overlay_size;           // bytes allocated at overlay
+} frame_stats;
+
+void frame_stats_init(frame_stats *stats);
+void frame_stats_reset(frame_stats *stats);
+void frame_stats_key(frame_stats *stats);
+void frame_stats_begin(frame_stats *stats);
+void frame_stats_end(frame_stats *stats);
+void frame_stats_swapped(frame_stats *stats);
+void frame_stats_draw_overlay(frame_stats *stats, int height);
+void frame_stats_print(frame_stats *stats);
+void frame_stats_free(frame_stats *stats);
+
+#endif
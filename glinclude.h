@@ -0,0 +1,15 @@
+/* glinclude header file - the GL headers of the platform */
+#ifndef GLINCLUDE_H
+#define GLINCLUDE_H
+
+#ifdef __APPLE__
+#include <OpenGL/gl.h>
+#else
+// framebuffer objects, timer queries and the rest of GL past 1.1 are only
+// declared by glext.h, and only with prototypes asked for
+#define GL_GLEXT_PROTOTYPES
+#include <GL/gl.h>
+#include <GL/glext.h>
+#endif
+
+#endif
@@ -0,0 +1,259 @@
+/** linmath_bench - compares the matsimd kernels with the scalar linmath functions
+ * usage: linmath_bench [iterations]
+ *
+ * Times mat4x4_mul, mat4x4_mul_vec4, mat4x4_invert and transforming a
+ * batch of points, each with linmath.h and with the kernels picked for
+ * this CPU, checks that both give the same results, and times composing
+ * the view from scratch every frame against the cached view_transform.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "linmath.h"
+#include "matsimd.h"
+#include "transform.h"
+
+#define DEFAULT_ITERATIONS 2000000
+// matrices and vectors cycled through, so each call gets different input
+#define SET_SIZE 256
+// points transformed in one batch
+#define BATCH_POINTS 4096
+
+static mat4x4 matrices[SET_SIZE];
+static vec4 vectors[SET_SIZE];
+static vec4 points[BATCH_POINTS], scalar_out[BATCH_POINTS], simd_out[BATCH_POINTS];
+// results are added up here so the compiler can't skip the work
+static volatile float sink;
+
+/**
+ * @return a monotonic timestamp in seconds
+ */
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @return a random float in [-1, 1]
+ */
+static float random_float(void) {
+    return rand() / (float)RAND_MAX * 2 - 1;
+}
+
+/**
+ * Fills the inputs with random values; the matrices are diagonally
+ * dominant so they can be inverted accurately
+ */
+static void make_inputs(void) {
+    int i, c, r;
+    srand(430);
+    for (i=0; i<SET_SIZE; i++) {
+        for (c=0; c<4; c++) {
+            for (r=0; r<4; r++) {
+                matrices[i][c][r] = random_float() + (c == r ? 4 : 0);
+            }
+            vectors[i][c] = random_float();
+        }
+    }
+    for (i=0; i<BATCH_POINTS; i++) {
+        points[i][0] = random_float();
+        points[i][1] = random_float();
+        points[i][2] = 0;
+        points[i][3] = 1;
+    }
+}
+
+/**
+ * Prints a row of the report
+ * @param name operation
+ * @param scalar seconds per call with linmath.h
+ * @param simd seconds per call with the kernels
+ * @param check what comparing the results found
+ */
+static void report(const char *name, double scalar, double simd, const char *check) {
+    printf("%-18s %9.2f ns %9.2f ns %6.2fx  %s\n", name, scalar * 1e9, simd * 1e9,
+           simd > 0 ? scalar / simd : 0, check);
+}
+
+static void bench_mul(long iterations) {
+    mat4x4 m;
+    double start, scalar, simd;
+    long i;
+    int same = 1;
+
+    for (i=0; i<SET_SIZE; i++) {
+        mat4x4 a, b;
+        mat4x4_mul(a, matrices[i], matrices[(i + 1) % SET_SIZE]);
+        mat4x4_mul_simd(b, matrices[i], matrices[(i + 1) % SET_SIZE]);
+        same &= memcmp(a, b, sizeof(mat4x4)) == 0;
+    }
+
+    start = now();
+    for (i=0; i<iterations; i++) {
+        mat4x4_mul(m, matrices[i % SET_SIZE], matrices[(i + 1) % SET_SIZE]);
+        sink += m[3][3];
+    }
+    scalar = (now() - start) / iterations;
+    start = now();
+    for (i=0; i<iterations; i++) {
+        mat4x4_mul_simd(m, matrices[i % SET_SIZE], matrices[(i + 1) % SET_SIZE]);
+        sink += m[3][3];
+    }
+    simd = (now() - start) / iterations;
+    report("mat4x4_mul", scalar, simd, same ? "identical" : "DIFFERENT");
+}
+
+static void bench_mul_vec4(long iterations) {
+    vec4 r;
+    double start, scalar, simd;
+    long i;
+    int same = 1;
+
+    for (i=0; i<SET_SIZE; i++) {
+        vec4 a, b;
+        mat4x4_mul_vec4(a, matrices[i], vectors[i]);
+        mat4x4_mul_vec4_simd(b, matrices[i], vectors[i]);
+        same &= memcmp(a, b, sizeof(vec4)) == 0;
+    }
+
+    start = now();
+    for (i=0; i<iterations; i++) {
+        mat4x4_mul_vec4(r, matrices[i % SET_SIZE], vectors[(i + 1) % SET_SIZE]);
+        sink += r[3];
+    }
+    scalar = (now() - start) / iterations;
+    start = now();
+    for (i=0; i<iterations; i++) {
+        mat4x4_mul_vec4_simd(r, matrices[i % SET_SIZE], vectors[(i + 1) % SET_SIZE]);
+        sink += r[3];
+    }
+    simd = (now() - start) / iterations;
+    report("mat4x4_mul_vec4", scalar, simd, same ? "identical" : "DIFFERENT");
+}
+
+static void bench_invert(long iterations) {
+    mat4x4 m;
+    double start, scalar, simd, worst = 0;
+    char check[64];
+    long i;
+    int c, r;
+
+    // how far each inverse is from the scalar one, relative to its largest element
+    for (i=0; i<SET_SIZE; i++) {
+        mat4x4 a, b;
+        double largest = 0, error = 0;
+        mat4x4_invert(a, matrices[i]);
+        mat4x4_invert_simd(b, matrices[i]);
+        for (c=0; c<4; c++) {
+            for (r=0; r<4; r++) {
+                largest = fmax(largest, fabs(a[c][r]));
+                error = fmax(error, fabs(a[c][r] - b[c][r]));
+            }
+        }
+        worst = fmax(worst, error / largest);
+    }
+    snprintf(check, sizeof(check), "relative error <= %.1e", worst);
+
+    start = now();
+    for (i=0; i<iterations; i++) {
+        mat4x4_invert(m, matrices[i % SET_SIZE]);
+        sink += m[3][3];
+    }
+    scalar = (now() - start) / iterations;
+    start = now();
+    for (i=0; i<iterations; i++) {
+        mat4x4_invert_simd(m, matrices[i % SET_SIZE]);
+        sink += m[3][3];
+    }
+    simd = (now() - start) / iterations;
+    report("mat4x4_invert", scalar, simd, check);
+}
+
+static void bench_transform_points(long iterations) {
+    long batches = iterations / BATCH_POINTS > 0 ? iterations / BATCH_POINTS : 1;
+    double start, scalar, simd;
+    long i, j;
+
+    start = now();
+    for (i=0; i<batches; i++) {
+        for (j=0; j<BATCH_POINTS; j++) {
+            mat4x4_mul_vec4(scalar_out[j], matrices[i % SET_SIZE], points[j]);
+        }
+        sink += scalar_out[i % BATCH_POINTS][0];
+    }
+    scalar = (now() - start) / (batches * BATCH_POINTS);
+    start = now();
+    for (i=0; i<batches; i++) {
+        mat4x4_transform_points(simd_out, matrices[i % SET_SIZE], (const vec4 *)points,
+                                BATCH_POINTS);
+        sink += simd_out[i % BATCH_POINTS][0];
+    }
+    simd = (now() - start) / (batches * BATCH_POINTS);
+    // the last batch of each used the same matrix
+    report("transform point", scalar, simd,
+           memcmp(scalar_out, simd_out, sizeof(scalar_out)) == 0 ? "identical" : "DIFFERENT");
+}
+
+/**
+ * Times building the view for a frame, from scratch as every frame used
+ * to and with view_transform, when only the translation changes (panning)
+ * and when nothing does
+ */
+static void bench_view(long iterations) {
+    view_transform view;
+    view_params params = { 0.3f, 0.1f, -0.2f, 0.75f, 0, 0, 0.05f, 0 };
+    mat4x4 a, b;
+    double start, scalar, panning, still;
+    long i;
+    int same = 1;
+
+    view_transform_init(&view);
+    start = now();
+    for (i=0; i<iterations; i++) {
+        params.x_pos = (float)(i % SET_SIZE) / SET_SIZE;
+        compose_view(&params, a);
+        sink += a[3][0];
+    }
+    scalar = (now() - start) / iterations;
+    start = now();
+    for (i=0; i<iterations; i++) {
+        params.x_pos = (float)(i % SET_SIZE) / SET_SIZE;
+        view_transform_set(&view, &params);
+        view_transform_get(&view, b);
+        sink += b[3][0];
+    }
+    panning = (now() - start) / iterations;
+    same &= memcmp(a, b, sizeof(mat4x4)) == 0;
+    start = now();
+    for (i=0; i<iterations; i++) {
+        view_transform_set(&view, &params);
+        view_transform_get(&view, b);
+        sink += b[3][0];
+    }
+    still = (now() - start) / iterations;
+
+    report("view, panning", scalar, panning, same ? "identical" : "DIFFERENT");
+    report("view, unchanged", scalar, still, "");
+}
+
+int main(int argc, char *argv[]) {
+    long iterations = argc > 1 ? atol(argv[1]) : DEFAULT_ITERATIONS;
+
+    if (iterations <= 0) {
+        fprintf(stderr, "Error: main: iterations must be a positive number\n");
+        return 1;
+    }
+    make_inputs();
+    printf("%s kernels, %ld iterations\n", matsimd_kernel_name(), iterations);
+    printf("%-18s %12s %12s %7s\n", "", "linmath.h", "matsimd", "speedup");
+    bench_mul(iterations);
+    bench_mul_vec4(iterations);
+    bench_invert(iterations);
+    bench_transform_points(iterations);
+    bench_view(iterations);
+    return 0;
+}
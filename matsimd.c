@@ -0,0 +1,282 @@
+/** matsimd - vectorized versions of the linmath matrix functions
+ * linmath.h works an element at a time. Its matrices are column major, so
+ * a column is one SSE register and a matrix times a vector is the sum of
+ * the columns, each scaled by one element of the vector. Every kernel has
+ * a scalar version that calls linmath plus SSE2 and, for the ones that
+ * work on several columns or points at once, AVX versions on x86. The best
+ * version for the running CPU is picked the first time a kernel is called.
+ */
+
+#include <string.h>
+#include <pthread.h>
+#include "matsimd.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MAT_X86 1
+#include <immintrin.h>
+#endif
+
+typedef void (*mul_fn)(mat4x4, mat4x4, mat4x4);
+typedef void (*mul_vec4_fn)(vec4, mat4x4, vec4);
+typedef void (*invert_fn)(mat4x4, mat4x4);
+typedef void (*transform_points_fn)(vec4 *, mat4x4, const vec4 *, size_t);
+
+// the implementations picked for the running CPU
+typedef struct kernels_t {
+    mul_fn mul;
+    mul_vec4_fn mul_vec4;
+    invert_fn invert;
+    transform_points_fn transform_points;
+    const char *name;
+} kernels;
+
+
+/*******************************************************//**
+ * Scalar kernels
+ * ********************************************************/
+
+static void mul_scalar(mat4x4 M, mat4x4 a, mat4x4 b) {
+    mat4x4_mul(M, a, b);
+}
+
+static void mul_vec4_scalar(vec4 r, mat4x4 M, vec4 v) {
+    mat4x4_mul_vec4(r, M, v);
+}
+
+static void invert_scalar(mat4x4 T, mat4x4 M) {
+    mat4x4 inverse;
+    mat4x4_invert(inverse, M);
+    mat4x4_dup(T, inverse);
+}
+
+static void transform_points_scalar(vec4 *out, mat4x4 M, const vec4 *in, size_t count) {
+    size_t i;
+    for (i=0; i<count; i++) {
+        vec4 p;
+        memcpy(p, in[i], sizeof(vec4));
+        mat4x4_mul_vec4(out[i], M, p);
+    }
+}
+
+#ifdef MAT_X86
+
+/*******************************************************//**
+ * SSE2 kernels
+ * ********************************************************/
+
+#define SHUFFLE(x, y, z, w) ((x) | ((y) << 2) | ((z) << 4) | ((w) << 6))
+#define SWIZZLE(v, x, y, z, w) _mm_shuffle_ps(v, v, SHUFFLE(x, y, z, w))
+
+/**
+ * @return c0 * v[0] + c1 * v[1] + c2 * v[2] + c3 * v[3], summed in the
+ *         order mat4x4_mul_vec4() sums them
+ */
+__attribute__((target("sse2")))
+static inline __m128 combine_sse2(__m128 c0, __m128 c1, __m128 c2, __m128 c3, __m128 v) {
+    __m128 r = _mm_mul_ps(c0, SWIZZLE(v, 0, 0, 0, 0));
+    r = _mm_add_ps(r, _mm_mul_ps(c1, SWIZZLE(v, 1, 1, 1, 1)));
+    r = _mm_add_ps(r, _mm_mul_ps(c2, SWIZZLE(v, 2, 2, 2, 2)));
+    return _mm_add_ps(r, _mm_mul_ps(c3, SWIZZLE(v, 3, 3, 3, 3)));
+}
+
+__attribute__((target("sse2")))
+static void mul_sse2(mat4x4 M, mat4x4 a, mat4x4 b) {
+    __m128 a0 = _mm_loadu_ps(a[0]), a1 = _mm_loadu_ps(a[1]);
+    __m128 a2 = _mm_loadu_ps(a[2]), a3 = _mm_loadu_ps(a[3]);
+    __m128 r0 = combine_sse2(a0, a1, a2, a3, _mm_loadu_ps(b[0]));
+    __m128 r1 = combine_sse2(a0, a1, a2, a3, _mm_loadu_ps(b[1]));
+    __m128 r2 = combine_sse2(a0, a1, a2, a3, _mm_loadu_ps(b[2]));
+    __m128 r3 = combine_sse2(a0, a1, a2, a3, _mm_loadu_ps(b[3]));
+    // all of b is read before M is written, so M may be b
+    _mm_storeu_ps(M[0], r0);
+    _mm_storeu_ps(M[1], r1);
+    _mm_storeu_ps(M[2], r2);
+    _mm_storeu_ps(M[3], r3);
+}
+
+__attribute__((target("sse2")))
+static void mul_vec4_sse2(vec4 r, mat4x4 M, vec4 v) {
+    _mm_storeu_ps(r, combine_sse2(_mm_loadu_ps(M[0]), _mm_loadu_ps(M[1]),
+                                  _mm_loadu_ps(M[2]), _mm_loadu_ps(M[3]), _mm_loadu_ps(v)));
+}
+
+/**
+ * Products of 2x2 matrices held row by row in a register: a * b, a# * b
+ * and a * b#, where # is the adjugate
+ */
+__attribute__((target("sse2")))
+static inline __m128 mat2_mul(__m128 a, __m128 b) {
+    return _mm_add_ps(_mm_mul_ps(a, SWIZZLE(b, 0, 3, 0, 3)),
+                      _mm_mul_ps(SWIZZLE(a, 1, 0, 3, 2), SWIZZLE(b, 2, 1, 2, 1)));
+}
+
+__attribute__((target("sse2")))
+static inline __m128 mat2_adj_mul(__m128 a, __m128 b) {
+    return _mm_sub_ps(_mm_mul_ps(SWIZZLE(a, 3, 3, 0, 0), b),
+                      _mm_mul_ps(SWIZZLE(a, 1, 1, 2, 2), SWIZZLE(b, 2, 3, 0, 1)));
+}
+
+__attribute__((target("sse2")))
+static inline __m128 mat2_mul_adj(__m128 a, __m128 b) {
+    return _mm_sub_ps(_mm_mul_ps(a, SWIZZLE(b, 3, 0, 3, 0)),
+                      _mm_mul_ps(SWIZZLE(a, 1, 0, 3, 2), SWIZZLE(b, 2, 1, 2, 1)));
+}
+
+/**
+ * Inverts blockwise: with M split into 2x2 blocks A B / C D, each block of
+ * the inverse is a 2x2 expression of them over det(M). The inverse of the
+ * transpose is the transpose of the inverse, so this works the same on
+ * columns as on rows.
+ */
+__attribute__((target("sse2")))
+static void invert_sse2(mat4x4 T, mat4x4 M) {
+    const __m128 sign = _mm_setr_ps(1.f, -1.f, -1.f, 1.f);
+    __m128 m0 = _mm_loadu_ps(M[0]), m1 = _mm_loadu_ps(M[1]);
+    __m128 m2 = _mm_loadu_ps(M[2]), m3 = _mm_loadu_ps(M[3]);
+    __m128 A = _mm_movelh_ps(m0, m1), B = _mm_movehl_ps(m1, m0);
+    __m128 C = _mm_movelh_ps(m2, m3), D = _mm_movehl_ps(m3, m2);
+    __m128 det_sub, det_a, det_b, det_c, det_d, det_m, d_c, a_b, x, y, z, w, trace, scale;
+
+    // determinants of A, B, C and D
+    det_sub = _mm_sub_ps(_mm_mul_ps(_mm_shuffle_ps(m0, m2, SHUFFLE(0, 2, 0, 2)),
+                                    _mm_shuffle_ps(m1, m3, SHUFFLE(1, 3, 1, 3))),
+                         _mm_mul_ps(_mm_shuffle_ps(m0, m2, SHUFFLE(1, 3, 1, 3)),
+                                    _mm_shuffle_ps(m1, m3, SHUFFLE(0, 2, 0, 2))));
+    det_a = SWIZZLE(det_sub, 0, 0, 0, 0);
+    det_b = SWIZZLE(det_sub, 1, 1, 1, 1);
+    det_c = SWIZZLE(det_sub, 2, 2, 2, 2);
+    det_d = SWIZZLE(det_sub, 3, 3, 3, 3);
+
+    // adjugates of the inverse's blocks, before dividing by det(M)
+    d_c = mat2_adj_mul(D, C);
+    a_b = mat2_adj_mul(A, B);
+    x = _mm_sub_ps(_mm_mul_ps(det_d, A), mat2_mul(B, d_c));
+    w = _mm_sub_ps(_mm_mul_ps(det_a, D), mat2_mul(C, a_b));
+    y = _mm_sub_ps(_mm_mul_ps(det_b, C), mat2_mul_adj(D, a_b));
+    z = _mm_sub_ps(_mm_mul_ps(det_c, B), mat2_mul_adj(A, d_c));
+
+    // det(M) = det(A) det(D) + det(B) det(C) - trace((A# B)(D# C))
+    trace = _mm_mul_ps(a_b, SWIZZLE(d_c, 0, 2, 1, 3));
+    trace = _mm_add_ps(trace, _mm_movehl_ps(trace, trace));
+    trace = _mm_add_ss(trace, SWIZZLE(trace, 1, 1, 1, 1));
+    trace = SWIZZLE(trace, 0, 0, 0, 0);
+    det_m = _mm_sub_ps(_mm_add_ps(_mm_mul_ps(det_a, det_d), _mm_mul_ps(det_b, det_c)), trace);
+
+    // the signs turn the blocks' adjugates back into the blocks
+    scale = _mm_div_ps(sign, det_m);
+    x = _mm_mul_ps(x, scale);
+    y = _mm_mul_ps(y, scale);
+    z = _mm_mul_ps(z, scale);
+    w = _mm_mul_ps(w, scale);
+    _mm_storeu_ps(T[0], _mm_shuffle_ps(x, y, SHUFFLE(3, 1, 3, 1)));
+    _mm_storeu_ps(T[1], _mm_shuffle_ps(x, y, SHUFFLE(2, 0, 2, 0)));
+    _mm_storeu_ps(T[2], _mm_shuffle_ps(z, w, SHUFFLE(3, 1, 3, 1)));
+    _mm_storeu_ps(T[3], _mm_shuffle_ps(z, w, SHUFFLE(2, 0, 2, 0)));
+}
+
+__attribute__((target("sse2")))
+static void transform_points_sse2(vec4 *out, mat4x4 M, const vec4 *in, size_t count) {
+    __m128 m0 = _mm_loadu_ps(M[0]), m1 = _mm_loadu_ps(M[1]);
+    __m128 m2 = _mm_loadu_ps(M[2]), m3 = _mm_loadu_ps(M[3]);
+    size_t i;
+    for (i=0; i<count; i++) {
+        _mm_storeu_ps(out[i], combine_sse2(m0, m1, m2, m3, _mm_loadu_ps(in[i])));
+    }
+}
+
+
+/*******************************************************//**
+ * AVX kernels
+ * ********************************************************/
+
+/**
+ * Two columns (or points) at once: the matrix's columns are repeated in
+ * both halves of a register and each half is scaled by its own vector
+ */
+__attribute__((target("avx")))
+static inline __m256 combine_avx(__m256 c0, __m256 c1, __m256 c2, __m256 c3, __m256 v) {
+    __m256 r = _mm256_mul_ps(c0, _mm256_shuffle_ps(v, v, SHUFFLE(0, 0, 0, 0)));
+    r = _mm256_add_ps(r, _mm256_mul_ps(c1, _mm256_shuffle_ps(v, v, SHUFFLE(1, 1, 1, 1))));
+    r = _mm256_add_ps(r, _mm256_mul_ps(c2, _mm256_shuffle_ps(v, v, SHUFFLE(2, 2, 2, 2))));
+    return _mm256_add_ps(r, _mm256_mul_ps(c3, _mm256_shuffle_ps(v, v, SHUFFLE(3, 3, 3, 3))));
+}
+
+__attribute__((target("avx")))
+static void mul_avx(mat4x4 M, mat4x4 a, mat4x4 b) {
+    __m256 a0 = _mm256_broadcast_ps((const __m128 *)a[0]);
+    __m256 a1 = _mm256_broadcast_ps((const __m128 *)a[1]);
+    __m256 a2 = _mm256_broadcast_ps((const __m128 *)a[2]);
+    __m256 a3 = _mm256_broadcast_ps((const __m128 *)a[3]);
+    __m256 r01 = combine_avx(a0, a1, a2, a3, _mm256_loadu_ps(b[0]));
+    __m256 r23 = combine_avx(a0, a1, a2, a3, _mm256_loadu_ps(b[2]));
+    _mm256_storeu_ps(M[0], r01);
+    _mm256_storeu_ps(M[2], r23);
+}
+
+__attribute__((target("avx")))
+static void transform_points_avx(vec4 *out, mat4x4 M, const vec4 *in, size_t count) {
+    __m256 m0 = _mm256_broadcast_ps((const __m128 *)M[0]);
+    __m256 m1 = _mm256_broadcast_ps((const __m128 *)M[1]);
+    __m256 m2 = _mm256_broadcast_ps((const __m128 *)M[2]);
+    __m256 m3 = _mm256_broadcast_ps((const __m128 *)M[3]);
+    size_t i;
+    for (i=0; i+2<=count; i+=2) {
+        _mm256_storeu_ps(out[i], combine_avx(m0, m1, m2, m3, _mm256_loadu_ps(in[i])));
+    }
+    if (i < count) {
+        transform_points_sse2(out + i, M, in + i, count - i);
+    }
+}
+
+#endif
+
+static kernels active;
+static pthread_once_t resolve_once = PTHREAD_ONCE_INIT;
+
+static void resolve_kernels(void) {
+    active.mul = mul_scalar;
+    active.mul_vec4 = mul_vec4_scalar;
+    active.invert = invert_scalar;
+    active.transform_points = transform_points_scalar;
+    active.name = "scalar";
+#ifdef MAT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        active.mul = mul_sse2;
+        active.mul_vec4 = mul_vec4_sse2;
+        active.invert = invert_sse2;
+        active.transform_points = transform_points_sse2;
+        active.name = "sse2";
+    }
+    if (__builtin_cpu_supports("avx")) {
+        active.mul = mul_avx;
+        active.transform_points = transform_points_avx;
+        active.name = "avx";
+    }
+#endif
+}
+
+static const kernels *get_kernels(void) {
+    pthread_once(&resolve_once, resolve_kernels);
+    return &active;
+}
+
+void mat4x4_mul_simd(mat4x4 M, mat4x4 a, mat4x4 b) {
+    get_kernels()->mul(M, a, b);
+}
+
+void mat4x4_mul_vec4_simd(vec4 r, mat4x4 M, vec4 v) {
+    get_kernels()->mul_vec4(r, M, v);
+}
+
+void mat4x4_invert_simd(mat4x4 T, mat4x4 M) {
+    get_kernels()->invert(T, M);
+}
+
+void mat4x4_transform_points(vec4 *out, mat4x4 M, const vec4 *in, size_t count) {
+    get_kernels()->transform_points(out, M, in, count);
+}
+
+const char *matsimd_kernel_name(void) {
+    return get_kernels()->name;
+}
@@ -0,0 +1,51 @@
+/* matsimd header file - vectorized versions of the linmath matrix functions */
+#ifndef MATSIMD_H
+#define MATSIMD_H
+
+#include <stddef.h>
+#include "linmath.h"
+
+/**
+ * Same as mat4x4_mul(): M = a * b. M may be a or b. The sums are taken in
+ * the same order as mat4x4_mul(), so the results are identical.
+ * @param M product
+ * @param a left matrix
+ * @param b right matrix
+ */
+void mat4x4_mul_simd(mat4x4 M, mat4x4 a, mat4x4 b);
+
+/**
+ * Same as mat4x4_mul_vec4(): r = M * v, with identical results. r must
+ * not be v.
+ * @param r product
+ * @param M matrix
+ * @param v vector
+ */
+void mat4x4_mul_vec4_simd(vec4 r, mat4x4 M, vec4 v);
+
+/**
+ * Same as mat4x4_invert(): T = M^-1, computed from 2x2 blocks rather than
+ * cofactors, so results can differ from mat4x4_invert() in the last bits.
+ * Like it, assumes M is invertible. T may be M.
+ * @param T inverse
+ * @param M matrix to invert
+ */
+void mat4x4_invert_simd(mat4x4 T, mat4x4 M);
+
+/**
+ * Multiplies many points by the same matrix, out[i] = M * in[i], with
+ * results identical to mat4x4_mul_vec4(). out may be in.
+ * @param out count transformed points
+ * @param M matrix
+ * @param in count points
+ * @param count number of points
+ */
+void mat4x4_transform_points(vec4 *out, mat4x4 M, const vec4 *in, size_t count);
+
+/**
+ * @return name of the instruction set the kernels were picked for:
+ *         "avx", "sse2" or "scalar"
+ */
+const char *matsimd_kernel_name(void);
+
+#endif
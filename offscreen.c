@@ -0,0 +1,131 @@
+/** offscreen - a GL context without a display
+ * Frames are rendered into a framebuffer object and read back, so batches
+ * of images can be drawn the way the viewer shows them on machines with no
+ * window system. On Linux the context comes from Mesa's surfaceless EGL
+ * platform (llvmpipe when there's no GPU). macOS has no EGL, so a hidden
+ * GLFW window provides it there. The context and framebuffer object are
+ * made once and reused for every frame; the renderbuffer is only
+ * reallocated when the frame size changes.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "offscreen.h"
+#include "trace.h"
+
+/**
+ * Creates the context and its framebuffer object and makes them current
+ * @param off offscreen context to initialize
+ * @return 0 on success, -1 on error
+ */
+int offscreen_init(offscreen *off) {
+    memset(off, 0, sizeof(offscreen));
+
+#ifdef __linux__
+    PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+            (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+
+    // surfaceless needs no X or Wayland; fall back to whatever EGL offers
+    off->display = EGL_NO_DISPLAY;
+    if (get_platform_display != NULL)
+        off->display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY,
+                                            NULL);
+    if (off->display == EGL_NO_DISPLAY)
+        off->display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if (off->display == EGL_NO_DISPLAY || !eglInitialize(off->display, NULL, NULL) ||
+        !eglBindAPI(EGL_OPENGL_API)) {
+        fprintf(stderr, "Error: offscreen_init: No EGL display with desktop OpenGL\n");
+        return -1;
+    }
+    // without a surface there's nothing for a config to describe
+    off->context = eglCreateContext(off->display, (EGLConfig)0, EGL_NO_CONTEXT, NULL);
+    if (off->context == EGL_NO_CONTEXT ||
+        !eglMakeCurrent(off->display, EGL_NO_SURFACE, EGL_NO_SURFACE, off->context)) {
+        fprintf(stderr, "Error: offscreen_init: Unable to create a surfaceless context\n");
+        if (off->context != EGL_NO_CONTEXT)
+            eglDestroyContext(off->display, off->context);
+        eglTerminate(off->display);
+        return -1;
+    }
+#else
+    if (!glfwInit()) {
+        fprintf(stderr, "Error: offscreen_init: Unable to initialize GLFW\n");
+        return -1;
+    }
+    glfwDefaultWindowHints();
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 2);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 0);
+    off->window = glfwCreateWindow(16, 16, "ezview", NULL, NULL);
+    if (off->window == NULL) {
+        fprintf(stderr, "Error: offscreen_init: Unable to create a context\n");
+        glfwTerminate();
+        return -1;
+    }
+    glfwMakeContextCurrent(off->window);
+#endif
+
+    glGenFramebuffers(1, &off->fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, off->fbo);
+    glGenRenderbuffers(1, &off->color);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    return 0;
+}
+
+/**
+ * Sizes the frame the next draws go into and sets the viewport to it
+ * @param off offscreen context
+ * @param width width in pixels
+ * @param height height in pixels
+ * @return 0 on success, -1 if the driver can't render at that size
+ */
+int offscreen_resize(offscreen *off, int width, int height) {
+    if (width != off->width || height != off->height) {
+        glBindRenderbuffer(GL_RENDERBUFFER, off->color);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER,
+                                  off->color);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+            fprintf(stderr, "Error: offscreen_resize: Unable to render %dx%d frames\n",
+                    width, height);
+            off->width = off->height = 0;
+            return -1;
+        }
+        off->width = width;
+        off->height = height;
+    }
+    glViewport(0, 0, width, height);
+    return 0;
+}
+
+/**
+ * Reads the last frame back
+ * @param off offscreen context
+ * @param fb framebuffer to copy the frame into, resized to it
+ */
+void offscreen_read(offscreen *off, framebuffer *fb) {
+    TRACE_SCOPE(span, "readback");
+    TRACE_BYTES(span, (size_t)off->width * off->height * 4);
+    if (framebuffer_resize(fb, off->width, off->height) < 0)
+        return;
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    glReadPixels(0, 0, off->width, off->height, GL_RGBA, GL_UNSIGNED_BYTE, fb->pixels);
+}
+
+/**
+ * Releases the framebuffer object and the context
+ * @param off offscreen context
+ */
+void offscreen_free(offscreen *off) {
+    glDeleteRenderbuffers(1, &off->color);
+    glDeleteFramebuffers(1, &off->fbo);
+#ifdef __linux__
+    eglMakeCurrent(off->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(off->display, off->context);
+    eglTerminate(off->display);
+#else
+    glfwDestroyWindow(off->window);
+    glfwTerminate();
+#endif
+}
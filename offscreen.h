@@ -0,0 +1,33 @@
+/* offscreen header file - a GL context without a display, rendering into a framebuffer object */
+#ifndef OFFSCREEN_H
+#define OFFSCREEN_H
+
+#include "glinclude.h"
+#include <GLFW/glfw3.h>
+#ifdef __linux__
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+#include "ppmrw.h"
+#include "raster.h"
+
+// a context that is made once and renders any number of frames
+typedef struct offscreen_t {
+#ifdef __linux__
+    EGLDisplay display;     // surfaceless Mesa display, no window system needed
+    EGLContext context;
+#else
+    GLFWwindow *window;     // hidden, only there for its context
+#endif
+    GLuint fbo;
+    GLuint color;           // renderbuffer frames are drawn into
+    int width, height;      // size of color, 0 until the first frame
+} offscreen;
+
+int offscreen_init(offscreen *off);
+int offscreen_resize(offscreen *off, int width, int height);
+void offscreen_read(offscreen *off, framebuffer *fb);
+void offscreen_free(offscreen *off);
+
+#endif
@@ -0,0 +1,327 @@
+/** playback - plays back a sequence of images
+ * The frames come either from numbered files (a printf pattern such as
+ * frame_%05d.ppm) or from one stream of concatenated images, e.g. piped out
+ * of ffmpeg -f image2pipe -vcodec ppm. Worker threads decode ahead of the
+ * frame on screen into a ring buffer, waiting whenever it's full, so memory
+ * stays bounded however long the sequence is. Numbered files are decoded by
+ * several threads at once; a stream can only be read in order, by one.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <GLFW/glfw3.h>
+
+#include "playback.h"
+#include "trace.h"
+
+// result of decoding one frame besides success and failure
+#define FRAME_END 1
+
+
+/*******************************************************//**
+ * Decoding
+ * ********************************************************/
+
+/**
+ * Checks that a frame can go in the same texture as the first one
+ * @return 0 if it matches, -1 otherwise
+ */
+static int check_frame(const player *play, int number, const header *hdr) {
+    const header *first = &play->first_header;
+    if (hdr->width != first->width || hdr->height != first->height ||
+        hdr->format != first->format ||
+        PPM_SAMPLE_BYTES(hdr->max_color_val) != PPM_SAMPLE_BYTES(first->max_color_val)) {
+        fprintf(stderr, "Error: check_frame: Frame %d doesn't match the size and format of the first\n",
+                number);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Reads a frame's raster into its slot, reusing the slot's pixels when it
+ * already has some. Text rasters have no fixed size, so they can only be
+ * read from a file of their own, into a new pixmap.
+ * @param fh input positioned just after the frame's header
+ * @param hdr the frame's header
+ * @param slot slot to fill
+ * @param whole_file TRUE if nothing follows the frame in fh
+ * @return 0 on success, -1 on error
+ */
+static int read_frame(FILE *fh, const header *hdr, frame_slot *slot, boolean whole_file) {
+    TRACE_SCOPE(span, "read_frame");
+    if (hdr->file_type < 4 && whole_file) {
+        free_image(&slot->img);
+        return read_pnm_data(fh, hdr, &slot->img);
+    }
+    if (slot->img.pixels == NULL) {
+        slot->img.width = hdr->width;
+        slot->img.height = hdr->height;
+        slot->img.max_color_val = hdr->max_color_val;
+        slot->img.format = hdr->format;
+        if (alloc_image(&slot->img) < 0)
+            return -1;
+    }
+    return read_pnm_frame(fh, hdr, &slot->img);
+}
+
+/**
+ * Decodes a frame from a numbered file
+ * @return 0 on success, FRAME_END if the file doesn't exist, -1 on error
+ */
+static int decode_file(player *play, int number, frame_slot *slot) {
+    char path[4096];
+    header hdr;
+    FILE *fh;
+    int ret_val;
+
+    snprintf(path, sizeof(path), play->pattern, play->first + number);
+    fh = fopen(path, "rb");
+    if (fh == NULL)
+        return access(path, F_OK) == 0 ? -1 : FRAME_END;
+    ret_val = read_header(fh, &hdr);
+    if (ret_val == 0)
+        ret_val = check_frame(play, number, &hdr);
+    if (ret_val == 0)
+        ret_val = read_frame(fh, &hdr, slot, TRUE);
+    if (ret_val < 0)
+        fprintf(stderr, "Error: decode_file: Problem reading %s\n", path);
+    fclose(fh);
+    return ret_val;
+}
+
+/**
+ * Decodes the next frame of a stream of concatenated images. The header of
+ * frame 0 was already read by player_open().
+ * @return 0 on success, FRAME_END at the end of the stream, -1 on error
+ */
+static int decode_stream(player *play, int number, frame_slot *slot) {
+    header hdr = play->first_header;
+    int c;
+
+    if (number > 0) {
+        // the end of the stream can only be told by trying the next header
+        do {
+            c = getc(play->stream);
+        } while (c != EOF && isspace(c));
+        if (c == EOF)
+            return FRAME_END;
+        ungetc(c, play->stream);
+        if (read_header(play->stream, &hdr) < 0 || check_frame(play, number, &hdr) < 0)
+            return -1;
+    }
+    return read_frame(play->stream, &hdr, slot, FALSE);
+}
+
+/**
+ * Decodes frames into the ring buffer until the sequence ends, the player
+ * is closed or a frame fails (thread entry point)
+ */
+static void *decode_frames(void *arg) {
+    player *play = arg;
+
+    trace_thread_name("decoder");
+    pthread_mutex_lock(&play->lock);
+    for (;;) {
+        int number;
+        frame_slot *slot;
+        int ret_val;
+
+        // the slot of the next frame is free once the frame a ring before it is released
+        while (!play->cancel && (play->end < 0 || play->next_frame < play->end) &&
+               play->next_frame >= play->released + PLAYBACK_RING)
+            pthread_cond_wait(&play->changed, &play->lock);
+        if (play->cancel || (play->end >= 0 && play->next_frame >= play->end))
+            break;
+        number = play->next_frame++;
+        slot = &play->slots[number % PLAYBACK_RING];
+        pthread_mutex_unlock(&play->lock);
+
+        if (play->stream != NULL)
+            ret_val = decode_stream(play, number, slot);
+        else
+            ret_val = decode_file(play, number, slot);
+
+        pthread_mutex_lock(&play->lock);
+        if (ret_val != 0) {
+            // several workers may run past the end; the lowest one wins
+            if (play->end < 0 || number < play->end)
+                play->end = number;
+            if (ret_val < 0)
+                play->failed = TRUE;
+        }
+        else {
+            slot->number = number;
+            slot->ready = TRUE;
+        }
+        pthread_cond_broadcast(&play->changed);
+        // wake the render loop in case the frame is already due
+        glfwPostEmptyEvent();
+    }
+    pthread_mutex_unlock(&play->lock);
+    return NULL;
+}
+
+
+/*******************************************************//**
+ * Player
+ * ********************************************************/
+
+/**
+ * Counts the number conversions in a printf pattern of file names. Only
+ * conversions of one int are allowed (%d, %i, %u, %o, %x or %X, with
+ * optional flags, width and precision), and %% for a literal percent sign;
+ * anything else would make snprintf() read arguments that aren't there.
+ * @param pattern pattern to check
+ * @return number of int conversions, -1 if there's any other conversion
+ */
+int pattern_numbers(const char *pattern) {
+    const char *p = pattern;
+    int count = 0;
+
+    while ((p = strchr(p, '%')) != NULL) {
+        p++;
+        if (*p == '%') {
+            p++;
+            continue;
+        }
+        p += strspn(p, "-+ #0");
+        p += strspn(p, "0123456789");
+        if (*p == '.') {
+            p++;
+            p += strspn(p, "0123456789");
+        }
+        if (*p == '\0' || strchr("diouxX", *p) == NULL)
+            return -1;
+        p++;
+        count++;
+    }
+    return count;
+}
+
+/**
+ * Opens a sequence and starts decoding it ahead. Numbered files may start
+ * at 0 or 1.
+ * @param play player to initialize
+ * @param source printf pattern of numbered files, or "-" for a stream of
+ *               concatenated images on stdin
+ * @return 0 on success, -1 on error
+ */
+int player_open(player *play, const char *source) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    FILE *fh = NULL;
+    char path[4096];
+    int i;
+
+    memset(play, 0, sizeof(player));
+    play->end = -1;
+    if (strcmp(source, "-") == 0) {
+        play->stream = stdin;
+        play->thread_count = 1;
+        if (read_header(stdin, &play->first_header) < 0) {
+            fprintf(stderr, "Error: player_open: Problem reading the first frame\n");
+            return -1;
+        }
+    }
+    else {
+        if (pattern_numbers(source) != 1) {
+            fprintf(stderr, "Error: player_open: %s needs exactly one %%d for the frame number\n",
+                    source);
+            return -1;
+        }
+        play->pattern = strdup(source);
+        play->thread_count = cores > PLAYBACK_THREADS ? PLAYBACK_THREADS : cores > 0 ? (int)cores : 1;
+        for (play->first=0; play->first<=1 && fh == NULL; play->first++) {
+            snprintf(path, sizeof(path), source, play->first);
+            fh = fopen(path, "rb");
+        }
+        play->first--;
+        if (fh == NULL) {
+            fprintf(stderr, "Error: player_open: No frames found for %s\n", source);
+            free(play->pattern);
+            return -1;
+        }
+        i = read_header(fh, &play->first_header);
+        fclose(fh);
+        if (i < 0) {
+            fprintf(stderr, "Error: player_open: Problem reading %s\n", path);
+            free(play->pattern);
+            return -1;
+        }
+    }
+
+    pthread_mutex_init(&play->lock, NULL);
+    pthread_cond_init(&play->changed, NULL);
+    for (i=0; i<play->thread_count; i++) {
+        if (pthread_create(&play->threads[i], NULL, decode_frames, play) != 0)
+            break;
+    }
+    if (i == 0) {
+        fprintf(stderr, "Error: player_open: Unable to start decoder threads\n");
+        pthread_mutex_destroy(&play->lock);
+        pthread_cond_destroy(&play->changed);
+        free(play->pattern);
+        return -1;
+    }
+    play->thread_count = i;
+    return 0;
+}
+
+/**
+ * Gets a decoded frame. It stays valid until it's released.
+ * @param play player
+ * @param number frame wanted
+ * @param ended set to TRUE if the sequence ends before that frame
+ * @return the frame, or NULL if it isn't decoded yet or doesn't exist
+ */
+image *player_frame(player *play, int number, boolean *ended) {
+    frame_slot *slot = &play->slots[number % PLAYBACK_RING];
+    image *img = NULL;
+
+    pthread_mutex_lock(&play->lock);
+    if (slot->ready && slot->number == number)
+        img = &slot->img;
+    *ended = play->end >= 0 && number >= play->end;
+    pthread_mutex_unlock(&play->lock);
+    return img;
+}
+
+/**
+ * Hands the slots of a frame and every frame before it back to the
+ * decoders
+ * @param play player
+ * @param number last frame to release
+ */
+void player_release(player *play, int number) {
+    pthread_mutex_lock(&play->lock);
+    while (play->released <= number) {
+        frame_slot *slot = &play->slots[play->released % PLAYBACK_RING];
+        if (slot->number == play->released)
+            slot->ready = FALSE;
+        play->released++;
+    }
+    pthread_cond_broadcast(&play->changed);
+    pthread_mutex_unlock(&play->lock);
+}
+
+/**
+ * Stops the decoders and releases every frame
+ * @param play player opened with player_open()
+ */
+void player_close(player *play) {
+    int i;
+
+    pthread_mutex_lock(&play->lock);
+    play->cancel = TRUE;
+    pthread_cond_broadcast(&play->changed);
+    pthread_mutex_unlock(&play->lock);
+    for (i=0; i<play->thread_count; i++)
+        pthread_join(play->threads[i], NULL);
+    pthread_mutex_destroy(&play->lock);
+    pthread_cond_destroy(&play->changed);
+    for (i=0; i<PLAYBACK_RING; i++)
+        free_image(&play->slots[i].img);
+    free(play->pattern);
+}
@@ -0,0 +1,46 @@
+/* playback header file - image sequences decoded ahead through a ring buffer */
+#ifndef PLAYBACK_H
+#define PLAYBACK_H
+
+#include <stdio.h>
+#include <pthread.h>
+
+#include "ppmrw.h"
+
+// frames that can be decoded ahead of the one on screen, plus that one
+#define PLAYBACK_RING 8
+// most threads decoding numbered files at once
+#define PLAYBACK_THREADS 4
+
+// one frame of the ring buffer; frame n always goes in slot n % PLAYBACK_RING
+typedef struct frame_slot_t {
+    image img;              // allocated the first time the slot is used
+    int number;             // frame in img
+    boolean ready;          // img holds frame number until it's released
+} frame_slot;
+
+// a sequence of same-sized images being decoded ahead of playback
+typedef struct player_t {
+    char *pattern;          // printf pattern of numbered files, NULL for a stream
+    int first;              // number of the first file
+    FILE *stream;           // concatenated images, NULL for numbered files
+    header first_header;    // every frame must match its size and format
+    frame_slot slots[PLAYBACK_RING];
+    pthread_t threads[PLAYBACK_THREADS];
+    int thread_count;
+    pthread_mutex_t lock;   // guards the fields below
+    pthread_cond_t changed; // a frame was decoded or released
+    int next_frame;         // next frame to hand to a worker
+    int released;           // frames before this one may be overwritten
+    int end;                // number of frames, -1 until the end is found
+    boolean failed;         // a frame couldn't be decoded; end is set too
+    boolean cancel;         // set to stop the workers
+} player;
+
+int pattern_numbers(const char *pattern);
+int player_open(player *play, const char *source);
+image *player_frame(player *play, int number, boolean *ended);
+void player_release(player *play, int number);
+void player_close(player *play);
+
+#endif
@@ -10,8 +10,69 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
 #include "ppmrw.h"
+#include "ppmsimd.h"
+#include "trace.h"
+
+
+// smallest slice of a P3 raster worth handing to its own thread
+#define P3_MIN_CHUNK (1 << 18)
+// longest P3 text for one sample and its separator, "255 "
+#define P3_SAMPLE_MAX 4
+// same for 16-bit images, "65535 "
+#define P3_SAMPLE16_MAX 6
+// target size of the text buffer each thread formats P3 output into
+#define P3_BAND_BYTES (1 << 22)
+// samples converted per write when writing 16-bit P6 data
+#define IO_BLOCK_SAMPLES (1 << 16)
+// largest single read or write; some platforms reject transfers >= 2 GB
+#define IO_CHUNK ((size_t)1 << 30)
+
+/* remaining bytes of a file, either mapped or read into memory */
+typedef struct raster_t {
+    unsigned char *data;
+    size_t size;
+    void *map_base;     // NULL when data was read into a malloc'd buffer
+    size_t map_length;
+} raster;
+
+/* one slice of a P3 raster decoded by its own thread */
+typedef struct p3_chunk_t {
+    const char *start, *end;    // text of the chunk, ends on whitespace
+    char *out;                  // where the chunk's first sample goes
+    int sample_bytes;           // 1 or 2 bytes per sample
+    size_t count;               // number of samples in the chunk
+    unsigned int max_seen;      // largest sample value in the chunk
+    int status;                 // 0 on success, -1 on a bad character
+} p3_chunk;
+
+/* rows of an image formatted as P3 text by its own thread */
+typedef struct p3_band_t {
+    image *img;
+    int first_row, rows;
+    char *text;                 // formatted output
+    size_t length;              // bytes of text used
+} p3_band;
+
+// decimal text of a sample value, padded so it can be copied as 4 bytes
+typedef struct digit_string_t {
+    char text[4];
+    unsigned char length;
+} digit_string;
+
+static digit_string digit_table[256];
+static pthread_once_t digits_once = PTHREAD_ONCE_INIT;
+
+// moves count samples of a P6 raster into a pixmap, returning the largest
+typedef unsigned int (*p6_kernel)(void *dst, const unsigned char *src, size_t count, int max);
+
+static int decode_threads = 0;  // 0 means one thread per online core
+static boolean normalize_samples = FALSE;
 
 
 /*******************************************************//**
@@ -19,392 +80,1567 @@
  * ********************************************************/
 
 /**
- * Checks for and moves over consecutive comments in a file recursively
- * @param fh file stream being checked
- * @param c The last character that was read from the file.
+ * Sets the number of threads used to decode large images
+ * @param threads number of threads, or 0 to use one per online core
+ */
+void ppm_set_threads(int threads) {
+    decode_threads = threads < 0 ? 0 : threads;
+}
+
+/**
+ * Chooses whether decoded images with an unusual max color value are
+ * scaled up to 255 (or 65535 for 16-bit images) so they display at full
+ * brightness. Off by default, which keeps the file's samples as they are.
+ * @param normalize TRUE to scale samples while decoding
+ */
+void ppm_set_normalize(boolean normalize) {
+    normalize_samples = normalize;
+}
+
+/**
+ * @return TRUE if decoded samples are scaled to the full range
+ */
+boolean ppm_get_normalize(void) {
+    return normalize_samples;
+}
+
+/**
+ * @return number of threads to decode with, always at least 1
+ */
+static int thread_count(void) {
+    long cores;
+    if (decode_threads > 0) {
+        return decode_threads;
+    }
+    cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? (int)cores : 1;
+}
+
+/**
+ * Runs fn on each of n work items, one thread per item. The first item
+ * runs on the calling thread.
+ * @param fn thread entry point, passed a pointer to its item
+ * @param items array of n work items
+ * @param stride size of one work item in bytes
+ * @param n number of work items
+ * @return 0 on success, -1 if threads couldn't be started
+ */
+static int run_parallel(void *(*fn)(void *), void *items, size_t stride, int n) {
+    pthread_t *threads = malloc(sizeof(pthread_t) * n);
+    char *item = items;
+    int started, i;
+    int ret_val = 0;
+
+    if (threads == NULL) {
+        return -1;
+    }
+    for (started=1; started<n; started++) {
+        if (pthread_create(&threads[started], NULL, fn, item + stride * started) != 0) {
+            ret_val = -1;
+            break;
+        }
+    }
+    fn(item);
+    for (i=1; i<started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    return ret_val;
+}
+
+/**
+ * Computes the number of bytes needed for an image's pixels
+ * @param width image width in pixels
+ * @param height image height in pixels
+ * @param pixel_size bytes per pixel
+ * @param bytes set to width * height * pixel_size
+ * @return 0 on success, -1 if the size doesn't fit in a size_t
+ */
+static int pixmap_bytes(int width, int height, size_t pixel_size, size_t *bytes) {
+    size_t pixels;
+    if (width <= 0 || height <= 0) {
+        return -1;
+    }
+    pixels = (size_t)width * (size_t)height;
+    if (pixels / (size_t)width != (size_t)height || pixels > SIZE_MAX / pixel_size) {
+        return -1;
+    }
+    *bytes = pixels * pixel_size;
+    return 0;
+}
+
+/**
+ * @return number of samples (one per channel of each pixel) in an image
+ */
+static size_t sample_count(const image *img) {
+    return (size_t)img->width * img->height * PPM_CHANNELS(img->format);
+}
+
+/**
+ * fread() that copes with transfers too large for a single read call
+ * @return number of bytes read
+ */
+static size_t fread_large(void *data, size_t size, FILE *fh) {
+    size_t done = 0;
+    TRACE_SCOPE(span, "fread");
+    while (done < size) {
+        size_t n = size - done < IO_CHUNK ? size - done : IO_CHUNK;
+        size_t read = fread((char *)data + done, 1, n, fh);
+        done += read;
+        if (read < n) {
+            break;
+        }
+    }
+    TRACE_BYTES(span, done);
+    return done;
+}
+
+/**
+ * fwrite() that copes with transfers too large for a single write call
+ * @return number of bytes written
+ */
+static size_t fwrite_large(const void *data, size_t size, FILE *fh) {
+    size_t done = 0;
+    TRACE_SCOPE(span, "fwrite");
+    while (done < size) {
+        size_t n = size - done < IO_CHUNK ? size - done : IO_CHUNK;
+        size_t written = fwrite((const char *)data + done, 1, n, fh);
+        done += written;
+        if (written < n) {
+            break;
+        }
+    }
+    TRACE_BYTES(span, done);
+    return done;
+}
+
+/**
+ * Maps everything from the current position of a file stream to the end of
+ * the file into memory. The mapping itself has to start on a page boundary,
+ * so it may begin before the raster data.
+ * @param fh file stream, positioned at the first byte that should be mapped
+ * @param r raster to fill in
+ * @return 0 on success, -1 if the stream can't be mapped (pipe, tty, etc.)
+ */
+static int map_remaining(FILE *fh, raster *r) {
+    struct stat st;
+    int fd = fileno(fh);
+    off_t pos = ftello(fh);
+    TRACE_SCOPE(span, "mmap");
+    if (fd < 0 || pos < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        return -1;
+    }
+    if (st.st_size <= pos) {
+        return -1;
+    }
+
+    // mmap offsets must be page aligned, so map from the page containing pos
+    off_t page = sysconf(_SC_PAGESIZE);
+    off_t start = pos - (pos % page);
+    r->map_length = (size_t)(st.st_size - start);
+    r->map_base = mmap(NULL, r->map_length, PROT_READ, MAP_PRIVATE, fd, start);
+    if (r->map_base == MAP_FAILED) {
+        r->map_base = NULL;
+        return -1;
+    }
+    // the raster is read front to back exactly once
+    madvise(r->map_base, r->map_length, MADV_SEQUENTIAL);
+    madvise(r->map_base, r->map_length, MADV_WILLNEED);
+
+    r->data = (unsigned char *)r->map_base + (pos - start);
+    r->size = (size_t)(st.st_size - pos);
+    TRACE_BYTES(span, r->size);
+    return 0;
+}
+
+/**
+ * Loads everything from the current position of a file stream to the end of
+ * the file, mapping it when possible and reading it into memory otherwise
+ * @param fh file stream, positioned at the start of the raster
+ * @param r raster to fill in. Release with release_raster()
+ * @return 0 on success, -1 on error
+ */
+static int load_raster(FILE *fh, raster *r) {
+    size_t capacity = 1 << 16;
+    size_t read;
+
+    r->map_base = NULL;
+    r->map_length = 0;
+    if (map_remaining(fh, r) == 0) {
+        return 0;
+    }
+
+    // not mappable, so read until EOF doubling the buffer as needed
+    r->size = 0;
+    r->data = malloc(capacity);
+    while (r->data != NULL) {
+        read = fread_large(r->data + r->size, capacity - r->size, fh);
+        r->size += read;
+        if (r->size < capacity) {
+            break;
+        }
+        if (capacity > SIZE_MAX / 2) {
+            free(r->data);
+            r->data = NULL;
+            break;
+        }
+        capacity *= 2;
+        unsigned char *grown = realloc(r->data, capacity);
+        if (grown == NULL) {
+            free(r->data);
+        }
+        r->data = grown;
+    }
+    if (r->data == NULL) {
+        fprintf(stderr, "Error: load_raster: Unable to allocate memory for image data\n");
+        return -1;
+    }
+    if (ferror(fh)) {
+        fprintf(stderr, "Error: load_raster: fread() returned an error when reading data\n");
+        free(r->data);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Releases a raster loaded by load_raster()
+ * @param r raster to release
+ */
+static void release_raster(raster *r) {
+    if (r->map_base != NULL) {
+        munmap(r->map_base, r->map_length);
+    }
+    else {
+        free(r->data);
+    }
+    r->data = NULL;
+}
+
+/**
+ * Checks the size of a P6 raster against the image dimensions
+ * @param size number of raster bytes available
+ * @param img image whose dimensions and max color value are checked against
+ * @return 0 on success, -1 on error
+ */
+static int check_p6_size(size_t size, image *img) {
+    size_t expected = sample_count(img) * PPM_SAMPLE_BYTES(img->max_color_val);
+
+    if (size < expected) {
+        fprintf(stderr, "Error: read_p6_data: Image data is missing or header dimensions are wrong\n");
+        return -1;
+    }
+    if (size > expected) {
+        fprintf(stderr, "Error: read_p6_data: Extra image data was found in file\n");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @return TRUE if an image with this max color value gets scaled up while
+ *         decoding
+ */
+static boolean needs_normalize(int max_color_val) {
+    return normalize_samples && max_color_val > 0 &&
+           max_color_val != 255 && max_color_val != 65535;
+}
+
+/**
+ * Scales the samples of a decoded, already range checked pixmap up to the
+ * full range when normalization is on
+ * @param img image to scale in place
+ */
+static void normalize_pixmap(image *img) {
+    if (!needs_normalize(img->max_color_val)) {
+        return;
+    }
+    if (img->bit_depth == 16) {
+        scale16_samples((unsigned short *)img->pixmap16, sample_count(img), img->max_color_val);
+        img->max_color_val = 65535;
+    }
+    else {
+        scale8_samples((unsigned char *)img->pixmap, (unsigned char *)img->pixmap,
+                       sample_count(img), img->max_color_val);
+        img->max_color_val = 255;
+    }
+}
+
+// every byte is in range, so the raster is only copied
+static unsigned int p6_copy(void *dst, const unsigned char *src, size_t count, int max) {
+    if (dst != src) {
+        memcpy(dst, src, count);
+    }
+    return 0;
+}
+
+static unsigned int p6_validate8(void *dst, const unsigned char *src, size_t count, int max) {
+    return copy_max8_samples(dst, src, count);
+}
+
+static unsigned int p6_normalize8(void *dst, const unsigned char *src, size_t count, int max) {
+    return scale8_samples(dst, src, count, max);
+}
+
+static unsigned int p6_swap16(void *dst, const unsigned char *src, size_t count, int max) {
+    return be16_samples(dst, src, count);
+}
+
+static unsigned int p6_normalize16(void *dst, const unsigned char *src, size_t count, int max) {
+    unsigned int max_seen = be16_samples(dst, src, count);
+    if (max_seen <= (unsigned int)max) {
+        scale16_samples(dst, count, max);
+    }
+    return max_seen;
+}
+
+// indexed by choose_p6_kernel()
+enum p6_path {
+    P6_COPY,
+    P6_VALIDATE8,
+    P6_NORMALIZE8,
+    P6_SWAP16,
+    P6_NORMALIZE16
+};
+
+static const p6_kernel p6_kernels[] = {
+    p6_copy,
+    p6_validate8,
+    p6_normalize8,
+    p6_swap16,
+    p6_normalize16
+};
+
+/**
+ * @return the kernel that decodes a P6 raster with this max color value
+ */
+static enum p6_path choose_p6_kernel(int max_color_val) {
+    if (PPM_SAMPLE_BYTES(max_color_val) == 2) {
+        return needs_normalize(max_color_val) ? P6_NORMALIZE16 : P6_SWAP16;
+    }
+    if (max_color_val == 255) {
+        return P6_COPY;
+    }
+    return needs_normalize(max_color_val) ? P6_NORMALIZE8 : P6_VALIDATE8;
+}
+
+/**
+ * Moves a P6 raster into a pixmap, converting 16-bit samples from big-endian
+ * to native order, and verifies that no sample exceeds the max color value.
+ * With normalization on the samples are also scaled to the full range and
+ * max_color_val is updated to match.
+ * @param dst pixmap to fill (may be the same memory as src)
+ * @param src raster bytes, already checked with check_p6_size()
+ * @param img image whose dimensions and max color value are used
+ * @return 0 on success, -1 on error
+ */
+static int convert_p6_raster(void *dst, const unsigned char *src, image *img) {
+    enum p6_path path = choose_p6_kernel(img->max_color_val);
+    // a mapped raster is paged in here, so this includes most of its I/O
+    TRACE_BEGIN(span, "convert_p6");
+    unsigned int max_seen = p6_kernels[path](dst, src, sample_count(img), img->max_color_val);
+    TRACE_END(span, sample_count(img) * PPM_SAMPLE_BYTES(img->max_color_val));
+
+    if (max_seen > (unsigned int)img->max_color_val) {
+        fprintf(stderr, "Error: read_p6_data: found a pixel value out of range\n");
+        return -1;
+    }
+    if (path == P6_NORMALIZE8) {
+        img->max_color_val = 255;
+    }
+    else if (path == P6_NORMALIZE16) {
+        img->max_color_val = 65535;
+    }
+    return 0;
+}
+
+
+/*******************************************************//**
+ * PPM read/write functions
+ * ********************************************************/
+
+/**
+ * Prepares a header parser to be fed the first byte of a file
+ * @param hp parser to initialize
+ * @param hdr header struct that receives the parsed fields
+ */
+void header_parser_init(header_parser *hp, header *hdr) {
+    hp->hdr = hdr;
+    hp->field = HDR_MAGIC_P;
+    hp->in_comment = FALSE;
+    hp->need_space = FALSE;
+    hp->have_digits = FALSE;
+    hp->value = 0;
+    hp->word_length = 0;
+    hp->key = 0;
+    hdr->comments = NULL;
+}
+
+/**
+ * Stores the number that was just read into the header field being parsed
+ * @param hp header parser
+ * @return 0 on success, -1 on error
+ */
+static int commit_header_field(header_parser *hp) {
+    int value = (int)hp->value;
+    switch (hp->field) {
+        case HDR_WIDTH:
+            if (value <= 0) {
+                fprintf(stderr, "Error: read_header: Image width cannot be less than zero\n");
+                return -1;
+            }
+            hp->hdr->width = value;
+            break;
+        case HDR_HEIGHT:
+            if (value <= 0) {
+                fprintf(stderr, "Error: read_header: Image height cannot be less than zero\n");
+                return -1;
+            }
+            hp->hdr->height = value;
+            // bitmaps have no max color value
+            if (hp->hdr->file_type == 1 || hp->hdr->file_type == 4) {
+                hp->hdr->max_color_val = 1;
+                hp->field = HDR_DONE;
+                hp->have_digits = FALSE;
+                hp->value = 0;
+                return 0;
+            }
+            break;
+        default:
+            // check bounds on max color value
+            if (value > 65535) {
+                fprintf(stderr, "Error: max color value must be >= 0 and <= 65535\n");
+                return -1;
+            }
+            hp->hdr->max_color_val = value;
+            break;
+    }
+    hp->field++;
+    hp->have_digits = FALSE;
+    hp->value = 0;
+    return 0;
+}
+
+/**
+ * Finishes a P7 header once ENDHDR is read, checking that every required
+ * field was given
+ * @param hdr header being parsed
+ * @return 0 on success, -1 on error
+ */
+static int finish_pam_header(header *hdr) {
+    if (hdr->width <= 0 || hdr->height <= 0) {
+        fprintf(stderr, "Error: read_header: PAM header is missing WIDTH or HEIGHT\n");
+        return -1;
+    }
+    if (hdr->max_color_val < 1) {
+        fprintf(stderr, "Error: read_header: PAM header is missing MAXVAL\n");
+        return -1;
+    }
+    if (hdr->format < PIXEL_GRAY || hdr->format > PIXEL_RGBA) {
+        fprintf(stderr, "Error: read_header: PAM DEPTH must be 1 to 4\n");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Feeds the next byte of a P7 header, which is a series of keyword lines
+ * ending with ENDHDR. TUPLTYPE is informational; the pixel format comes
+ * from DEPTH.
+ * @param hp header parser
+ * @param c next byte of the file
+ * @return 1 once the header is complete, 0 if more bytes are needed,
+ *         -1 on error
+ */
+static int feed_pam_header(header_parser *hp, int c) {
+    static const char *keywords[] = { "WIDTH", "HEIGHT", "DEPTH", "MAXVAL", "TUPLTYPE" };
+    int k;
+
+    if (hp->in_comment) {
+        hp->in_comment = (c != '\n');
+        return 0;
+    }
+
+    if (hp->field == HDR_PAM_VALUE) {
+        // TUPLTYPE runs to the end of its line
+        if (hp->key == 4) {
+            if (c == '\n') {
+                hp->field = HDR_PAM_KEYWORD;
+            }
+            return 0;
+        }
+        if (isdigit(c)) {
+            hp->value = hp->value * 10 + (c - '0');
+            if (hp->value > 0x7fffffff) {
+                fprintf(stderr, "Error: read_header: Header value is too large\n");
+                return -1;
+            }
+            hp->have_digits = TRUE;
+            return 0;
+        }
+        if (!isspace(c)) {
+            fprintf(stderr, "Error: read_header: Unexpected character in header\n");
+            return -1;
+        }
+        if (!hp->have_digits) {
+            if (c == '\n') {
+                fprintf(stderr, "Error: read_header: PAM %s has no value\n", keywords[hp->key]);
+                return -1;
+            }
+            return 0;
+        }
+        switch (hp->key) {
+            case 0: hp->hdr->width = (int)hp->value; break;
+            case 1: hp->hdr->height = (int)hp->value; break;
+            case 2: hp->hdr->format = (enum pixel_format)hp->value; break;
+            default:
+                if (hp->value > 65535) {
+                    fprintf(stderr, "Error: max color value must be >= 0 and <= 65535\n");
+                    return -1;
+                }
+                hp->hdr->max_color_val = (int)hp->value;
+                break;
+        }
+        hp->field = HDR_PAM_KEYWORD;
+        hp->have_digits = FALSE;
+        hp->value = 0;
+        return 0;
+    }
+
+    // HDR_PAM_KEYWORD
+    if (!isspace(c)) {
+        if (c == '#' && hp->word_length == 0) {
+            hp->in_comment = TRUE;
+            return 0;
+        }
+        if (hp->word_length == (int)sizeof(hp->word) - 1) {
+            fprintf(stderr, "Error: read_header: Unknown PAM header keyword\n");
+            return -1;
+        }
+        hp->word[hp->word_length++] = (char)c;
+        return 0;
+    }
+    if (hp->word_length == 0) {
+        return 0;
+    }
+    hp->word[hp->word_length] = '\0';
+    hp->word_length = 0;
+    // the raster starts right after the whitespace that ends ENDHDR
+    if (strcmp(hp->word, "ENDHDR") == 0) {
+        hp->field = HDR_DONE;
+        return finish_pam_header(hp->hdr) < 0 ? -1 : 1;
+    }
+    for (k=0; k<5; k++) {
+        if (strcmp(hp->word, keywords[k]) == 0) {
+            hp->key = k;
+            hp->field = HDR_PAM_VALUE;
+            if (c == '\n' && k != 4) {
+                fprintf(stderr, "Error: read_header: PAM %s has no value\n", keywords[k]);
+                return -1;
+            }
+            return 0;
+        }
+    }
+    fprintf(stderr, "Error: read_header: Unknown PAM header keyword %s\n", hp->word);
+    return -1;
+}
+
+/**
+ * Feeds the next byte of a file to a header parser. Comments are skipped
+ * iteratively and nothing is ever pushed back, so this works on pipes and
+ * in-memory buffers alike. The header ends at the single whitespace byte
+ * that follows the max color value; the raster starts with the next byte.
+ * @param hp header parser
+ * @param c next byte of the file, or EOF
+ * @return 1 once the header is complete, 0 if more bytes are needed,
+ *         -1 on error
+ */
+int header_parser_feed(header_parser *hp, int c) {
+    if (c == EOF) {
+        fprintf(stderr, "Error: read_header: Premature end of file\n");
+        return -1;
+    }
+
+    // read magic number
+    if (hp->field == HDR_MAGIC_P) {
+        if (c != 'P') {
+            fprintf(stderr, "Error: read_header: Invalid ppm file. First character is not 'P'\n");
+            return -1;
+        }
+        hp->field = HDR_MAGIC_NUMBER;
+        return 0;
+    }
+    if (hp->field == HDR_MAGIC_NUMBER) {
+        if (c < '1' || c > '7') {
+            fprintf(stderr, "Error: read_header: Unsupported magic number found in header\n");
+            return -1;
+        }
+        hp->hdr->file_type = c - '0';
+        hp->hdr->format = (c == '3' || c == '6') ? PIXEL_RGB : PIXEL_GRAY;
+        hp->field = HDR_WIDTH;
+        hp->need_space = TRUE;
+        if (c == '7') {
+            hp->hdr->width = 0;
+            hp->hdr->height = 0;
+            hp->hdr->max_color_val = 0;
+            hp->hdr->format = 0;
+            hp->field = HDR_PAM_KEYWORD;
+        }
+        return 0;
+    }
+    if (hp->field >= HDR_PAM_KEYWORD) {
+        if (hp->need_space) {
+            if (!isspace(c)) {
+                fprintf(stderr, "Error: read_header: No separator found after magic number\n");
+                return -1;
+            }
+            hp->need_space = FALSE;
+        }
+        return feed_pam_header(hp, c);
+    }
+
+    // skip to the end of a comment line
+    if (hp->in_comment) {
+        if (c == '\n' || c == '\r') {
+            hp->in_comment = FALSE;
+        }
+        return 0;
+    }
+
+    if (isdigit(c)) {
+        if (hp->need_space) {
+            fprintf(stderr, "Error: read_header: No separator found after magic number\n");
+            return -1;
+        }
+        hp->value = hp->value * 10 + (c - '0');
+        if (hp->value > 0x7fffffff) {
+            fprintf(stderr, "Error: read_header: Header value is too large\n");
+            return -1;
+        }
+        hp->have_digits = TRUE;
+        return 0;
+    }
+    if (isspace(c)) {
+        hp->need_space = FALSE;
+        if (hp->have_digits) {
+            if (commit_header_field(hp) < 0) {
+                return -1;
+            }
+            if (hp->field == HDR_DONE) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+    if (c == '#' && !hp->need_space && !hp->have_digits) {
+        hp->in_comment = TRUE;
+        return 0;
+    }
+    fprintf(stderr, "Error: read_header: Unexpected character in header\n");
+    return -1;
+}
+
+/**
+ * Reads the header information from a ppm file from a file stream into
+ * a header struct
+ * @param fh file handler
+ * @param hdr header struct to store the information from the fh stream
+ * @return 0 on success, -1 on error
+ */
+int read_header(FILE *fh, header *hdr) {
+    header_parser hp;
+    int ret_val;
+    TRACE_SCOPE(span, "read_header");
+
+    header_parser_init(&hp, hdr);
+    do {
+        ret_val = header_parser_feed(&hp, getc(fh));
+    } while (ret_val == 0);
+    return ret_val < 0 ? -1 : 0;
+}
+
+/**
+ * Reads the header information from the start of a buffer holding a ppm
+ * file into a header struct
+ * @param data bytes of the file
+ * @param size number of bytes at data
+ * @param hdr header struct to store the information in
+ * @return offset of the first raster byte on success, -1 on error
+ */
+long read_header_buffer(const void *data, size_t size, header *hdr) {
+    const unsigned char *p = data;
+    header_parser hp;
+    size_t i;
+    int ret_val = 0;
+
+    header_parser_init(&hp, hdr);
+    for (i=0; i<size && ret_val == 0; i++) {
+        ret_val = header_parser_feed(&hp, p[i]);
+    }
+    if (ret_val == 0) {
+        ret_val = header_parser_feed(&hp, EOF);
+    }
+    return ret_val < 0 ? -1 : (long)i;
+}
+
+/**
+ * Writes binary image data (pixels) to a file stream: P6, or P5/P7 for
+ * other pixel formats
+ * @param fh file handler
+ * @param img image struct holding image data to be written
+ * @return 0 on success, -1 on error
+ */
+int write_p6_data(FILE *fh, image *img) {
+    size_t count = sample_count(img);
+    unsigned char *block;
+    size_t i, n;
+    TRACE_SCOPE(span, "write_p6");
+    TRACE_BYTES(span, count * (img->bit_depth / 8));
+
+    // an 8-bit pixmap is already laid out exactly like a P6 raster
+    if (img->bit_depth != 16) {
+        if (fwrite_large(img->pixmap, count, fh) != count) {
+            fprintf(stderr, "Error: write_p6_data: fwrite() failed\n");
+            return -1;
+        }
+        return 0;
+    }
+
+    // 16-bit samples are written big-endian, a block at a time
+    block = malloc(IO_BLOCK_SAMPLES * 2);
+    if (block == NULL) {
+        fprintf(stderr, "Error: write_p6_data: Unable to allocate write buffer\n");
+        return -1;
+    }
+    for (i=0; i<count; i+=n) {
+        n = count - i < IO_BLOCK_SAMPLES ? count - i : IO_BLOCK_SAMPLES;
+        // swapping is its own inverse, so this converts native to big-endian
+        be16_samples((unsigned short *)block, (const unsigned char *)(img->pixmap16) + i * 2, n);
+        if (fwrite(block, 2, n, fh) != n) {
+            fprintf(stderr, "Error: write_p6_data: fwrite() failed\n");
+            free(block);
+            return -1;
+        }
+    }
+    free(block);
+    return 0;
+}
+
+/**
+ * Reads the pixel data from a P6 ppm file from a file stream into
+ * an img struct. Regular files are mapped and copied into the pixmap in one
+ * pass; anything else (pipes) is read straight into the pixmap.
+ * @param fh input file pointer
+ * @param img initially empty. Place to store image data read from fh
+ * @return 0 on success, -1 on error
+ */
+int read_p6_data(FILE *fh, image *img) {
+    size_t expected = sample_count(img) * PPM_SAMPLE_BYTES(img->max_color_val);
+    size_t size;
+    raster r;
+
+    img->bit_depth = 8 * PPM_SAMPLE_BYTES(img->max_color_val);
+    if (map_remaining(fh, &r) == 0) {
+        int ret_val = check_p6_size(r.size, img);
+        if (ret_val == 0) {
+            ret_val = convert_p6_raster(img->pixmap, r.data, img);
+        }
+        release_raster(&r);
+        return ret_val;
+    }
+
+    // not mappable, so read the raster directly into the pixmap
+    size = fread_large(img->pixmap, expected, fh);
+    if (ferror(fh)) {
+        fprintf(stderr, "Error: read_p6_data: fread() returned an error when reading data\n");
+        return -1;
+    }
+    if (size == expected && fgetc(fh) != EOF) {
+        size++;
+    }
+    if (check_p6_size(size, img) < 0) {
+        return -1;
+    }
+    return convert_p6_raster(img->pixmap, (unsigned char *)img->pixmap, img);
+}
+
+/**
+ * Maps the pixel data from a P6 ppm file so the pixmap points straight into
+ * the file instead of a copy. The pixmap is read only and must be released
+ * with free_image(). 16-bit rasters need their byte order converted and
+ * normalized rasters need rescaling, so they, like streams that can't be
+ * mapped, are read into a freshly allocated pixmap instead.
+ * @param fh input file pointer, positioned at the start of the raster
+ * @param img image with width, height and max_color_val filled in
  * @return 0 on success, -1 on error
  */
-int check_for_comments(FILE *fh, char c) {
-    /* jumps over comments and onto the next line, then recursively checks again */
-    // skip any leading white space
-    while (isspace(c) && c != EOF) { c = fgetc(fh); }
+int map_p6_data(FILE *fh, image *img) {
+    raster r;
 
-    // base case, current char, c, is not a pound sign
-    if (c != '#') {
-        fseek(fh, -1, SEEK_CUR); // backup one character
-        return 0;
-    }
-    else { // c is a comment, so read to end of line
-        while (c != '\n' && c != EOF) {
-            c = fgetc(fh);
-        }
-        if (c == EOF) {
-            fprintf(stderr, "Error: check_for_comments: Premature end of file\n");
+    img->map_base = NULL;
+    img->map_length = 0;
+
+    if (PPM_SAMPLE_BYTES(img->max_color_val) == 2 || needs_normalize(img->max_color_val) ||
+        map_remaining(fh, &r) < 0) {
+        if (alloc_image(img) < 0) {
             return -1;
         }
-        else { // c is '\n', so grab the next char and check recursively
-            return check_for_comments(fh, fgetc(fh));
-        }
+        return read_p6_data(fh, img);
+    }
+    img->bit_depth = 8;
+    if (check_p6_size(r.size, img) < 0 || convert_p6_raster(r.data, r.data, img) < 0) {
+        release_raster(&r);
+        img->pixmap = NULL;
+        return -1;
     }
+    img->pixmap = (RGBPixel *)r.data;
+    img->map_base = r.map_base;
+    img->map_length = r.map_length;
+    return 0;
 }
 
-int check_for_newline(char c) {
-    if (!isspace(c)) {
-        fprintf(stderr, "Error: check_for_newline: missing newline or space\n");
+/**
+ * Allocates the pixmap of an image whose dimensions are already set,
+ * checking that its size doesn't overflow
+ * @param img image to allocate pixels for
+ * @return 0 on success, -1 on error
+ */
+int alloc_image(image *img) {
+    size_t bytes;
+    img->map_base = NULL;
+    img->map_length = 0;
+    img->pixmap = NULL;
+    img->bit_depth = 8 * PPM_SAMPLE_BYTES(img->max_color_val);
+    if (pixmap_bytes(img->width, img->height,
+                     PPM_CHANNELS(img->format) * (img->bit_depth / 8), &bytes) < 0) {
+        fprintf(stderr, "Error: alloc_image: %dx%d image is too large\n", img->width, img->height);
+        return -1;
+    }
+    img->pixmap = malloc(bytes);
+    if (img->pixmap == NULL) {
+        fprintf(stderr, "Error: alloc_image: Unable to allocate %zu bytes for pixmap\n", bytes);
         return -1;
     }
     return 0;
 }
 
-int bytes_left(FILE *fh) {
-    // returns the number of bytes left in a file
-    int bytes;
-    int pos = ftell(fh);    // get current pointer
-    fseek(fh, 0, SEEK_END);
-    int end = ftell(fh);
-    bytes = end - pos;
-    fseek(fh, pos, SEEK_SET); // put the pointer back
-    if (bytes <= 0) {
-        fprintf(stderr, "Error: bytes_left: bytes remaining <= 0\n");
+/**
+ * Releases the pixels of an image, whether they were allocated or mapped
+ * @param img image to release
+ */
+void free_image(image *img) {
+    if (img->map_base != NULL) {
+        munmap(img->map_base, img->map_length);
+    }
+    else {
+        free(img->pixmap);
+    }
+    img->pixmap = NULL;
+    img->map_base = NULL;
+    img->map_length = 0;
+}
+
+/**
+ * Converts a 16-bit image to 8 bits per sample, scaled to a max color
+ * value of 255. 8-bit images are left alone.
+ * @param img image to convert in place
+ * @return 0 on success, -1 on error
+ */
+int image_to_8bit(image *img) {
+    size_t count = sample_count(img);
+    unsigned int max = img->max_color_val;
+    image narrow = *img;
+    size_t i;
+    TRACE_SCOPE(span, "to_8bit");
+    TRACE_BYTES(span, count * 2);
+
+    if (img->bit_depth != 16) {
+        return 0;
+    }
+    narrow.max_color_val = 255;
+    if (alloc_image(&narrow) < 0) {
         return -1;
     }
-    return bytes;
+    if (max == 65535) {
+        narrow16_samples((unsigned char *)narrow.pixmap, (unsigned short *)img->pixmap16, count);
+    }
+    else {
+        const unsigned short *src = (const unsigned short *)img->pixmap16;
+        unsigned char *dst = (unsigned char *)narrow.pixmap;
+        for (i=0; i<count; i++) {
+            dst[i] = (unsigned char)((src[i] * 255u + max / 2) / max);
+        }
+    }
+    free_image(img);
+    *img = narrow;
+    return 0;
 }
 
+// a band of output rows for image_downsample() to fill on one thread
+typedef struct downsample_band_t {
+    const image *src;
+    image *dst;
+    int first_row, rows;
+} downsample_band;
 
-/*******************************************************//**
- * PPM read/write functions
- * ********************************************************/
+/**
+ * Box filters a band of rows into the half-size image (thread entry point)
+ */
+static void *downsample_rows(void *arg) {
+    downsample_band *band = arg;
+    const image *src = band->src;
+    int channels = PPM_CHANNELS(src->format);
+    size_t sample_size = src->bit_depth / 8;
+    size_t src_row = (size_t)src->width * channels * sample_size;
+    size_t dst_row = (size_t)band->dst->width * channels * sample_size;
+    int y;
+
+    for (y=band->first_row; y<band->first_row + band->rows; y++) {
+        const unsigned char *row0 = (const unsigned char *)src->pixels + 2 * (size_t)y * src_row;
+        const unsigned char *row1 = 2 * y + 1 < src->height ? row0 + src_row : row0;
+        unsigned char *out = (unsigned char *)band->dst->pixels + (size_t)y * dst_row;
+        if (src->bit_depth == 16) {
+            box16_rows((unsigned short *)out, (const unsigned short *)row0,
+                       (const unsigned short *)row1, src->width, channels);
+        }
+        else {
+            box8_rows(out, row0, row1, src->width, channels);
+        }
+    }
+    return NULL;
+}
 
 /**
- * Reads the header information from a ppm file from a file stream into
- * a header struct
- * @param fh file handler
- * @param hdr header struct to store the information from the fh stream
+ * Makes a half-size copy of an image with a 2x2 box filter, as the next
+ * level of a mipmap pyramid. Odd dimensions round up and the last row or
+ * column is averaged with itself. Bands of rows are filtered in parallel.
+ * @param src image to shrink
+ * @param dst set to the new image; the caller releases it with free_image()
  * @return 0 on success, -1 on error
  */
-int read_header(FILE *fh, header *hdr) {
-    int ret_val;    // holds temp return value for reading each section of header
-    char c;         // temporary char read in from file
-    boolean is_p3;  // determines file type being P3 or P6
+int image_downsample(const image *src, image *dst) {
+    int n = thread_count();
+    downsample_band *bands;
+    int rows_per_band, i;
+    TRACE_SCOPE(span, "downsample");
+    TRACE_BYTES(span, sample_count(src) * (src->bit_depth / 8));
 
-    // read magic number
-    c = fgetc(fh);
-    if (c != 'P') {
-        fprintf(stderr, "Error: read_header: Invalid ppm file. First character is not 'P'\n");
+    *dst = *src;
+    dst->width = (src->width + 1) / 2;
+    dst->height = (src->height + 1) / 2;
+    if (alloc_image(dst) < 0) {
         return -1;
     }
-    c = fgetc(fh);
-    if (c == '3') {
-        is_p3 = TRUE;
-    }
-    else if (c == '6') {
-        is_p3 = FALSE;
+
+    if (n > dst->height) {
+        n = dst->height;
     }
-    else {
-        fprintf(stderr, "Error: read_header: Unsupported magic number found in header\n");
+    bands = malloc(sizeof(downsample_band) * n);
+    if (bands == NULL) {
+        fprintf(stderr, "Error: image_downsample: Unable to allocate %d bands\n", n);
+        free_image(dst);
         return -1;
     }
-    // set header struct magic number
-    if (is_p3) {
-        hdr->file_type = 3;
+    rows_per_band = (dst->height + n - 1) / n;
+    n = (dst->height + rows_per_band - 1) / rows_per_band;
+    for (i=0; i<n; i++) {
+        bands[i].src = src;
+        bands[i].dst = dst;
+        bands[i].first_row = i * rows_per_band;
+        bands[i].rows = dst->height - bands[i].first_row < rows_per_band
+                            ? dst->height - bands[i].first_row : rows_per_band;
     }
-    else {
-        hdr->file_type = 6;
+    if (run_parallel(downsample_rows, bands, sizeof(downsample_band), n) < 0) {
+        // couldn't start threads, so filter the rest on this one
+        for (i=1; i<n; i++) {
+            downsample_rows(&bands[i]);
+        }
     }
-    // check for newline and comments
-    ret_val = check_for_newline(fgetc(fh));
-    if (ret_val < 0) {
-        fprintf(stderr, "Error: read_header: No separator found after magic number\n");
+    free(bands);
+    return 0;
+}
+
+/**
+ * Decodes a whole P3 raster on the calling thread
+ * @param data first byte of the raster
+ * @param end one past the last byte of the raster
+ * @param img image with dimensions filled in and pixmap allocated
+ * @return 0 on success, -1 on error
+ */
+static int decode_p3_serial(const char *data, const char *end, image *img) {
+    size_t expected = sample_count(img);
+    const char *data_p = data;
+    unsigned int max_seen;
+    size_t parsed;
+
+    // tokenize and convert every sample, then range check them all at once
+    parsed = p3_parse_samples(&data_p, end, img->pixmap, expected,
+                              PPM_SAMPLE_BYTES(img->max_color_val), &max_seen);
+    if (parsed < expected) {
+        if (data_p < end) {
+            fprintf(stderr, "Error: read_p3_data: found an invalid character in image data\n");
+        }
+        else {
+            fprintf(stderr, "Error: read_p3_data: Image data is missing or header dimensions are wrong\n");
+        }
         return -1;
     }
-    ret_val = check_for_comments(fh, fgetc(fh));
-    if (ret_val < 0) {
-        fprintf(stderr, "Error: read_header: Problem reading comment after magic number\n");
+    if (max_seen > (unsigned int)img->max_color_val) {
+        fprintf(stderr, "Error: read_p3_data: found a pixel value out of range\n");
         return -1;
     }
 
-    // read width
-    fscanf(fh, "%d", &(hdr->width));
-    if (hdr->width <= 0) {
-        fprintf(stderr, "Error: read_header: Image width cannot be less than zero\n");
-        return -1;
-    }
-    if (hdr->width == EOF) {
-        fprintf(stderr, "Error: read_header: Image width not found. Premature EOF\n");
+    // skip any white space that may remain at the end of the data
+    while (data_p < end && isspace((unsigned char)*data_p)) { data_p++; };
+
+    // check if there's still data left
+    if (data_p < end) {
+        fprintf(stderr, "Error: read_p3_data: Extra image data was found in file\n");
         return -1;
     }
-    // check for newline and comments
-    ret_val = check_for_newline(fgetc(fh));
-    if (ret_val < 0) {
-        fprintf(stderr, "Error: read_header: No separator found after width\n");
-        return -1;
+    return 0;
+}
+
+/**
+ * Counts the samples in one chunk of a P3 raster (thread entry point)
+ */
+static void *count_p3_chunk(void *arg) {
+    p3_chunk *chunk = arg;
+    chunk->count = p3_count_samples(chunk->start, chunk->end);
+    return NULL;
+}
+
+/**
+ * Parses one chunk of a P3 raster into its slice of the pixmap
+ * (thread entry point)
+ */
+static void *parse_p3_chunk(void *arg) {
+    p3_chunk *chunk = arg;
+    const char *p = chunk->start;
+    size_t parsed = p3_parse_samples(&p, chunk->end, chunk->out, chunk->count,
+                                     chunk->sample_bytes, &chunk->max_seen);
+    while (p < chunk->end && isspace((unsigned char)*p)) { p++; }
+    chunk->status = (parsed == chunk->count && p == chunk->end) ? 0 : -1;
+    return NULL;
+}
+
+/**
+ * Decodes a P3 raster on several threads. The text is split into chunks
+ * that end on whitespace, the samples in each chunk are counted to find
+ * where its pixels start, then every chunk is parsed into its own slice
+ * of the pixmap.
+ * @param data first byte of the raster
+ * @param end one past the last byte of the raster
+ * @param img image with dimensions filled in and pixmap allocated
+ * @param n number of threads to use
+ * @return 0 on success, -1 on error
+ */
+static int decode_p3_parallel(const char *data, const char *end, image *img, int n) {
+    size_t expected = sample_count(img);
+    int sample_bytes = PPM_SAMPLE_BYTES(img->max_color_val);
+    size_t size = end - data;
+    size_t total = 0;
+    unsigned int max_seen = 0;
+    int i;
+
+    p3_chunk *chunks = calloc(n, sizeof(p3_chunk));
+    if (chunks == NULL) {
+        return decode_p3_serial(data, end, img);
     }
-    ret_val = check_for_comments(fh, fgetc(fh));
-    if (ret_val < 0) {
-        fprintf(stderr, "Error: read_header: Problem reading comment after width\n");
-        return -1;
+
+    // snap each split point forward onto whitespace so no sample is cut
+    for (i=0; i<n; i++) {
+        const char *split = (i == n - 1) ? end : data + size / n * (i + 1);
+        chunks[i].start = (i == 0) ? data : chunks[i-1].end;
+        if (split < chunks[i].start) {
+            split = chunks[i].start;
+        }
+        while (split < end && !isspace((unsigned char)*split)) { split++; }
+        chunks[i].end = split;
     }
 
-    // read height
-    ret_val = fscanf(fh, "%d", &(hdr->height));
-    if (ret_val <= 0 || ret_val == EOF) {
-        fprintf(stderr, "Error: read_header: Image height not found\n");
-        return -1;
+    if (run_parallel(count_p3_chunk, chunks, sizeof(p3_chunk), n) < 0) {
+        free(chunks);
+        return decode_p3_serial(data, end, img);
     }
-    // check for newline and comments
-    ret_val = check_for_newline(fgetc(fh));
-    if (ret_val < 0) {
-        fprintf(stderr, "Error: read_header: No separator found after height\n");
-        return -1;
+    for (i=0; i<n; i++) {
+        chunks[i].out = (char *)img->pixmap + total * sample_bytes;
+        chunks[i].sample_bytes = sample_bytes;
+        total += chunks[i].count;
     }
-    ret_val = check_for_comments(fh, fgetc(fh));
-    if (ret_val < 0) {
-        fprintf(stderr, "Error: read_header: Problem reading comment after height\n");
+    if (total < expected) {
+        fprintf(stderr, "Error: read_p3_data: Image data is missing or header dimensions are wrong\n");
+        free(chunks);
         return -1;
     }
-    
-    // read max color value
-    ret_val = fscanf(fh, "%d", &(hdr->max_color_val));
-    if (ret_val <= 0 || ret_val == EOF) {
-        fprintf(stderr, "Error: read_header: Max color value not found\n");
+    if (total > expected) {
+        fprintf(stderr, "Error: read_p3_data: Extra image data was found in file\n");
+        free(chunks);
         return -1;
     }
-    // check bounds on max color value
-    if (hdr->max_color_val > 255 || hdr->max_color_val < 0) {
-        fprintf(stderr, "Error: max color value must be >= 0 and <= 255\n");
-        return -1;
+
+    if (run_parallel(parse_p3_chunk, chunks, sizeof(p3_chunk), n) < 0) {
+        free(chunks);
+        return decode_p3_serial(data, end, img);
     }
-    // check for newline and comments for the last time
-    ret_val = check_for_newline(fgetc(fh));
-    if (ret_val < 0) {
-        fprintf(stderr, "Error: read_header: No separator found after max color value\n");
-        return -1;
+    for (i=0; i<n; i++) {
+        if (chunks[i].status < 0) {
+            fprintf(stderr, "Error: read_p3_data: found an invalid character in image data\n");
+            free(chunks);
+            return -1;
+        }
+        if (chunks[i].max_seen > max_seen) {
+            max_seen = chunks[i].max_seen;
+        }
     }
-    ret_val = check_for_comments(fh, fgetc(fh));
-    if (ret_val < 0) {
-        fprintf(stderr, "Error: read_header: Problem reading comment after max color value\n");
+    free(chunks);
+
+    if (max_seen > (unsigned int)img->max_color_val) {
+        fprintf(stderr, "Error: read_p3_data: found a pixel value out of range\n");
         return -1;
     }
-
     return 0;
 }
 
 /**
- * Writes ppm P6 image data (pixels) to a file stream
- * @param fh file handler
- * @param img image struct holding image data to be written
+ * Decodes a P3 raster held in memory into img, splitting the work across
+ * threads when the raster is big enough to be worth it
+ * @param data first byte of the raster
+ * @param end one past the last byte of the raster
+ * @param img image with dimensions filled in and pixmap allocated
  * @return 0 on success, -1 on error
  */
-int write_p6_data(FILE *fh, image *img) {
-    int i,j;
-    for (i=0; i<(img->height); i++) {
-        for (j=0; j<(img->width); j++) {
-            fwrite(&(img->pixmap[i * img->width + j].r), 1, 1, fh);
-            fwrite(&(img->pixmap[i * img->width + j].g), 1, 1, fh);
-            fwrite(&(img->pixmap[i * img->width + j].b), 1, 1, fh);
+static int decode_p3(const char *data, const char *end, image *img) {
+    int ret_val;
+    TRACE_SCOPE(span, "decode_p3");
+
+    img->bit_depth = 8 * PPM_SAMPLE_BYTES(img->max_color_val);
+
+    // comments may still sit between the header and the first sample
+    while (data < end && (isspace((unsigned char)*data) || *data == '#')) {
+        if (*data == '#') {
+            while (data < end && *data != '\n') { data++; }
+        }
+        else {
+            data++;
         }
     }
-    return 0;
+
+    size_t chunks = (size_t)(end - data) / P3_MIN_CHUNK;
+    int n = thread_count();
+
+    if ((size_t)n > chunks) {
+        n = (int)chunks;
+    }
+    ret_val = n > 1 ? decode_p3_parallel(data, end, img, n) : decode_p3_serial(data, end, img);
+    if (ret_val == 0) {
+        normalize_pixmap(img);
+    }
+    TRACE_BYTES(span, sample_count(img) * (img->bit_depth / 8));
+    return ret_val;
 }
 
 /**
- * Reads the pixel data from a P6 ppm file from a file stream into
+ * Reads the pixel data from a P3 ppm file from a file stream into
  * an img struct
  * @param fh input file pointer
  * @param img initially empty. Place to store image data read from fh
  * @return 0 on success, -1 on error
  */
-int read_p6_data(FILE *fh, image *img) {
-    // reads p6 data and stores in buffer
-    // read all remaining data from image into buffer
-    int b = bytes_left(fh);
-    // check for error reading bytes_left()
-    if (b < 0) {
-        fprintf(stderr, "Error: read_p6_data: Problem reading remaining bytes in image\n");
+int read_p3_data(FILE *fh, image *img) {
+    int ret_val;
+    raster r;
+
+    if (load_raster(fh, &r) < 0) {
+        fprintf(stderr, "Error: read_p3_data: reading remaining bytes\n");
         return -1;
     }
+    ret_val = decode_p3((const char *)r.data, (const char *)r.data + r.size, img);
+    release_raster(&r);
+    return ret_val;
+}
+
+/**
+ * Decodes a P1 or P4 bitmap raster into 8-bit gray, black 0 and white 255.
+ * The image's max color value becomes 255 to match.
+ * @param file_type 1 for text bits, 4 for packed rows
+ * @param data first byte of the raster
+ * @param size number of raster bytes
+ * @param img image with dimensions filled in and an 8-bit pixmap allocated
+ * @return 0 on success, -1 on error
+ */
+static int decode_pbm(int file_type, const unsigned char *data, size_t size, image *img) {
+    unsigned char *dst = img->pixels;
+    size_t expected = sample_count(img);
+    const unsigned char *end = data + size;
+    size_t row_bytes = ((size_t)img->width + 7) / 8;
+    size_t filled = 0;
+    int row;
+    TRACE_SCOPE(span, "decode_pbm");
+    TRACE_BYTES(span, expected);
 
-    // create temp buffer for image data + 1 for null char
-    unsigned char data[b+1];
-    int read;
+    img->max_color_val = 255;
+    if (file_type == 4) {
+        if (size != row_bytes * img->height) {
+            fprintf(stderr, size < row_bytes * img->height
+                    ? "Error: read_pbm_data: Image data is missing or header dimensions are wrong\n"
+                    : "Error: read_pbm_data: Extra image data was found in file\n");
+            return -1;
+        }
+        for (row=0; row<img->height; row++) {
+            expand_bits(dst + (size_t)row * img->width, data + row * row_bytes, img->width);
+        }
+        return 0;
+    }
 
-    // read the rest of the file and check that what remains is the right size
-    if ((read = fread(data, 1, b, fh)) < 0) {
-        fprintf(stderr, "Error: read_p6_data: fread() returned an error when reading data\n");
+    // every '0' or '1' is a pixel; whitespace between them is optional
+    for (; data < end; data++) {
+        if (*data == '0' || *data == '1') {
+            if (filled == expected) {
+                break;
+            }
+            dst[filled++] = *data == '0' ? 255 : 0;
+        }
+        else if (*data == '#') {
+            while (data < end && *data != '\n') { data++; }
+            if (data == end) {
+                break;
+            }
+        }
+        else if (!isspace((unsigned char)*data)) {
+            fprintf(stderr, "Error: read_pbm_data: found an invalid character in image data\n");
+            return -1;
+        }
+    }
+    if (filled < expected) {
+        fprintf(stderr, "Error: read_pbm_data: Image data is missing or header dimensions are wrong\n");
         return -1;
     }
-
-    // double check number of bytes actually read is correct
-    if (read < b || read > b) {
-        fprintf(stderr, "Error: read_p6_data: image data doesn't match header dimensions\n");
+    if (data < end) {
+        fprintf(stderr, "Error: read_pbm_data: Extra image data was found in file\n");
         return -1;
     }
+    return 0;
+}
 
-    int ptr = 0;        // data pointer/incrementer
-    int i, j, k;        // loop variables
-    unsigned char num;  // build a number from chars read in from file
+/**
+ * Reads the raster of any netpbm file (P1 to P7) into an image. Binary
+ * rasters are mapped in place where map_p6_data() allows it; everything
+ * else is decoded into a newly allocated pixmap.
+ * @param fh input file pointer, positioned just after the header
+ * @param hdr header read from fh
+ * @param img receives the dimensions, pixel format and pixels, which the
+ *            caller releases with free_image()
+ * @return 0 on success, -1 on error
+ */
+int read_pnm_data(FILE *fh, const header *hdr, image *img) {
+    int ret_val;
+    raster r;
 
-    // loop through buffer and populate RGBPixel array
-    for (i=0; i<img->height; i++) {
-        for (j=0; j<img->width; j++) {
-            RGBPixel px;
-            for (k=0; k<3; k++) {
-                // check that we haven't read more than what is available
-                if (ptr >= b) {
-                    fprintf(stderr, "Error: read_p6_data: Image data is missing or header dimensions are wrong\n");
-                    return -1;
-                }
-                num = data[ptr++];
-                if (num < 0 || num > img->max_color_val) {
-                    fprintf(stderr, "Error: read_p6_data: found a pixel value out of range\n");
-                    return -1;
-                }
+    img->width = hdr->width;
+    img->height = hdr->height;
+    img->max_color_val = hdr->max_color_val;
+    img->format = hdr->format;
+    if (hdr->file_type >= 5) {
+        return map_p6_data(fh, img);
+    }
+    if (alloc_image(img) < 0) {
+        return -1;
+    }
+    if (hdr->file_type == 2 || hdr->file_type == 3) {
+        ret_val = read_p3_data(fh, img);
+    }
+    else if (load_raster(fh, &r) < 0) {
+        fprintf(stderr, "Error: read_pbm_data: reading remaining bytes\n");
+        ret_val = -1;
+    }
+    else {
+        ret_val = decode_pbm(hdr->file_type, r.data, r.size, img);
+        release_raster(&r);
+    }
+    if (ret_val < 0) {
+        free_image(img);
+    }
+    return ret_val;
+}
 
-                if (k == 0) {
-                    px.r = num;
-                }
-                else if (k == 1) {
-                    px.g = num;
-                }
-                else {
-                    px.b = num;
-                }
-            }
-            img->pixmap[i * img->width + j] = px;
+/**
+ * Reads the binary raster (P4 to P7) of one image from a stream that may
+ * hold more images after it, such as the frames piped out of
+ * ffmpeg -f image2pipe -vcodec ppm. Exactly the raster's bytes are read,
+ * so fh is left at the header of the next image. Text rasters have no
+ * fixed size and can't be read this way.
+ * @param fh input file pointer, positioned just after the header
+ * @param hdr header read from fh
+ * @param img image allocated with hdr's dimensions, format and sample size;
+ *            its pixels are overwritten and its max color value updated
+ * @return 0 on success, -1 on error
+ */
+int read_pnm_frame(FILE *fh, const header *hdr, image *img) {
+    unsigned char *packed;
+    size_t size;
+    int ret_val;
+
+    if (hdr->file_type < 4) {
+        fprintf(stderr, "Error: read_pnm_frame: P%d rasters can't be read as frames\n",
+                hdr->file_type);
+        return -1;
+    }
+    img->max_color_val = hdr->max_color_val;
+    if (hdr->file_type == 4) {
+        size = ((size_t)img->width + 7) / 8 * img->height;
+        packed = malloc(size);
+        if (packed == NULL) {
+            fprintf(stderr, "Error: read_pnm_frame: Unable to allocate %zu bytes\n", size);
+            return -1;
         }
+        ret_val = fread_large(packed, size, fh) == size ? decode_pbm(4, packed, size, img) : -1;
+        free(packed);
     }
-    // check if there's still data left
-    if (ptr < b) {
-        fprintf(stderr, "Error: read_p6_data: Extra image data was found in file\n");
-        return -1;
+    else {
+        size = sample_count(img) * PPM_SAMPLE_BYTES(img->max_color_val);
+        ret_val = fread_large(img->pixels, size, fh) == size
+                      ? convert_p6_raster(img->pixels, img->pixels, img) : -1;
     }
-    return 0;
+    if (ferror(fh)) {
+        fprintf(stderr, "Error: read_pnm_frame: fread() returned an error when reading data\n");
+    }
+    else if (feof(fh)) {
+        fprintf(stderr, "Error: read_pnm_frame: Image data is missing or header dimensions are wrong\n");
+    }
+    return ret_val;
 }
 
 /**
- * Reads the pixel data from a P3 ppm file from a file stream into
- * an img struct
- * @param fh input file pointer
- * @param img initially empty. Place to store image data read from fh
+ * Decodes a complete netpbm file (P1 to P7) held in memory, so no FILE*
+ * is needed
+ * @param data bytes of the file
+ * @param size number of bytes at data
+ * @param img receives the dimensions and a newly allocated pixmap, which
+ *            the caller releases with free_image()
  * @return 0 on success, -1 on error
  */
-int read_p3_data(FILE *fh, image *img) {
-    
-    // read all remaining data from image into buffer
-    int b = bytes_left(fh); 
-    // check for error reading bytes_left()
-    if (b < 0) {
-        fprintf(stderr, "Error: read_p3_data: reading remaining bytes\n");
+int ppm_decode_buffer(const void *data, size_t size, image *img) {
+    const unsigned char *raster_p;
+    size_t raster_size;
+    header hdr;
+    long offset;
+    int ret_val;
+
+    offset = read_header_buffer(data, size, &hdr);
+    if (offset < 0) {
         return -1;
     }
+    raster_p = (const unsigned char *)data + offset;
+    raster_size = size - offset;
 
-    // create temp buffer for image data + 1 for null char
-    char data[b+1];
-    char *data_p = data;
-    int read;
-
-    // read the rest of the file and check that what remains is the right size
-    if ((read = fread(data, 1, b, fh)) < 0) {
-        fprintf(stderr, "Error: read_p3_data: fread returned an error when reading data\n");
-        return -1;
-    }
-    
-    // double check number of bytes actually read is correct
-    if (read < b || read > b) {
-        fprintf(stderr, "Error: read_p3_data: image data doesn't match header dimensions\n");
-        return -1;
-    }
-    // null terminate the buffer
-    data[b] = '\0';
-    // make sure we're not starting at a space or newline
-    while (isspace(*data_p) && (*data_p != '\0')) { data_p++; };
-    
-    int i, j, k;        // loop variables
-    int ptr;            // current index of the num array
-    char num[4];        // holds string repr. of a 0-255 value
-
-    // loop through buffer and populate RGBPixel array
-    for (i=0; i<img->height; i++) {
-        for (j=0; j<img->width; j++) {
-            RGBPixel px;
-            for (k=0; k<3; k++) {
-                ptr = 0;
-                while (TRUE) {
-                    // check that we haven't read more than what is available
-                    if (*data_p == '\0') {
-                        fprintf(stderr, "Error: read_p3_data: Image data is missing or header dimensions are wrong\n");
-                        return -1;
-                    }
-                    if (isspace(*data_p)) {
-                        *(num + ptr) = '\0';
-                        while (isspace(*data_p) && (*data_p != '\0')) { 
-                            data_p++; 
-                        }
-                        break;
-                    }
-                    else {
-                        *(num + ptr) = *data_p++;
-                        ptr++;
-                    }
-                }
+    img->width = hdr.width;
+    img->height = hdr.height;
+    img->max_color_val = hdr.max_color_val;
+    img->format = hdr.format;
+    if (alloc_image(img) < 0) {
+        return -1;
+    }
 
-                if (atoi(num) < 0 || atoi(num) > img->max_color_val) {
-                    fprintf(stderr, "Error: read_p3_data: found a pixel value out of range\n");
-                    return -1;
-                }
+    if (hdr.file_type == 2 || hdr.file_type == 3) {
+        ret_val = decode_p3((const char *)raster_p, (const char *)raster_p + raster_size, img);
+    }
+    else if (hdr.file_type == 1 || hdr.file_type == 4) {
+        ret_val = decode_pbm(hdr.file_type, raster_p, raster_size, img);
+    }
+    else {
+        ret_val = check_p6_size(raster_size, img);
+        if (ret_val == 0) {
+            ret_val = convert_p6_raster(img->pixmap, raster_p, img);
+        }
+    }
+    if (ret_val < 0) {
+        free_image(img);
+    }
+    return ret_val;
+}
 
-                if (k == 0) {
-                    px.r = atoi(num);
-                }
-                else if (k == 1) {
-                    px.g = atoi(num);
-                }
-                else {
-                    px.b = atoi(num);
-                }
-                img->pixmap[i * img->width + j] = px;
-            }
+/**
+ * Fills the table of decimal strings for every sample value
+ */
+static void build_digit_table(void) {
+    int v;
+    for (v=0; v<256; v++) {
+        digit_table[v].length = (unsigned char)sprintf(digit_table[v].text, "%d", v);
+    }
+}
+
+/**
+ * Writes the decimal text of a 16-bit sample
+ * @param out where to write the digits
+ * @param v sample value
+ * @return one past the last digit written
+ */
+static char *format_sample(char *out, unsigned int v) {
+    char digits[5];
+    int n = 0;
+
+    if (v < 256) {
+        memcpy(out, digit_table[v].text, 4);
+        return out + digit_table[v].length;
+    }
+    while (v > 0) {
+        digits[n++] = (char)('0' + v % 10);
+        v /= 10;
+    }
+    while (n > 0) {
+        *out++ = digits[--n];
+    }
+    return out;
+}
+
+/**
+ * Formats a band of rows as P3 text, one pixel per line (thread entry point)
+ */
+static void *format_p3_band(void *arg) {
+    p3_band *band = arg;
+    int channels = PPM_CHANNELS(band->img->format);
+    size_t first = (size_t)band->first_row * band->img->width * channels;
+    size_t count = (size_t)band->rows * band->img->width * channels;
+    char *out = band->text;
+    size_t i;
+
+    if (band->img->bit_depth == 16) {
+        const unsigned short *sample = (const unsigned short *)band->img->pixmap16 + first;
+        for (i=0; i<count; i++) {
+            out = format_sample(out, sample[i]);
+            *out++ = (i % channels == (size_t)channels - 1) ? '\n' : ' ';
+        }
+        band->length = out - band->text;
+        return NULL;
+    }
+    if (channels != 3) {
+        const unsigned char *sample = (const unsigned char *)band->img->pixels + first;
+        for (i=0; i<count; i++) {
+            memcpy(out, digit_table[sample[i]].text, 4);
+            out += digit_table[sample[i]].length;
+            *out++ = (i % channels == (size_t)channels - 1) ? '\n' : ' ';
         }
+        band->length = out - band->text;
+        return NULL;
     }
 
-    // skip any white space that may remain at the end of the data
-    while (isspace(*data_p) && (*data_p != '\0')) { data_p++; };
-    
-    // check if there's still data left
-    if (*data_p != '\0') {
-        fprintf(stderr, "Error: read_p3_data: Extra image data was found in file\n");
-        return -1;
+    // every table entry is copied as 4 bytes and the end pointer is only
+    // advanced past the digits, so the padding gets overwritten
+    const unsigned char *sample = (const unsigned char *)band->img->pixmap + first;
+    for (i=0; i<count; i+=3) {
+        memcpy(out, digit_table[sample[0]].text, 4);
+        out += digit_table[sample[0]].length;
+        *out++ = ' ';
+        memcpy(out, digit_table[sample[1]].text, 4);
+        out += digit_table[sample[1]].length;
+        *out++ = ' ';
+        memcpy(out, digit_table[sample[2]].text, 4);
+        out += digit_table[sample[2]].length;
+        *out++ = '\n';
+        sample += 3;
     }
-    return 0;
+    band->length = out - band->text;
+    return NULL;
 }
 
 /**
- * Writes ppm P3 image data (pixels) to a file stream
+ * Writes text image data (pixels) to a file stream, one pixel per line:
+ * P3, or P2 for grayscale
  * @param fh file handler
  * @param img image struct holding image data to be written
  * @return 0 on success, -1 on error
  */
 int write_p3_data(FILE *fh, image *img) {
-    int i,j;
-    for (i=0; i<(img->height); i++) {
-        for (j=0; j<(img->width); j++) {
-            fprintf(fh, "%d ", img->pixmap[i * img->width + j].r);
-            fprintf(fh, "%d ", img->pixmap[i * img->width + j].g);
-            fprintf(fh, "%d\n", img->pixmap[i * img->width + j].b);
+    int n = thread_count();
+    size_t pixel_max;
+    int rows_per_band, row, i;
+    p3_band *bands;
+    int ret_val = 0;
+    TRACE_SCOPE(span, "write_p3");
+    TRACE_BYTES(span, sample_count(img) * (img->bit_depth / 8));
+
+    pthread_once(&digits_once, build_digit_table);
+
+    // format bands of rows in parallel, a batch at a time, so the text
+    // buffers stay a fixed size no matter how big the image is
+    pixel_max = PPM_CHANNELS(img->format) *
+                (img->bit_depth == 16 ? P3_SAMPLE16_MAX : P3_SAMPLE_MAX);
+    rows_per_band = (int)(P3_BAND_BYTES / ((size_t)img->width * pixel_max));
+    if (rows_per_band < 1) {
+        rows_per_band = 1;
+    }
+    if (n > (img->height + rows_per_band - 1) / rows_per_band) {
+        n = (img->height + rows_per_band - 1) / rows_per_band;
+    }
+    bands = calloc(n, sizeof(p3_band));
+    if (bands == NULL) {
+        fprintf(stderr, "Error: write_p3_data: Unable to allocate text buffers\n");
+        return -1;
+    }
+    for (i=0; i<n; i++) {
+        bands[i].img = img;
+        bands[i].text = malloc((size_t)rows_per_band * img->width * pixel_max + 4);
+        if (bands[i].text == NULL) {
+            fprintf(stderr, "Error: write_p3_data: Unable to allocate text buffers\n");
+            ret_val = -1;
         }
     }
-    return 0;
+
+    for (row=0; ret_val == 0 && row<img->height; ) {
+        int active = 0;
+        while (active < n && row < img->height) {
+            bands[active].first_row = row;
+            bands[active].rows = rows_per_band;
+            if (row + rows_per_band > img->height) {
+                bands[active].rows = img->height - row;
+            }
+            row += bands[active].rows;
+            active++;
+        }
+        if (run_parallel(format_p3_band, bands, sizeof(p3_band), active) < 0) {
+            // couldn't start threads, so format the rest on this one
+            for (i=1; i<active; i++) {
+                format_p3_band(&bands[i]);
+            }
+        }
+        for (i=0; i<active && ret_val == 0; i++) {
+            if (fwrite(bands[i].text, 1, bands[i].length, fh) != bands[i].length) {
+                fprintf(stderr, "Error: write_p3_data: fwrite() failed\n");
+                ret_val = -1;
+            }
+        }
+    }
+
+    for (i=0; i<n; i++) {
+        free(bands[i].text);
+    }
+    free(bands);
+    return ret_val;
 }
 
 /**
- * Writes ppm header struct information to a file stream
+ * Writes ppm header struct information to a file stream. P7 files get a
+ * PAM header built from the pixel format; P1 and P4 have no max color value.
  * @param fh file handler
  * @param hdr header struct
  * @return 0 on success, -1 on error
  */
 int write_header(FILE *fh, header *hdr) {
+    static const char *tuple_types[] = { "", "GRAYSCALE", "GRAYSCALE_ALPHA", "RGB", "RGB_ALPHA" };
     int ret_val = 0;
+
+    if (hdr->file_type == 7) {
+        ret_val = fprintf(fh, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH %d\nMAXVAL %d\nTUPLTYPE %s\nENDHDR\n",
+                          hdr->width, hdr->height, PPM_CHANNELS(hdr->format),
+                          hdr->max_color_val, tuple_types[hdr->format]);
+        return ret_val < 0 ? -1 : ret_val;
+    }
+    if (hdr->file_type == 1 || hdr->file_type == 4) {
+        ret_val = fprintf(fh, "P%d\n%d %d\n", hdr->file_type, hdr->width, hdr->height);
+        return ret_val < 0 ? -1 : ret_val;
+    }
+
     ret_val = fputs("P", fh);
     if (ret_val < 0) {
         return -1;
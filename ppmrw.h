@@ -10,31 +10,121 @@
 #define TRUE 1
 #define MAX_SIZE 1024
 
+// bytes per sample for a max color value; above 255 samples are 16-bit
+#define PPM_SAMPLE_BYTES(max_color_val) ((max_color_val) > 255 ? 2 : 1)
+
+// samples per pixel of a pixel format
+#define PPM_CHANNELS(format) ((int)(format))
+
 /* variables and types */
 typedef int8_t boolean;
 
+// layout of a pixel; each value is the number of samples per pixel
+enum pixel_format {
+    PIXEL_GRAY = 1,         // P1, P2, P4, P5, and P7 with DEPTH 1
+    PIXEL_GRAY_ALPHA = 2,   // P7 GRAYSCALE_ALPHA
+    PIXEL_RGB = 3,          // P3, P6, and P7 RGB
+    PIXEL_RGBA = 4          // P7 RGB_ALPHA
+};
+
 // file header info
 typedef struct header_t {
-    int file_type;
+    int file_type;      // 1 to 7, the digit of the magic number
     char **comments;
     int width;
     int height;
-    int max_color_val;
+    int max_color_val;  // always 1 for P1 and P4 bitmaps
+    enum pixel_format format;
 } header;
 
+// fields of a header, in the order they appear in a file
+enum header_field {
+    HDR_MAGIC_P,
+    HDR_MAGIC_NUMBER,
+    HDR_WIDTH,
+    HDR_HEIGHT,
+    HDR_MAX_COLOR_VAL,
+    HDR_DONE,
+    HDR_PAM_KEYWORD,    // P7 headers are keyword lines, read by these two
+    HDR_PAM_VALUE
+};
+
+// incremental header parser, fed one byte at a time
+typedef struct header_parser_t {
+    header *hdr;        // receives the parsed fields
+    int field;          // header_field currently being read
+    boolean in_comment; // inside a '#' comment
+    boolean need_space; // whitespace must come before the next field
+    boolean have_digits;// digits of the current field have been read
+    long long value;    // value of the current field so far
+    char word[16];      // P7 keyword being read
+    int word_length;
+    int key;            // P7 keyword whose value is being read
+} header_parser;
+
+// called with each completed row of pixels: width * PPM_CHANNELS(format)
+// samples, unsigned chars or (when max_color_val > 255) native unsigned
+// shorts. Bitmaps (P1, P4) arrive as 8-bit gray, black 0 and white 255;
+// return 0 to keep decoding, anything else to stop
+typedef int (*ppm_row_callback)(void *user, const header *hdr, int row,
+                                const void *pixels);
+
+// incremental decoder, see ppmstream.c
+typedef struct ppm_stream_t ppm_stream;
+
 // one pixel
 typedef struct RGBPixel_t {
     unsigned char r, g, b;
 } RGBPixel;
 
+// one pixel of an image with a max color value above 255
+typedef struct RGBPixel16_t {
+    unsigned short r, g, b;
+} RGBPixel16;
+
 // image info
 typedef struct image_t {
-    RGBPixel *pixmap;
+    union {
+        RGBPixel *pixmap;       // when bit_depth is 8
+        RGBPixel16 *pixmap16;   // when bit_depth is 16, native byte order
+        void *pixels;           // any other pixel format
+    };
     int width, height, max_color_val;
+    enum pixel_format format;   // samples per pixel
+    int bit_depth;      // bits per sample, 8 or 16
+    void *map_base;     // set when pixmap points into a file mapping
+    size_t map_length;  // length of the mapping at map_base
 } image;
 
 int read_header(FILE *fh, header *hdr);
+long read_header_buffer(const void *data, size_t size, header *hdr);
+int write_header(FILE *fh, header *hdr);
 int read_p6_data(FILE *fh, image *img);
 int read_p3_data(FILE *fh, image *img);
+int map_p6_data(FILE *fh, image *img);
+int read_pnm_data(FILE *fh, const header *hdr, image *img);
+int read_pnm_frame(FILE *fh, const header *hdr, image *img);
+int write_p6_data(FILE *fh, image *img);
+int write_p3_data(FILE *fh, image *img);
+int ppm_decode_buffer(const void *data, size_t size, image *img);
+int alloc_image(image *img);
+int image_to_8bit(image *img);
+int image_downsample(const image *src, image *dst);
+void free_image(image *img);
+void ppm_set_threads(int threads);
+void ppm_set_normalize(boolean normalize);
+boolean ppm_get_normalize(void);
+
+void header_parser_init(header_parser *hp, header *hdr);
+int header_parser_feed(header_parser *hp, int c);
+
+ppm_stream *ppm_stream_create(ppm_row_callback on_row, void *user);
+ppm_stream *ppm_stream_resume(ppm_row_callback on_row, void *user, const header *hdr);
+int ppm_stream_feed(ppm_stream *stream, const void *data, size_t size);
+int ppm_stream_finish(ppm_stream *stream);
+const header *ppm_stream_header(const ppm_stream *stream);
+void ppm_stream_destroy(ppm_stream *stream);
+int ppm_stream_file(FILE *fh, ppm_row_callback on_row, void *user);
+int ppm_stream_raster(FILE *fh, const header *hdr, ppm_row_callback on_row, void *user);
 
 #endif
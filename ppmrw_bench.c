@@ -0,0 +1,585 @@
+/** ppmrw_bench - throughput benchmark for the ppm decoder and encoder
+ * usage: ppmrw_bench [--size WxH]... [--max-mp N] [--threads N] [--dir path]
+ *                    [--json file] [--baseline file] [--tolerance percent]
+ *
+ * Writes synthetic images from 1 KP to 200 MP as P6 and P3 files, reads
+ * them back with the page cache warm and again with the file dropped from
+ * it, and reports how many MB/s and pixels/s each reader and writer
+ * manages. The results can be saved as JSON and compared with a saved run
+ * to catch regressions.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "ppmrw.h"
+
+// 1 KP, 64 KP, 1 MP, 16 MP and 200 MP
+static const int default_sizes[][2] = {
+    {32, 32}, {256, 256}, {1024, 1024}, {4096, 4096}, {16384, 12288}
+};
+#define MAX_SIZES 16
+// results of the readers and writers at every size, warm and cold
+#define MAX_RESULTS (MAX_SIZES * 16)
+// every operation runs until it has been timed for BENCH_MIN_TIME seconds
+// or MAX_RUNS times, whichever comes first, and keeps its best run
+#define BENCH_MIN_TIME 0.5
+#define MAX_RUNS 1000
+// dropping a file from the cache costs more than reading it, so cold
+// reads are repeated less
+#define MAX_COLD_RUNS 5
+#define DEFAULT_TOLERANCE 10.0
+
+// best run of one operation on one image
+typedef struct bench_result_t {
+    char op[32];
+    char cache[8];          // "warm" or "cold"
+    int width, height;
+    long long bytes;        // file bytes read or written per run
+    long long pixels;       // pixels decoded or encoded per run, 0 for headers
+    double seconds;
+} bench_result;
+
+// a reader under test; the header has been read and img set up from it
+typedef struct raster_reader_t {
+    const char *name;
+    int file_type;          // file it reads, 3 or 6
+    int (*read)(FILE *fh, image *img);
+} raster_reader;
+
+static bench_result results[MAX_RESULTS];
+static int result_count = 0;
+static boolean cache_warned = FALSE;
+
+/**
+ * @return a monotonic timestamp in seconds
+ */
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Fills an image with a noisy gradient so P3 output has a realistic mix
+ * of one, two and three digit samples
+ * @param img image with width and height set; pixmap is allocated here
+ * @return 0 on success, -1 on error
+ */
+static int make_image(image *img) {
+    size_t i, pixels = (size_t)img->width * img->height;
+    img->max_color_val = 255;
+    img->format = PIXEL_RGB;
+    if (alloc_image(img) < 0) {
+        return -1;
+    }
+    srand(430);
+    for (i=0; i<pixels; i++) {
+        img->pixmap[i].r = (unsigned char)(i % img->width * 255 / img->width);
+        img->pixmap[i].g = (unsigned char)(i / img->width * 255 / img->height);
+        img->pixmap[i].b = (unsigned char)rand();
+    }
+    return 0;
+}
+
+/**
+ * Adds a run to the results, or keeps it in place of the last run of the
+ * same operation if it was faster
+ * @param op operation name
+ * @param cache "warm" or "cold"
+ * @param img image the operation worked on
+ * @param bytes file bytes the run read or wrote
+ * @param pixels pixels the run decoded or encoded
+ * @param seconds time the run took
+ * @param first TRUE for the first run of the operation
+ */
+static void record(const char *op, const char *cache, const image *img,
+                   long long bytes, long long pixels, double seconds, boolean first) {
+    bench_result *r;
+    if (first) {
+        if (result_count == MAX_RESULTS) {
+            return;
+        }
+        r = &results[result_count++];
+        snprintf(r->op, sizeof(r->op), "%s", op);
+        snprintf(r->cache, sizeof(r->cache), "%s", cache);
+        r->width = img->width;
+        r->height = img->height;
+    }
+    else {
+        r = &results[result_count - 1];
+        if (seconds >= r->seconds) {
+            return;
+        }
+    }
+    r->bytes = bytes;
+    r->pixels = pixels;
+    r->seconds = seconds;
+}
+
+/**
+ * Prints the last result as a row of the report
+ * @param out stream the report goes to
+ */
+static void print_result(FILE *out) {
+    const bench_result *r = &results[result_count - 1];
+    double seconds = r->seconds > 0 ? r->seconds : 1e-9;
+    fprintf(out, "%-14s %s %5dx%-5d %9.1f MB/s %9.1f MP/s  (%lld bytes in %.6f s)\n",
+            r->op, r->cache, r->width, r->height, r->bytes / seconds / 1e6,
+            r->pixels / seconds / 1e6, r->bytes, r->seconds);
+}
+
+/**
+ * Flushes a file to disk and drops its pages from the page cache, so the
+ * next read of it comes from the disk
+ * @param path file to drop
+ * @return 0 on success, -1 on error
+ */
+static int drop_cache(const char *path) {
+    int fd = open(path, O_RDONLY);
+    int ret_val = 0;
+    if (fd < 0) {
+        fprintf(stderr, "Error: drop_cache: %s can't be opened\n", path);
+        return -1;
+    }
+    fsync(fd);
+#ifdef POSIX_FADV_DONTNEED
+    ret_val = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) == 0 ? 0 : -1;
+#else
+    // no fadvise on Mac OS, but invalidating a mapping of the whole file
+    // throws away its cached pages
+    {
+        struct stat st;
+        void *map = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        ret_val = map != MAP_FAILED && msync(map, st.st_size, MS_INVALIDATE) == 0 ? 0 : -1;
+        if (map != MAP_FAILED) {
+            munmap(map, st.st_size);
+        }
+    }
+#endif
+    close(fd);
+    if (ret_val < 0 && !cache_warned) {
+        fprintf(stderr, "Warning: drop_cache: Unable to drop %s from the page cache, "
+                        "so cold reads may be warm\n", path);
+        cache_warned = TRUE;
+    }
+    return 0;
+}
+
+/**
+ * Times one writer, keeping the best of several runs. The file written by
+ * the last run is left for the readers.
+ * @param name label for the report
+ * @param write writer under test
+ * @param file_type magic number digit of the file written
+ * @param img image to write
+ * @param path file to write
+ * @param out stream the report goes to
+ * @return 0 on success, -1 on error
+ */
+static int bench_writer(const char *name, int (*write)(FILE *, image *), int file_type,
+                        image *img, const char *path, FILE *out) {
+    double total = 0;
+    int i;
+
+    for (i=0; i<MAX_RUNS && (i == 0 || total < BENCH_MIN_TIME); i++) {
+        FILE *fh = fopen(path, "wb");
+        header hdr;
+        off_t start_offset;
+        double start, elapsed;
+        if (fh == NULL) {
+            fprintf(stderr, "Error: bench_writer: %s can't be opened\n", path);
+            return -1;
+        }
+        hdr.file_type = file_type;
+        hdr.comments = NULL;
+        hdr.width = img->width;
+        hdr.height = img->height;
+        hdr.max_color_val = img->max_color_val;
+        hdr.format = img->format;
+        if (write_header(fh, &hdr) < 0) {
+            fclose(fh);
+            return -1;
+        }
+        start_offset = ftello(fh);
+        start = now();
+        if (write(fh, img) < 0 || fflush(fh) != 0) {
+            fclose(fh);
+            return -1;
+        }
+        elapsed = now() - start;
+        total += elapsed;
+        record(name, "warm", img, (long long)(ftello(fh) - start_offset),
+               (long long)img->width * img->height, elapsed, i == 0);
+        if (fclose(fh) != 0) {
+            fprintf(stderr, "Error: bench_writer: Problem writing %s\n", path);
+            return -1;
+        }
+    }
+    print_result(out);
+    return 0;
+}
+
+/**
+ * Times read_header(), keeping the best of several runs
+ * @param path P6 file to read the header of
+ * @param img image the file holds
+ * @param cold TRUE to drop the file from the page cache before each run
+ * @param out stream the report goes to
+ * @return 0 on success, -1 on error
+ */
+static int bench_header(const char *path, const image *img, boolean cold, FILE *out) {
+    double total = 0;
+    int i, runs = cold ? MAX_COLD_RUNS : MAX_RUNS;
+
+    for (i=0; i<runs && (i == 0 || total < BENCH_MIN_TIME); i++) {
+        FILE *fh;
+        header hdr;
+        double start, elapsed;
+        if (cold && drop_cache(path) < 0) {
+            return -1;
+        }
+        fh = fopen(path, "rb");
+        if (fh == NULL) {
+            fprintf(stderr, "Error: bench_header: %s can't be opened\n", path);
+            return -1;
+        }
+        start = now();
+        if (read_header(fh, &hdr) < 0) {
+            fclose(fh);
+            return -1;
+        }
+        elapsed = now() - start;
+        total += elapsed;
+        record("read_header", cold ? "cold" : "warm", img, (long long)ftello(fh), 0,
+               elapsed, i == 0);
+        fclose(fh);
+    }
+    print_result(out);
+    return 0;
+}
+
+/**
+ * Reads a byte of every page of a pixmap, so the pages of a mapped file
+ * are faulted in
+ * @param img image whose pixmap is mapped
+ * @param size bytes in the pixmap
+ */
+static void touch_pages(const image *img, size_t size) {
+    const volatile unsigned char *p = (const unsigned char *)img->pixmap;
+    long page = sysconf(_SC_PAGESIZE);
+    size_t i;
+    for (i=0; i<size; i+=page > 0 ? page : 4096) {
+        (void)p[i];
+    }
+}
+
+/**
+ * Times one reader, keeping the best of several runs. Only the raster is
+ * timed; the header is read first. A mapped pixmap is timed until all its
+ * pages have been touched.
+ * @param reader reader under test
+ * @param path file to read
+ * @param expected image the file holds, compared with what was read
+ * @param cold TRUE to drop the file from the page cache before each run
+ * @param out stream the report goes to
+ * @return 0 on success, -1 on error
+ */
+static int bench_reader(const raster_reader *reader, const char *path, const image *expected,
+                        boolean cold, FILE *out) {
+    size_t pixmap_size = (size_t)expected->width * expected->height * sizeof(RGBPixel);
+    double total = 0;
+    int i, runs = cold ? MAX_COLD_RUNS : MAX_RUNS;
+
+    for (i=0; i<runs && (i == 0 || total < BENCH_MIN_TIME); i++) {
+        FILE *fh;
+        header hdr;
+        image img;
+        struct stat st;
+        off_t start_offset;
+        double start, elapsed;
+        int ret_val;
+
+        if (cold && drop_cache(path) < 0) {
+            return -1;
+        }
+        fh = fopen(path, "rb");
+        if (fh == NULL) {
+            fprintf(stderr, "Error: bench_reader: %s can't be opened\n", path);
+            return -1;
+        }
+        if (read_header(fh, &hdr) < 0) {
+            fclose(fh);
+            return -1;
+        }
+        img.width = hdr.width;
+        img.height = hdr.height;
+        img.max_color_val = hdr.max_color_val;
+        img.format = hdr.format;
+        // map_p6_data() provides its own pixels
+        if (reader->read != map_p6_data && alloc_image(&img) < 0) {
+            fclose(fh);
+            return -1;
+        }
+        start_offset = ftello(fh);
+        start = now();
+        ret_val = reader->read(fh, &img);
+        // a mapping reads nothing until its pages are touched
+        if (ret_val == 0 && img.map_base != NULL) {
+            touch_pages(&img, pixmap_size);
+        }
+        elapsed = now() - start;
+        if (ret_val == 0 && memcmp(img.pixmap, expected->pixmap, pixmap_size) != 0) {
+            fprintf(stderr, "Error: bench_reader: %s read different pixels than were written\n",
+                    reader->name);
+            ret_val = -1;
+        }
+        free_image(&img);
+        if (ret_val < 0 || fstat(fileno(fh), &st) < 0) {
+            fclose(fh);
+            return -1;
+        }
+        fclose(fh);
+        total += elapsed;
+        record(reader->name, cold ? "cold" : "warm", expected,
+               (long long)(st.st_size - start_offset),
+               (long long)expected->width * expected->height, elapsed, i == 0);
+    }
+    print_result(out);
+    return 0;
+}
+
+/**
+ * Benchmarks every writer and reader on one image size
+ * @param width width of the image
+ * @param height height of the image
+ * @param dir directory the test files are written in
+ * @param out stream the report goes to
+ * @return 0 on success, -1 on error
+ */
+static int bench_size(int width, int height, const char *dir, FILE *out) {
+    static const raster_reader readers[] = {
+        {"read_p6_data", 6, read_p6_data},
+        {"map_p6_data", 6, map_p6_data},
+        {"read_p3_data", 3, read_p3_data}
+    };
+    char p6_path[MAX_SIZE], p3_path[MAX_SIZE];
+    image img;
+    int i, cold, ret_val = 0;
+
+    img.width = width;
+    img.height = height;
+    if (make_image(&img) < 0) {
+        fprintf(stderr, "Error: bench_size: Unable to create a %dx%d test image\n", width, height);
+        return -1;
+    }
+    snprintf(p6_path, sizeof(p6_path), "%s/ppmrw_bench_%d.p6.ppm", dir, (int)getpid());
+    snprintf(p3_path, sizeof(p3_path), "%s/ppmrw_bench_%d.p3.ppm", dir, (int)getpid());
+
+    if (bench_writer("write_p6_data", write_p6_data, 6, &img, p6_path, out) < 0 ||
+        bench_writer("write_p3_data", write_p3_data, 3, &img, p3_path, out) < 0) {
+        ret_val = -1;
+    }
+    for (cold=0; cold<2 && ret_val == 0; cold++) {
+        ret_val = bench_header(p6_path, &img, cold, out);
+        for (i=0; i<(int)(sizeof(readers) / sizeof(readers[0])) && ret_val == 0; i++) {
+            ret_val = bench_reader(&readers[i], readers[i].file_type == 6 ? p6_path : p3_path,
+                                   &img, cold, out);
+        }
+    }
+    remove(p6_path);
+    remove(p3_path);
+    free_image(&img);
+    return ret_val;
+}
+
+/**
+ * Writes the results as JSON, one result to a line so load_baseline() can
+ * read them back without a JSON parser
+ * @param path file to write, - for stdout
+ * @param threads decoder threads the results were measured with, 0 for one per core
+ * @return 0 on success, -1 on error
+ */
+static int write_json(const char *path, int threads) {
+    FILE *fh = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    int i, ret_val;
+
+    if (fh == NULL) {
+        fprintf(stderr, "Error: write_json: %s can't be opened\n", path);
+        return -1;
+    }
+    fprintf(fh, "{\"threads\":%d,\"results\":[\n", threads);
+    for (i=0; i<result_count; i++) {
+        const bench_result *r = &results[i];
+        double seconds = r->seconds > 0 ? r->seconds : 1e-9;
+        fprintf(fh, "{\"op\":\"%s\",\"cache\":\"%s\",\"width\":%d,\"height\":%d,"
+                    "\"bytes\":%lld,\"pixels\":%lld,\"seconds\":%.9f,"
+                    "\"mb_per_s\":%.3f,\"pixels_per_s\":%.1f}%s\n",
+                r->op, r->cache, r->width, r->height, r->bytes, r->pixels, r->seconds,
+                r->bytes / seconds / 1e6, r->pixels / seconds, i + 1 < result_count ? "," : "");
+    }
+    fprintf(fh, "]}\n");
+    ret_val = ferror(fh) ? -1 : 0;
+    if (fh != stdout && fclose(fh) != 0) {
+        ret_val = -1;
+    }
+    if (ret_val < 0) {
+        fprintf(stderr, "Error: write_json: Problem writing %s\n", path);
+    }
+    return ret_val;
+}
+
+/**
+ * Compares the results with the ones in a file written by an earlier run
+ * with --json, and reports every operation whose throughput dropped by
+ * more than the tolerance
+ * @param path baseline file
+ * @param tolerance slowdown allowed, in percent
+ * @param out stream the report goes to
+ * @return number of regressions, -1 on error
+ */
+static int compare_baseline(const char *path, double tolerance, FILE *out) {
+    FILE *fh = fopen(path, "r");
+    char line[MAX_SIZE];
+    int i, compared = 0, regressions = 0;
+
+    if (fh == NULL) {
+        fprintf(stderr, "Error: compare_baseline: %s can't be opened\n", path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fh) != NULL) {
+        bench_result base;
+        double base_mb_s;
+        if (sscanf(line, "{\"op\":\"%31[^\"]\",\"cache\":\"%7[^\"]\",\"width\":%d,\"height\":%d,"
+                         "\"bytes\":%lld,\"pixels\":%lld,\"seconds\":%lf,\"mb_per_s\":%lf",
+                   base.op, base.cache, &base.width, &base.height, &base.bytes, &base.pixels,
+                   &base.seconds, &base_mb_s) != 8) {
+            continue;
+        }
+        for (i=0; i<result_count; i++) {
+            const bench_result *r = &results[i];
+            double mb_s, change;
+            if (strcmp(r->op, base.op) != 0 || strcmp(r->cache, base.cache) != 0 ||
+                r->width != base.width || r->height != base.height) {
+                continue;
+            }
+            mb_s = r->bytes / (r->seconds > 0 ? r->seconds : 1e-9) / 1e6;
+            change = base_mb_s > 0 ? (mb_s / base_mb_s - 1) * 100 : 0;
+            compared++;
+            if (change < -tolerance) {
+                fprintf(out, "Regression: %s %s %dx%d %.1f MB/s, baseline %.1f MB/s (%+.1f%%)\n",
+                        r->op, r->cache, r->width, r->height, mb_s, base_mb_s, change);
+                regressions++;
+            }
+        }
+    }
+    fclose(fh);
+    fprintf(out, "%d of %d results more than %.1f%% slower than %s\n",
+            regressions, compared, tolerance, path);
+    return regressions;
+}
+
+/**
+ * Reads the value of an option that takes a number
+ * @param option the option, for the error message
+ * @param value the option's value
+ * @return the number; exits on error
+ */
+static double parse_number(const char *option, const char *value) {
+    char *end;
+    double number = strtod(value, &end);
+    if (end == value || *end != '\0' || number < 0) {
+        fprintf(stderr, "Error: main: %s takes a number\n", option);
+        exit(1);
+    }
+    return number;
+}
+
+int main(int argc, char *argv[]) {
+    int sizes[MAX_SIZES][2];
+    int size_count = 0, threads = 0, i, regressions = 0;
+    double max_mp = 0, tolerance = DEFAULT_TOLERANCE;
+    const char *dir = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+    const char *json_path = NULL, *baseline_path = NULL;
+    FILE *out;
+
+    for (i=1; i<argc; i++) {
+        if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            if (size_count == MAX_SIZES ||
+                sscanf(argv[i + 1], "%dx%d", &sizes[size_count][0], &sizes[size_count][1]) != 2 ||
+                sizes[size_count][0] <= 0 || sizes[size_count][1] <= 0) {
+                fprintf(stderr, "Error: main: --size takes WxH, at most %d times\n", MAX_SIZES);
+                return 1;
+            }
+            size_count++;
+            i++;
+        }
+        else if (strcmp(argv[i], "--max-mp") == 0 && i + 1 < argc) {
+            max_mp = parse_number(argv[i], argv[i + 1]);
+            i++;
+        }
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = (int)parse_number(argv[i], argv[i + 1]);
+            i++;
+        }
+        else if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc) {
+            dir = argv[++i];
+        }
+        else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            json_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+            baseline_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc) {
+            tolerance = parse_number(argv[i], argv[i + 1]);
+            i++;
+        }
+        else {
+            fprintf(stderr, "Usage: %s [--size WxH]... [--max-mp N] [--threads N] [--dir path]\n"
+                            "       %*s [--json file] [--baseline file] [--tolerance percent]\n",
+                    argv[0], (int)strlen(argv[0]), "");
+            return 1;
+        }
+    }
+    if (size_count == 0) {
+        for (i=0; i<(int)(sizeof(default_sizes) / sizeof(default_sizes[0])); i++) {
+            sizes[size_count][0] = default_sizes[i][0];
+            sizes[size_count][1] = default_sizes[i][1];
+            size_count++;
+        }
+    }
+    ppm_set_threads(threads);
+    // the report moves out of the way of JSON on stdout
+    out = json_path != NULL && strcmp(json_path, "-") == 0 ? stderr : stdout;
+
+    for (i=0; i<size_count; i++) {
+        if (max_mp > 0 && (double)sizes[i][0] * sizes[i][1] > max_mp * 1e6) {
+            continue;
+        }
+        if (bench_size(sizes[i][0], sizes[i][1], dir, out) < 0) {
+            fprintf(stderr, "Error: main: Benchmarking the %dx%d image failed\n",
+                    sizes[i][0], sizes[i][1]);
+            return 1;
+        }
+    }
+    if (json_path != NULL && write_json(json_path, threads) < 0) {
+        return 1;
+    }
+    if (baseline_path != NULL) {
+        regressions = compare_baseline(baseline_path, tolerance, out);
+        if (regressions < 0) {
+            return 1;
+        }
+    }
+    return regressions > 0 ? 2 : 0;
+}
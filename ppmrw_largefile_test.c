@@ -0,0 +1,161 @@
+/** ppmrw_largefile_test - decodes a P6 file larger than 4 GB
+ * usage: ppmrw_largefile_test [directory]
+ *
+ * Writes a sparse 40000x36000 P6 file (4.3 GB, almost all of it holes),
+ * fills in the rows that straddle the 4 GB mark and the last rows with a
+ * known pattern, decodes it with read_pnm_data() and checks those pixels.
+ * Offsets or sizes that wrap at 2 or 4 GB show up as the wrong pixels or
+ * as a failed decode. Exits with 0 when every pixel matched.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include "ppmrw.h"
+
+#define TEST_WIDTH 40000
+#define TEST_HEIGHT 36000
+// rows filled in at the end of the image
+#define TAIL_ROWS 4
+
+/**
+ * @return the pixel written at (x, y)
+ */
+static RGBPixel pattern(int x, int y) {
+    RGBPixel p;
+    p.r = (unsigned char)(x % 251);
+    p.g = (unsigned char)(y % 241);
+    p.b = (unsigned char)((x + y) % 239 + 1);
+    return p;
+}
+
+/**
+ * Writes the pattern over whole rows of the raster
+ * @param fd file to write to
+ * @param raster offset of the raster in the file
+ * @param first first row to write
+ * @param count number of rows
+ * @return 0 on success, -1 on error
+ */
+static int write_rows(int fd, off_t raster, int first, int count) {
+    size_t row_bytes = (size_t)TEST_WIDTH * sizeof(RGBPixel);
+    RGBPixel *row = malloc(row_bytes);
+    int x, y;
+
+    if (row == NULL) {
+        fprintf(stderr, "Error: write_rows: Unable to allocate a row\n");
+        return -1;
+    }
+    for (y=first; y<first + count; y++) {
+        for (x=0; x<TEST_WIDTH; x++) {
+            row[x] = pattern(x, y);
+        }
+        if (pwrite(fd, row, row_bytes, raster + (off_t)y * row_bytes) != (ssize_t)row_bytes) {
+            perror("Error: write_rows");
+            free(row);
+            return -1;
+        }
+    }
+    free(row);
+    return 0;
+}
+
+/**
+ * Checks rows of the decoded image against the pattern
+ * @param img decoded image
+ * @param first first row to check
+ * @param count number of rows
+ * @return number of pixels that didn't match
+ */
+static long check_rows(const image *img, int first, int count) {
+    long wrong = 0;
+    int x, y;
+
+    for (y=first; y<first + count; y++) {
+        const RGBPixel *row = img->pixmap + (size_t)y * img->width;
+        for (x=0; x<img->width; x++) {
+            RGBPixel want = pattern(x, y);
+            if (memcmp(&row[x], &want, sizeof(RGBPixel)) != 0) {
+                if (wrong == 0) {
+                    fprintf(stderr, "Error: check_rows: pixel (%d, %d) is %d %d %d, expected %d %d %d\n",
+                            x, y, row[x].r, row[x].g, row[x].b, want.r, want.g, want.b);
+                }
+                wrong++;
+            }
+        }
+    }
+    return wrong;
+}
+
+int main(int argc, char *argv[]) {
+    const char *dir = argc > 1 ? argv[1] : getenv("TMPDIR");
+    size_t row_bytes = (size_t)TEST_WIDTH * sizeof(RGBPixel);
+    // the row holding byte 2^32 of the raster, and the rows either side of it
+    int wrap_row = (int)((4ULL << 30) / row_bytes) - 1;
+    char path[MAX_SIZE], magic[64];
+    header hdr;
+    image img;
+    FILE *fh;
+    off_t raster;
+    long wrong;
+    int fd, magic_length;
+
+    if (dir == NULL || dir[0] == '\0') {
+        dir = "/tmp";
+    }
+    snprintf(path, sizeof(path), "%s/ppmrw_largefile_%d.ppm", dir, (int)getpid());
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("Error: main: creating the test file");
+        return 1;
+    }
+
+    magic_length = snprintf(magic, sizeof(magic), "P6\n%d %d\n255\n", TEST_WIDTH, TEST_HEIGHT);
+    raster = magic_length;
+    if (write(fd, magic, magic_length) != magic_length ||
+        ftruncate(fd, raster + (off_t)row_bytes * TEST_HEIGHT) < 0) {
+        perror("Error: main: writing the test file");
+        close(fd);
+        unlink(path);
+        return 1;
+    }
+    if (write_rows(fd, raster, wrap_row, 3) < 0 ||
+        write_rows(fd, raster, TEST_HEIGHT - TAIL_ROWS, TAIL_ROWS) < 0) {
+        close(fd);
+        unlink(path);
+        return 1;
+    }
+    close(fd);
+
+    fh = fopen(path, "rb");
+    // the file has been opened, so it goes away once it's closed
+    unlink(path);
+    if (fh == NULL) {
+        perror("Error: main: opening the test file");
+        return 1;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    if (read_header(fh, &hdr) < 0 || read_pnm_data(fh, &hdr, &img) < 0) {
+        fprintf(stderr, "Error: main: Unable to decode the %dx%d test image\n",
+                TEST_WIDTH, TEST_HEIGHT);
+        fclose(fh);
+        return 1;
+    }
+    fclose(fh);
+
+    if (img.width != TEST_WIDTH || img.height != TEST_HEIGHT) {
+        fprintf(stderr, "Error: main: decoded a %dx%d image, expected %dx%d\n",
+                img.width, img.height, TEST_WIDTH, TEST_HEIGHT);
+        free_image(&img);
+        return 1;
+    }
+    wrong = check_rows(&img, wrap_row, 3) + check_rows(&img, TEST_HEIGHT - TAIL_ROWS, TAIL_ROWS);
+    printf("%dx%d P6, %.2f GB, %s: %ld wrong pixels around 4 GB and in the last %d rows\n",
+           TEST_WIDTH, TEST_HEIGHT, (raster + (off_t)row_bytes * TEST_HEIGHT) / 1e9,
+           img.map_base != NULL ? "mapped" : "read", wrong, TAIL_ROWS);
+    free_image(&img);
+    return wrong == 0 ? 0 : 1;
+}
@@ -0,0 +1,810 @@
+/** ppmsimd - vectorized kernels for ppmrw
+ * Each kernel has a scalar version that works everywhere plus SSE2/AVX2
+ * versions on x86. The best version for the running CPU is picked the
+ * first time a kernel is called.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "ppmsimd.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PPM_X86 1
+#include <immintrin.h>
+#endif
+
+#define IS_DIGIT(c) ((unsigned char)((c) - '0') < 10)
+#define IS_SPACE(c) ((c) == ' ' || (unsigned char)((c) - '\t') < 5)
+
+typedef size_t (*p3_parse_fn)(const char **, const char *, void *, size_t,
+                              int, unsigned int *);
+typedef size_t (*p3_count_fn)(const char *, const char *);
+typedef unsigned int (*be16_fn)(unsigned short *, const unsigned char *, size_t);
+typedef void (*narrow16_fn)(unsigned char *, const unsigned short *, size_t);
+typedef unsigned int (*copy_max8_fn)(unsigned char *, const unsigned char *, size_t);
+typedef unsigned int (*scale8_fn)(unsigned char *, const unsigned char *, size_t, int);
+typedef void (*expand_bits_fn)(unsigned char *, const unsigned char *, size_t);
+typedef void (*box8_fn)(unsigned char *, const unsigned char *, const unsigned char *,
+                        size_t, int);
+
+// the implementations picked for the running CPU
+typedef struct kernels_t {
+    p3_parse_fn p3_parse;
+    p3_count_fn p3_count;
+    be16_fn be16;
+    narrow16_fn narrow16;
+    copy_max8_fn copy_max8;
+    scale8_fn scale8;
+    expand_bits_fn expand_bits;
+    box8_fn box8;
+} kernels;
+
+// n / divisor computed as (n * magic) >> (16 + shift) in 16-bit lanes
+typedef struct divider_t {
+    unsigned int magic;
+    unsigned int shift;
+} divider;
+
+
+/*******************************************************//**
+ * P3 sample parsing
+ * ********************************************************/
+
+/**
+ * Appends one decimal digit to a sample value, saturating at 65535 so
+ * absurdly long tokens can't overflow
+ */
+static inline unsigned int add_digit(unsigned int v, char c) {
+    v = v * 10 + (unsigned int)(c - '0');
+    return v > 65535 ? 65535 : v;
+}
+
+/**
+ * Stores sample n as an 8 or 16 bit value
+ */
+static inline void store_sample(void *out, size_t n, int sample_bytes, unsigned int v) {
+    if (sample_bytes == 2) {
+        ((unsigned short *)out)[n] = (unsigned short)v;
+    }
+    else {
+        ((unsigned char *)out)[n] = (unsigned char)v;
+    }
+}
+
+static size_t parse_scalar(const char **pp, const char *end, void *out,
+                           size_t count, int sample_bytes, unsigned int *max_seen) {
+    const char *p = *pp;
+    unsigned int max = *max_seen;
+    size_t n = 0;
+
+    while (n < count) {
+        unsigned int v = 0;
+        while (p < end && IS_SPACE(*p)) { p++; }
+        if (p == end || !IS_DIGIT(*p)) {
+            break;
+        }
+        while (p < end && IS_DIGIT(*p)) {
+            v = add_digit(v, *p++);
+        }
+        // a token has to end in whitespace or at the end of the data
+        if (p < end && !IS_SPACE(*p)) {
+            break;
+        }
+        store_sample(out, n++, sample_bytes, v);
+        if (v > max) {
+            max = v;
+        }
+    }
+    *pp = p;
+    *max_seen = max;
+    return n;
+}
+
+static size_t count_scalar(const char *p, const char *end) {
+    size_t n = 0;
+    int in_token = 0;
+    for (; p < end; p++) {
+        int digit = IS_DIGIT(*p);
+        n += digit && !in_token;
+        in_token = digit;
+    }
+    return n;
+}
+
+#ifdef PPM_X86
+
+/**
+ * Parses the tokens of a 32 byte window that holds only digits and
+ * whitespace, given a bitmask of which bytes are digits.
+ * @return offset to continue from. A token that runs off the end of the
+ *         window is left for the next window, so this can be less than 32
+ */
+static inline unsigned int parse_window(const char *p, uint32_t digits,
+                                        void *out, size_t *n, size_t count,
+                                        int sample_bytes, unsigned int *max) {
+    uint32_t nondigits = ~digits;
+    unsigned int i = 0;
+
+    while (*n < count && i < 32) {
+        uint32_t starts = digits & (0xffffffffu << i);
+        uint32_t ends;
+        unsigned int s, e, v = 0;
+
+        if (starts == 0) {
+            return 32;
+        }
+        s = __builtin_ctz(starts);
+        ends = nondigits & (0xffffffffu << s);
+        if (ends == 0) {
+            return s;
+        }
+        e = __builtin_ctz(ends);
+        for (i=s; i<e; i++) {
+            v = add_digit(v, p[i]);
+        }
+        store_sample(out, (*n)++, sample_bytes, v);
+        if (v > *max) {
+            *max = v;
+        }
+    }
+    return i;
+}
+
+__attribute__((target("sse2")))
+static size_t parse_sse2(const char **pp, const char *end, void *out,
+                         size_t count, int sample_bytes, unsigned int *max_seen) {
+    const __m128i zero = _mm_set1_epi8('0');
+    const __m128i nine = _mm_set1_epi8(9);
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i four = _mm_set1_epi8(4);
+    const __m128i space = _mm_set1_epi8(' ');
+    const char *p = *pp;
+    size_t n = 0;
+    size_t parsed;
+
+    while (n < count && end - p >= 32) {
+        uint32_t digits = 0, spaces = 0;
+        unsigned int half, adv;
+        for (half=0; half<2; half++) {
+            __m128i c = _mm_loadu_si128((const __m128i *)(p + 16 * half));
+            __m128i d = _mm_sub_epi8(c, zero);
+            __m128i w = _mm_sub_epi8(c, tab);
+            __m128i is_digit = _mm_cmpeq_epi8(_mm_min_epu8(d, nine), d);
+            __m128i is_space = _mm_or_si128(_mm_cmpeq_epi8(c, space),
+                                            _mm_cmpeq_epi8(_mm_min_epu8(w, four), w));
+            digits |= (uint32_t)_mm_movemask_epi8(is_digit) << (16 * half);
+            spaces |= (uint32_t)_mm_movemask_epi8(is_space) << (16 * half);
+        }
+        // let the scalar code find and report anything unexpected
+        if ((digits | spaces) != 0xffffffffu) {
+            break;
+        }
+        adv = parse_window(p, digits, out, &n, count, sample_bytes, max_seen);
+        if (adv == 0) {
+            break;
+        }
+        p += adv;
+    }
+    parsed = parse_scalar(&p, end, (char *)out + n * sample_bytes, count - n,
+                          sample_bytes, max_seen);
+    *pp = p;
+    return n + parsed;
+}
+
+__attribute__((target("avx2")))
+static size_t parse_avx2(const char **pp, const char *end, void *out,
+                         size_t count, int sample_bytes, unsigned int *max_seen) {
+    const __m256i zero = _mm256_set1_epi8('0');
+    const __m256i nine = _mm256_set1_epi8(9);
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i four = _mm256_set1_epi8(4);
+    const __m256i space = _mm256_set1_epi8(' ');
+    const char *p = *pp;
+    size_t n = 0;
+    size_t parsed;
+
+    while (n < count && end - p >= 32) {
+        __m256i c = _mm256_loadu_si256((const __m256i *)p);
+        __m256i d = _mm256_sub_epi8(c, zero);
+        __m256i w = _mm256_sub_epi8(c, tab);
+        __m256i is_digit = _mm256_cmpeq_epi8(_mm256_min_epu8(d, nine), d);
+        __m256i is_space = _mm256_or_si256(_mm256_cmpeq_epi8(c, space),
+                                           _mm256_cmpeq_epi8(_mm256_min_epu8(w, four), w));
+        uint32_t digits = (uint32_t)_mm256_movemask_epi8(is_digit);
+        uint32_t spaces = (uint32_t)_mm256_movemask_epi8(is_space);
+        unsigned int adv;
+
+        if ((digits | spaces) != 0xffffffffu) {
+            break;
+        }
+        adv = parse_window(p, digits, out, &n, count, sample_bytes, max_seen);
+        if (adv == 0) {
+            break;
+        }
+        p += adv;
+    }
+    parsed = parse_scalar(&p, end, (char *)out + n * sample_bytes, count - n,
+                          sample_bytes, max_seen);
+    *pp = p;
+    return n + parsed;
+}
+
+__attribute__((target("sse2")))
+static size_t count_sse2(const char *p, const char *end) {
+    const __m128i zero = _mm_set1_epi8('0');
+    const __m128i nine = _mm_set1_epi8(9);
+    uint32_t carry = 0;
+    size_t n = 0;
+
+    for (; end - p >= 16; p += 16) {
+        __m128i d = _mm_sub_epi8(_mm_loadu_si128((const __m128i *)p), zero);
+        uint32_t digits = (uint32_t)_mm_movemask_epi8(
+                _mm_cmpeq_epi8(_mm_min_epu8(d, nine), d));
+        // a sample starts at every digit that doesn't follow another digit
+        n += __builtin_popcount(digits & ~((digits << 1) | carry));
+        carry = digits >> 15;
+    }
+    return n - (carry && p < end && IS_DIGIT(*p)) + count_scalar(p, end);
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t count_avx2(const char *p, const char *end) {
+    const __m256i zero = _mm256_set1_epi8('0');
+    const __m256i nine = _mm256_set1_epi8(9);
+    uint32_t carry = 0;
+    size_t n = 0;
+
+    for (; end - p >= 32; p += 32) {
+        __m256i d = _mm256_sub_epi8(_mm256_loadu_si256((const __m256i *)p), zero);
+        uint32_t digits = (uint32_t)_mm256_movemask_epi8(
+                _mm256_cmpeq_epi8(_mm256_min_epu8(d, nine), d));
+        n += __builtin_popcount(digits & ~((digits << 1) | carry));
+        carry = digits >> 31;
+    }
+    return n - (carry && p < end && IS_DIGIT(*p)) + count_scalar(p, end);
+}
+
+#endif
+
+/*******************************************************//**
+ * 8-bit samples
+ * ********************************************************/
+
+/**
+ * Finds a multiply-high and shift that divide v * 255 + max / 2 by max
+ * exactly for every valid sample v, so normalization can be vectorized
+ * @param max max color value, 1 to 254
+ * @param div set to the magic number and shift
+ * @return 0 on success, -1 if there is none (use the lookup table)
+ */
+static int find_divider(int max, divider *div) {
+    unsigned int shift, v;
+    for (shift=0; shift<=8; shift++) {
+        unsigned long magic = ((1ul << (16 + shift)) + max - 1) / max;
+        if (magic > 65535) {
+            break;
+        }
+        for (v=0; v<=(unsigned int)max; v++) {
+            unsigned long n = v * 255 + max / 2;
+            if ((n * magic) >> (16 + shift) != n / max) {
+                break;
+            }
+        }
+        if (v > (unsigned int)max) {
+            div->magic = (unsigned int)magic;
+            div->shift = shift;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @return largest of n bytes
+ */
+static unsigned int max_of_bytes(const unsigned char *lanes, int n) {
+    unsigned int max = 0;
+    int k;
+    for (k=0; k<n; k++) {
+        if (lanes[k] > max) {
+            max = lanes[k];
+        }
+    }
+    return max;
+}
+
+static unsigned int copy_max8_scalar(unsigned char *dst, const unsigned char *src, size_t count) {
+    unsigned int max = 0;
+    size_t i;
+    // src may be read only memory when dst is the same buffer
+    if (dst != src) {
+        memcpy(dst, src, count);
+    }
+    for (i=0; i<count; i++) {
+        if (src[i] > max) {
+            max = src[i];
+        }
+    }
+    return max;
+}
+
+static unsigned int scale8_scalar(unsigned char *dst, const unsigned char *src,
+                                  size_t count, int max) {
+    unsigned char table[256];
+    unsigned int seen = 0;
+    unsigned int v;
+    size_t i;
+
+    // out of range entries are never used, the caller rejects the image
+    for (v=0; v<256; v++) {
+        table[v] = (unsigned char)((v * 255 + max / 2) / max);
+    }
+    for (i=0; i<count; i++) {
+        v = src[i];
+        if (v > seen) {
+            seen = v;
+        }
+        dst[i] = table[v];
+    }
+    return seen;
+}
+
+#ifdef PPM_X86
+
+__attribute__((target("sse2")))
+static unsigned int copy_max8_sse2(unsigned char *dst, const unsigned char *src, size_t count) {
+    __m128i max = _mm_setzero_si128();
+    unsigned char lanes[16];
+    unsigned int result, tail;
+    size_t i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        max = _mm_max_epu8(max, v);
+        if (dst != src) {
+            _mm_storeu_si128((__m128i *)(dst + i), v);
+        }
+    }
+    _mm_storeu_si128((__m128i *)lanes, max);
+    result = max_of_bytes(lanes, 16);
+    tail = copy_max8_scalar(dst + i, src + i, count - i);
+    return tail > result ? tail : result;
+}
+
+__attribute__((target("avx2")))
+static unsigned int copy_max8_avx2(unsigned char *dst, const unsigned char *src, size_t count) {
+    __m256i max = _mm256_setzero_si256();
+    unsigned char lanes[32];
+    unsigned int result, tail;
+    size_t i = 0;
+
+    for (; i + 32 <= count; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+        max = _mm256_max_epu8(max, v);
+        if (dst != src) {
+            _mm256_storeu_si256((__m256i *)(dst + i), v);
+        }
+    }
+    _mm256_storeu_si256((__m256i *)lanes, max);
+    result = max_of_bytes(lanes, 32);
+    tail = copy_max8_scalar(dst + i, src + i, count - i);
+    return tail > result ? tail : result;
+}
+
+__attribute__((target("sse2")))
+static unsigned int scale8_sse2(unsigned char *dst, const unsigned char *src,
+                                size_t count, int max) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i k255 = _mm_set1_epi16(255);
+    const __m128i bias = _mm_set1_epi16((short)(max / 2));
+    __m128i seen = zero;
+    __m128i magic, shift;
+    unsigned char lanes[16];
+    unsigned int result, tail;
+    divider div;
+    size_t i = 0;
+
+    if (find_divider(max, &div) < 0) {
+        return scale8_scalar(dst, src, count, max);
+    }
+    magic = _mm_set1_epi16((short)div.magic);
+    shift = _mm_cvtsi32_si128((int)div.shift);
+
+    for (; i + 16 <= count; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i lo = _mm_unpacklo_epi8(v, zero);
+        __m128i hi = _mm_unpackhi_epi8(v, zero);
+        seen = _mm_max_epu8(seen, v);
+        // (v * 255 + max / 2) / max
+        lo = _mm_add_epi16(_mm_mullo_epi16(lo, k255), bias);
+        hi = _mm_add_epi16(_mm_mullo_epi16(hi, k255), bias);
+        lo = _mm_srl_epi16(_mm_mulhi_epu16(lo, magic), shift);
+        hi = _mm_srl_epi16(_mm_mulhi_epu16(hi, magic), shift);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
+    }
+    _mm_storeu_si128((__m128i *)lanes, seen);
+    result = max_of_bytes(lanes, 16);
+    tail = scale8_scalar(dst + i, src + i, count - i, max);
+    return tail > result ? tail : result;
+}
+
+__attribute__((target("avx2")))
+static unsigned int scale8_avx2(unsigned char *dst, const unsigned char *src,
+                                size_t count, int max) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i k255 = _mm256_set1_epi16(255);
+    const __m256i bias = _mm256_set1_epi16((short)(max / 2));
+    __m256i seen = zero;
+    __m256i magic;
+    __m128i shift;
+    unsigned char lanes[32];
+    unsigned int result, tail;
+    divider div;
+    size_t i = 0;
+
+    if (find_divider(max, &div) < 0) {
+        return scale8_scalar(dst, src, count, max);
+    }
+    magic = _mm256_set1_epi16((short)div.magic);
+    shift = _mm_cvtsi32_si128((int)div.shift);
+
+    // unpack and pack both work within 128-bit lanes, so byte order is kept
+    for (; i + 32 <= count; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i lo = _mm256_unpacklo_epi8(v, zero);
+        __m256i hi = _mm256_unpackhi_epi8(v, zero);
+        seen = _mm256_max_epu8(seen, v);
+        lo = _mm256_add_epi16(_mm256_mullo_epi16(lo, k255), bias);
+        hi = _mm256_add_epi16(_mm256_mullo_epi16(hi, k255), bias);
+        lo = _mm256_srl_epi16(_mm256_mulhi_epu16(lo, magic), shift);
+        hi = _mm256_srl_epi16(_mm256_mulhi_epu16(hi, magic), shift);
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_packus_epi16(lo, hi));
+    }
+    _mm256_storeu_si256((__m256i *)lanes, seen);
+    result = max_of_bytes(lanes, 32);
+    tail = scale8_scalar(dst + i, src + i, count - i, max);
+    return tail > result ? tail : result;
+}
+
+#endif
+
+/*******************************************************//**
+ * 16-bit samples
+ * ********************************************************/
+
+static unsigned int be16_scalar(unsigned short *dst, const unsigned char *src, size_t count) {
+    unsigned int max = 0;
+    size_t i;
+    for (i=0; i<count; i++) {
+        unsigned int v = (unsigned int)src[2 * i] << 8 | src[2 * i + 1];
+        dst[i] = (unsigned short)v;
+        if (v > max) {
+            max = v;
+        }
+    }
+    return max;
+}
+
+static void narrow16_scalar(unsigned char *dst, const unsigned short *src, size_t count) {
+    size_t i;
+    for (i=0; i<count; i++) {
+        dst[i] = (unsigned char)(src[i] >> 8);
+    }
+}
+
+void scale16_samples(unsigned short *samples, size_t count, int max_color_val) {
+    unsigned int max = (unsigned int)max_color_val;
+    size_t i;
+    for (i=0; i<count; i++) {
+        samples[i] = (unsigned short)((samples[i] * 65535u + max / 2) / max);
+    }
+}
+
+#ifdef PPM_X86
+
+__attribute__((target("sse2")))
+static unsigned int be16_sse2(unsigned short *dst, const unsigned char *src, size_t count) {
+    // SSE2 only has a signed 16-bit max, so compare with the sign bit flipped
+    const __m128i bias = _mm_set1_epi16((short)0x8000);
+    __m128i max = bias;
+    unsigned short lanes[8];
+    unsigned int result, tail;
+    size_t i = 0;
+    int k;
+
+    for (; i + 8 <= count; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        _mm_storeu_si128((__m128i *)(dst + i), v);
+        max = _mm_max_epi16(max, _mm_xor_si128(v, bias));
+    }
+    _mm_storeu_si128((__m128i *)lanes, _mm_xor_si128(max, bias));
+    result = 0;
+    for (k=0; k<8; k++) {
+        if (lanes[k] > result) {
+            result = lanes[k];
+        }
+    }
+    tail = be16_scalar(dst + i, src + 2 * i, count - i);
+    return tail > result ? tail : result;
+}
+
+__attribute__((target("avx2")))
+static unsigned int be16_avx2(unsigned short *dst, const unsigned char *src, size_t count) {
+    __m256i max = _mm256_setzero_si256();
+    unsigned short lanes[16];
+    unsigned int result, tail;
+    size_t i = 0;
+    int k;
+
+    for (; i + 16 <= count; i += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + 2 * i));
+        v = _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8));
+        _mm256_storeu_si256((__m256i *)(dst + i), v);
+        max = _mm256_max_epu16(max, v);
+    }
+    _mm256_storeu_si256((__m256i *)lanes, max);
+    result = 0;
+    for (k=0; k<16; k++) {
+        if (lanes[k] > result) {
+            result = lanes[k];
+        }
+    }
+    tail = be16_scalar(dst + i, src + 2 * i, count - i);
+    return tail > result ? tail : result;
+}
+
+__attribute__((target("sse2")))
+static void narrow16_sse2(unsigned char *dst, const unsigned short *src, size_t count) {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i lo = _mm_srli_epi16(_mm_loadu_si128((const __m128i *)(src + i)), 8);
+        __m128i hi = _mm_srli_epi16(_mm_loadu_si128((const __m128i *)(src + i + 8)), 8);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
+    }
+    narrow16_scalar(dst + i, src + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void narrow16_avx2(unsigned char *dst, const unsigned short *src, size_t count) {
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m256i lo = _mm256_srli_epi16(_mm256_loadu_si256((const __m256i *)(src + i)), 8);
+        __m256i hi = _mm256_srli_epi16(_mm256_loadu_si256((const __m256i *)(src + i + 16)), 8);
+        // packus works within 128-bit lanes, so put the quadwords back in order
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), 0xd8);
+        _mm256_storeu_si256((__m256i *)(dst + i), packed);
+    }
+    narrow16_scalar(dst + i, src + i, count - i);
+}
+
+#endif
+
+/*******************************************************//**
+ * Bitmaps
+ * ********************************************************/
+
+static void expand_bits_scalar(unsigned char *dst, const unsigned char *src, size_t count) {
+    size_t i;
+    for (i=0; i<count; i++) {
+        dst[i] = (src[i / 8] & (0x80 >> (i % 8))) ? 0 : 255;
+    }
+}
+
+#ifdef PPM_X86
+
+__attribute__((target("sse2")))
+static void expand_bits_sse2(unsigned char *dst, const unsigned char *src, size_t count) {
+    const __m128i bits = _mm_set_epi8(1, 2, 4, 8, 16, 32, 64, (char)128,
+                                      1, 2, 4, 8, 16, 32, 64, (char)128);
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+
+    // two source bytes per 16 pixels, each byte spread across 8 lanes
+    for (; i + 16 <= count; i += 16) {
+        __m128i v = _mm_cvtsi32_si128(src[i / 8] | (src[i / 8 + 1] << 8));
+        v = _mm_unpacklo_epi8(v, v);
+        v = _mm_unpacklo_epi16(v, v);
+        v = _mm_unpacklo_epi32(v, v);
+        // a set bit is black
+        v = _mm_cmpeq_epi8(_mm_and_si128(v, bits), zero);
+        _mm_storeu_si128((__m128i *)(dst + i), v);
+    }
+    expand_bits_scalar(dst + i, src + i / 8, count - i);
+}
+
+__attribute__((target("avx2")))
+static void expand_bits_avx2(unsigned char *dst, const unsigned char *src, size_t count) {
+    const __m256i spread = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+                                            2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+    const __m256i bits = _mm256_set1_epi64x((long long)0x0102040810204080ull);
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+
+    // four source bytes per 32 pixels
+    for (; i + 32 <= count; i += 32) {
+        int32_t word;
+        __m256i v;
+        memcpy(&word, src + i / 8, 4);
+        v = _mm256_shuffle_epi8(_mm256_set1_epi32(word), spread);
+        v = _mm256_cmpeq_epi8(_mm256_and_si256(v, bits), zero);
+        _mm256_storeu_si256((__m256i *)(dst + i), v);
+    }
+    expand_bits_scalar(dst + i, src + i / 8, count - i);
+}
+
+#endif
+
+/*******************************************************//**
+ * 2x2 box filter
+ * ********************************************************/
+
+/**
+ * Averages the 2x2 blocks of pixels starting at pixel pair first, rounding
+ * to nearest. An odd last pixel is paired with itself.
+ */
+static void box8_scalar_from(unsigned char *dst, const unsigned char *row0,
+                             const unsigned char *row1, size_t width, int channels,
+                             size_t first) {
+    size_t out_width = (width + 1) / 2;
+    size_t p;
+    int c;
+
+    for (p=first; p<out_width; p++) {
+        size_t left = 2 * p * channels;
+        size_t right = (2 * p + 1 < width) ? left + channels : left;
+        for (c=0; c<channels; c++) {
+            dst[p * channels + c] = (unsigned char)((row0[left + c] + row0[right + c] +
+                                                     row1[left + c] + row1[right + c] + 2) >> 2);
+        }
+    }
+}
+
+static void box8_scalar(unsigned char *dst, const unsigned char *row0, const unsigned char *row1,
+                        size_t width, int channels) {
+    box8_scalar_from(dst, row0, row1, width, channels, 0);
+}
+
+void box16_rows(unsigned short *dst, const unsigned short *row0, const unsigned short *row1,
+                size_t width, int channels) {
+    size_t out_width = (width + 1) / 2;
+    size_t p;
+    int c;
+
+    for (p=0; p<out_width; p++) {
+        size_t left = 2 * p * channels;
+        size_t right = (2 * p + 1 < width) ? left + channels : left;
+        for (c=0; c<channels; c++) {
+            dst[p * channels + c] = (unsigned short)((row0[left + c] + row0[right + c] +
+                                                      row1[left + c] + row1[right + c] + 2u) >> 2);
+        }
+    }
+}
+
+#ifdef PPM_X86
+
+/*
+ * Per channel count: byte shuffles that pick the left and the right pixel
+ * of each pair in a 16-byte window and widen them to 16 bits, and how many
+ * pixel pairs one window holds
+ */
+static const signed char box_left[5][16] = {
+    { 0 },
+    { 0,-1, 2,-1, 4,-1, 6,-1, 8,-1,10,-1,12,-1,14,-1 },
+    { 0,-1, 1,-1, 4,-1, 5,-1, 8,-1, 9,-1,12,-1,13,-1 },
+    { 0,-1, 1,-1, 2,-1, 6,-1, 7,-1, 8,-1,-1,-1,-1,-1 },
+    { 0,-1, 1,-1, 2,-1, 3,-1, 8,-1, 9,-1,10,-1,11,-1 }
+};
+static const signed char box_right[5][16] = {
+    { 0 },
+    { 1,-1, 3,-1, 5,-1, 7,-1, 9,-1,11,-1,13,-1,15,-1 },
+    { 2,-1, 3,-1, 6,-1, 7,-1,10,-1,11,-1,14,-1,15,-1 },
+    { 3,-1, 4,-1, 5,-1, 9,-1,10,-1,11,-1,-1,-1,-1,-1 },
+    { 4,-1, 5,-1, 6,-1, 7,-1,12,-1,13,-1,14,-1,15,-1 }
+};
+static const int box_pairs[5] = { 0, 8, 4, 2, 2 };
+
+__attribute__((target("ssse3")))
+static void box8_ssse3(unsigned char *dst, const unsigned char *row0, const unsigned char *row1,
+                       size_t width, int channels) {
+    const __m128i left = _mm_loadu_si128((const __m128i *)box_left[channels]);
+    const __m128i right = _mm_loadu_si128((const __m128i *)box_right[channels]);
+    const __m128i two = _mm_set1_epi16(2);
+    size_t pairs = box_pairs[channels];
+    size_t in_bytes = width * channels;
+    size_t out_bytes = (width + 1) / 2 * channels;
+    size_t p = 0;
+
+    // whole 16-byte loads and 8-byte stores; the rest is done below
+    for (; 2 * p * channels + 16 <= in_bytes && p * channels + 8 <= out_bytes; p += pairs) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(row0 + 2 * p * channels));
+        __m128i b = _mm_loadu_si128((const __m128i *)(row1 + 2 * p * channels));
+        __m128i sum = _mm_add_epi16(_mm_add_epi16(_mm_shuffle_epi8(a, left), _mm_shuffle_epi8(a, right)),
+                                    _mm_add_epi16(_mm_shuffle_epi8(b, left), _mm_shuffle_epi8(b, right)));
+        sum = _mm_srli_epi16(_mm_add_epi16(sum, two), 2);
+        _mm_storel_epi64((__m128i *)(dst + p * channels), _mm_packus_epi16(sum, sum));
+    }
+    box8_scalar_from(dst, row0, row1, width, channels, p);
+}
+
+#endif
+
+static kernels active;
+static pthread_once_t resolve_once = PTHREAD_ONCE_INIT;
+
+static void resolve_kernels(void) {
+    active.p3_parse = parse_scalar;
+    active.p3_count = count_scalar;
+    active.be16 = be16_scalar;
+    active.narrow16 = narrow16_scalar;
+    active.copy_max8 = copy_max8_scalar;
+    active.scale8 = scale8_scalar;
+    active.expand_bits = expand_bits_scalar;
+    active.box8 = box8_scalar;
+#ifdef PPM_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+        active.p3_parse = parse_avx2;
+        active.p3_count = count_avx2;
+        active.be16 = be16_avx2;
+        active.narrow16 = narrow16_avx2;
+        active.copy_max8 = copy_max8_avx2;
+        active.scale8 = scale8_avx2;
+        active.expand_bits = expand_bits_avx2;
+    }
+    else if (__builtin_cpu_supports("sse2")) {
+        active.p3_parse = parse_sse2;
+        active.p3_count = count_sse2;
+        active.be16 = be16_sse2;
+        active.narrow16 = narrow16_sse2;
+        active.copy_max8 = copy_max8_sse2;
+        active.scale8 = scale8_sse2;
+        active.expand_bits = expand_bits_sse2;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        active.box8 = box8_ssse3;
+    }
+#endif
+}
+
+static const kernels *get_kernels(void) {
+    pthread_once(&resolve_once, resolve_kernels);
+    return &active;
+}
+
+size_t p3_parse_samples(const char **pp, const char *end, void *out,
+                        size_t count, int sample_bytes, unsigned int *max_seen) {
+    *max_seen = 0;
+    return get_kernels()->p3_parse(pp, end, out, count, sample_bytes, max_seen);
+}
+
+size_t p3_count_samples(const char *p, const char *end) {
+    return get_kernels()->p3_count(p, end);
+}
+
+unsigned int be16_samples(unsigned short *dst, const unsigned char *src, size_t count) {
+    return get_kernels()->be16(dst, src, count);
+}
+
+void narrow16_samples(unsigned char *dst, const unsigned short *src, size_t count) {
+    get_kernels()->narrow16(dst, src, count);
+}
+
+unsigned int copy_max8_samples(unsigned char *dst, const unsigned char *src, size_t count) {
+    return get_kernels()->copy_max8(dst, src, count);
+}
+
+unsigned int scale8_samples(unsigned char *dst, const unsigned char *src, size_t count,
+                            int max_color_val) {
+    return get_kernels()->scale8(dst, src, count, max_color_val);
+}
+
+void expand_bits(unsigned char *dst, const unsigned char *src, size_t count) {
+    get_kernels()->expand_bits(dst, src, count);
+}
+
+void box8_rows(unsigned char *dst, const unsigned char *row0, const unsigned char *row1,
+               size_t width, int channels) {
+    get_kernels()->box8(dst, row0, row1, width, channels);
+}
@@ -0,0 +1,112 @@
+/* ppmsimd header file - vectorized kernels used by ppmrw */
+#ifndef PPMSIMD_H
+#define PPMSIMD_H
+
+#include <stddef.h>
+
+/**
+ * Parses whitespace separated decimal samples from a P3 raster.
+ * Stops after count samples, at end, or at the first character that is
+ * neither whitespace nor a digit (*pp is left pointing at it).
+ * Values larger than 65535 saturate; the largest value seen is returned
+ * through max_seen so the caller can range check the whole run at once.
+ * @param pp in: where to start parsing. out: first unparsed character
+ * @param end one past the last byte of the raster
+ * @param out destination for the parsed samples
+ * @param count number of samples wanted
+ * @param sample_bytes 1 to store unsigned chars, 2 to store unsigned shorts
+ * @param max_seen set to the largest sample value parsed
+ * @return number of samples parsed
+ */
+size_t p3_parse_samples(const char **pp, const char *end, void *out,
+                        size_t count, int sample_bytes, unsigned int *max_seen);
+
+/**
+ * Counts the whitespace separated digit runs in part of a P3 raster.
+ * Anything that isn't a digit is treated as a separator; validation is left
+ * to p3_parse_samples().
+ * @param p first byte to look at
+ * @param end one past the last byte to look at
+ * @return number of samples found
+ */
+size_t p3_count_samples(const char *p, const char *end);
+
+/**
+ * Converts big-endian 16-bit samples (as stored in a file) to native
+ * unsigned shorts. dst may be the same buffer as src.
+ * @param dst destination for count samples
+ * @param src 2 * count bytes of big-endian samples
+ * @param count number of samples
+ * @return largest sample value converted
+ */
+unsigned int be16_samples(unsigned short *dst, const unsigned char *src, size_t count);
+
+/**
+ * Keeps the high byte of each 16-bit sample, the usual fast 8-bit
+ * equivalent for images with a max color value of 65535
+ * @param dst destination for count samples
+ * @param src count native 16-bit samples
+ * @param count number of samples
+ */
+void narrow16_samples(unsigned char *dst, const unsigned short *src, size_t count);
+
+/**
+ * Copies 8-bit samples and finds the largest one in the same pass, so a
+ * raster can be range checked while it is moved. dst may equal src.
+ * @param dst destination for count samples
+ * @param src count samples
+ * @param count number of samples
+ * @return largest sample value
+ */
+unsigned int copy_max8_samples(unsigned char *dst, const unsigned char *src, size_t count);
+
+/**
+ * Scales 8-bit samples with a max color value below 255 up to 0-255,
+ * rounding to nearest, and finds the largest source sample in the same
+ * pass. dst may equal src.
+ * @param dst destination for count samples
+ * @param src count samples
+ * @param count number of samples
+ * @param max_color_val max color value of src, 1 to 254
+ * @return largest source sample value (out of range if > max_color_val)
+ */
+unsigned int scale8_samples(unsigned char *dst, const unsigned char *src, size_t count,
+                            int max_color_val);
+
+/**
+ * Scales native 16-bit samples in place up to 0-65535, rounding to nearest
+ * @param samples count samples, none above max_color_val
+ * @param count number of samples
+ * @param max_color_val max color value of the samples, 256 to 65534
+ */
+void scale16_samples(unsigned short *samples, size_t count, int max_color_val);
+
+/**
+ * Unpacks one row of a P4 bitmap, most significant bit first, to 8-bit
+ * gray: a set bit (black) becomes 0 and a clear bit 255
+ * @param dst destination for count pixels
+ * @param src (count + 7) / 8 bytes of packed bits
+ * @param count number of pixels
+ */
+void expand_bits(unsigned char *dst, const unsigned char *src, size_t count);
+
+/**
+ * Halves a pair of rows with a 2x2 box filter, rounding to nearest. The
+ * output has (width + 1) / 2 pixels; an odd last pixel is averaged with
+ * itself.
+ * @param dst destination for the output row
+ * @param row0 first row, width * channels samples
+ * @param row1 second row (may be row0 for an odd last row)
+ * @param width pixels in each input row
+ * @param channels samples per pixel, 1 to 4
+ */
+void box8_rows(unsigned char *dst, const unsigned char *row0, const unsigned char *row1,
+               size_t width, int channels);
+
+/**
+ * Same as box8_rows() for native 16-bit samples
+ */
+void box16_rows(unsigned short *dst, const unsigned short *row0, const unsigned short *row1,
+                size_t width, int channels);
+
+#endif
@@ -0,0 +1,505 @@
+/** ppmstream - incremental ppm decoding
+ * Bytes are fed in as they arrive (from a pipe, socket or file) and every
+ * completed row of pixels is handed to a callback. Only one row is ever
+ * buffered, so images larger than memory can be processed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "ppmrw.h"
+#include "ppmsimd.h"
+#include "trace.h"
+
+// size of the reads made by ppm_stream_file()
+#define STREAM_CHUNK (1 << 16)
+
+struct ppm_stream_t {
+    ppm_row_callback on_row;
+    void *user;
+    header hdr;
+    header_parser parser;
+    boolean have_header;
+    unsigned char *row;     // working buffer holding one row of samples
+    unsigned char *packed;  // partial row of P4 bits, else the same as row
+    size_t row_samples;     // samples in a row (width * channels)
+    size_t row_bytes;       // bytes of a binary row in the file
+    int sample_bytes;       // 1, or 2 when max_color_val > 255
+    int source_max;         // max color value in the file
+    boolean normalize;      // rows are scaled up to hdr.max_color_val
+    size_t fill;            // samples (P3) or bytes (P6) currently in row
+    int rows_done;          // rows handed to on_row so far
+    // P3 text state carried between feeds
+    boolean in_token;
+    boolean in_comment;
+    unsigned int value;
+};
+
+
+/*******************************************************//**
+ * Helpers
+ * ********************************************************/
+
+/**
+ * Hands a completed row to the row callback
+ * @param stream decoder
+ * @param pixels row of samples (may point into the caller's buffer)
+ * @return 0 on success, -1 when the callback asked to stop
+ */
+static int emit_row(ppm_stream *stream, const void *pixels) {
+    if (stream->on_row(stream->user, &stream->hdr, stream->rows_done, pixels) != 0) {
+        return -1;
+    }
+    stream->rows_done++;
+    stream->fill = 0;
+    return 0;
+}
+
+/**
+ * Scales a completed row in stream->row up to the full range, if the
+ * decoder normalizes, then emits it
+ * @return 0 on success, -1 when the callback asked to stop
+ */
+static int emit_scaled_row(ppm_stream *stream) {
+    if (stream->normalize) {
+        if (stream->sample_bytes == 2) {
+            scale16_samples((unsigned short *)stream->row, stream->row_samples, stream->source_max);
+        }
+        else {
+            scale8_samples(stream->row, stream->row, stream->row_samples, stream->source_max);
+        }
+    }
+    return emit_row(stream, stream->row);
+}
+
+/**
+ * Converts and range checks a completed row of P6 data, then emits it.
+ * Rows with a max color value of 255 are passed on untouched.
+ * @param stream decoder
+ * @param raw raw bytes of the row, either the caller's buffer or stream->row
+ * @return 0 on success, -1 on error or when the callback asked to stop
+ */
+static int emit_p6_row(ppm_stream *stream, const unsigned char *raw) {
+    unsigned int max_seen = 0;
+
+    if (stream->hdr.file_type == 4) {
+        expand_bits(stream->row, raw, stream->hdr.width);
+        return emit_row(stream, stream->row);
+    }
+    if (stream->sample_bytes == 2) {
+        max_seen = be16_samples((unsigned short *)stream->row, raw, stream->row_samples);
+    }
+    else if (stream->normalize) {
+        // scaled straight into the row buffer in the same pass
+        max_seen = scale8_samples(stream->row, raw, stream->row_samples, stream->source_max);
+        if (max_seen <= (unsigned int)stream->source_max) {
+            return emit_row(stream, stream->row);
+        }
+    }
+    else if (stream->source_max < 255) {
+        max_seen = copy_max8_samples(stream->row, raw, stream->row_samples);
+    }
+    else {
+        return emit_row(stream, raw);
+    }
+    if (max_seen > (unsigned int)stream->source_max) {
+        fprintf(stderr, "Error: ppm_stream_feed: found a pixel value out of range\n");
+        return -1;
+    }
+    return emit_scaled_row(stream);
+}
+
+/**
+ * Stores one P3 sample in the row buffer, emitting the row once it's full
+ * @return 0 on success, -1 on error
+ */
+static int add_sample(ppm_stream *stream, unsigned int value) {
+    if (value > (unsigned int)stream->source_max) {
+        fprintf(stderr, "Error: ppm_stream_feed: found a pixel value out of range\n");
+        return -1;
+    }
+    if (stream->sample_bytes == 2) {
+        ((unsigned short *)stream->row)[stream->fill++] = (unsigned short)value;
+    }
+    else {
+        stream->row[stream->fill++] = (unsigned char)value;
+    }
+    if (stream->fill == stream->row_samples) {
+        return emit_scaled_row(stream);
+    }
+    return 0;
+}
+
+/**
+ * Decodes binary (P4 to P7) bytes. Whole 8-bit rows are passed to the
+ * callback straight from the input; only rows split across feeds are copied.
+ * @return number of bytes consumed, or -1 on error
+ */
+static long feed_p6(ppm_stream *stream, const unsigned char *p, const unsigned char *end) {
+    const unsigned char *start = p;
+    size_t row_bytes = stream->row_bytes;
+
+    while (p < end && stream->rows_done < stream->hdr.height) {
+        size_t avail = end - p;
+        if (stream->fill == 0 && avail >= row_bytes) {
+            if (emit_p6_row(stream, p) < 0) {
+                return -1;
+            }
+            p += row_bytes;
+        }
+        else {
+            size_t n = row_bytes - stream->fill;
+            if (n > avail) {
+                n = avail;
+            }
+            memcpy(stream->packed + stream->fill, p, n);
+            stream->fill += n;
+            p += n;
+            if (stream->fill == row_bytes && emit_p6_row(stream, stream->packed) < 0) {
+                return -1;
+            }
+        }
+    }
+    return p - start;
+}
+
+/**
+ * Decodes P3 text. Runs of complete samples go through the vectorized
+ * parser; a sample cut off at the end of a feed is finished byte by byte
+ * on the next one.
+ * @return number of bytes consumed, or -1 on error
+ */
+static long feed_p3(ppm_stream *stream, const char *p, const char *end) {
+    const char *start = p;
+
+    while (p < end && stream->rows_done < stream->hdr.height) {
+        unsigned char c;
+
+        if (stream->in_comment) {
+            stream->in_comment = (*p != '\n' && *p != '\r');
+            p++;
+            continue;
+        }
+
+        if (!stream->in_token) {
+            // only samples followed by whitespace are known to be complete
+            const char *safe = end;
+            while (safe > p && !isspace((unsigned char)safe[-1])) { safe--; }
+            if (safe > p) {
+                const char *before = p;
+                size_t wanted = stream->row_samples - stream->fill;
+                unsigned int max_seen;
+                size_t parsed = p3_parse_samples(&p, safe,
+                                                 stream->row + stream->fill * stream->sample_bytes,
+                                                 wanted, stream->sample_bytes, &max_seen);
+                if (max_seen > (unsigned int)stream->source_max) {
+                    fprintf(stderr, "Error: ppm_stream_feed: found a pixel value out of range\n");
+                    return -1;
+                }
+                // digits run straight into something that isn't whitespace
+                if (parsed < wanted && p < safe && p > before && isdigit((unsigned char)p[-1])) {
+                    fprintf(stderr, "Error: ppm_stream_feed: found an invalid character in image data\n");
+                    return -1;
+                }
+                stream->fill += parsed;
+                if (stream->fill == stream->row_samples && emit_scaled_row(stream) < 0) {
+                    return -1;
+                }
+                if (parsed > 0) {
+                    continue;
+                }
+            }
+            if (p == end) {
+                break;
+            }
+        }
+
+        // byte at a time: partial samples, comments and anything odd
+        c = *p++;
+        if (isdigit(c)) {
+            stream->value = stream->value * 10 + (c - '0');
+            if (stream->value > 65535) {
+                stream->value = 65535;
+            }
+            stream->in_token = TRUE;
+        }
+        else if (isspace(c)) {
+            if (stream->in_token) {
+                stream->in_token = FALSE;
+                if (add_sample(stream, stream->value) < 0) {
+                    return -1;
+                }
+                stream->value = 0;
+            }
+        }
+        else if (c == '#' && !stream->in_token) {
+            stream->in_comment = TRUE;
+        }
+        else {
+            fprintf(stderr, "Error: ppm_stream_feed: found an invalid character in image data\n");
+            return -1;
+        }
+    }
+    return p - start;
+}
+
+
+/**
+ * Decodes P1 text, where every '0' or '1' is a pixel and whitespace
+ * between them is optional
+ * @return number of bytes consumed, or -1 on error
+ */
+static long feed_p1(ppm_stream *stream, const char *p, const char *end) {
+    const char *start = p;
+
+    for (; p < end && stream->rows_done < stream->hdr.height; p++) {
+        if (stream->in_comment) {
+            stream->in_comment = (*p != '\n' && *p != '\r');
+        }
+        else if (*p == '0' || *p == '1') {
+            if (add_sample(stream, *p == '0' ? 255 : 0) < 0) {
+                return -1;
+            }
+        }
+        else if (*p == '#') {
+            stream->in_comment = TRUE;
+        }
+        else if (!isspace((unsigned char)*p)) {
+            fprintf(stderr, "Error: ppm_stream_feed: found an invalid character in image data\n");
+            return -1;
+        }
+    }
+    return p - start;
+}
+
+
+/**
+ * Sets up row decoding once the header is known
+ * @param stream decoder whose hdr has just been filled in
+ * @return 0 on success, -1 on error
+ */
+static int start_raster(ppm_stream *stream) {
+    stream->have_header = TRUE;
+    stream->row_samples = (size_t)stream->hdr.width * PPM_CHANNELS(stream->hdr.format);
+    stream->sample_bytes = PPM_SAMPLE_BYTES(stream->hdr.max_color_val);
+    stream->row_bytes = stream->row_samples * stream->sample_bytes;
+    stream->source_max = stream->hdr.max_color_val;
+    stream->normalize = ppm_get_normalize() && stream->source_max > 0 &&
+                        stream->source_max != 255 && stream->source_max != 65535;
+    // callbacks see the header of the rows they are given
+    if (stream->hdr.file_type == 1 || stream->hdr.file_type == 4) {
+        stream->hdr.max_color_val = stream->source_max = 255;
+        stream->normalize = FALSE;
+    }
+    if (stream->hdr.file_type == 4) {
+        stream->row_bytes = ((size_t)stream->hdr.width + 7) / 8;
+    }
+    if (stream->normalize) {
+        stream->hdr.max_color_val = stream->sample_bytes == 2 ? 65535 : 255;
+    }
+    // P4 rows are expanded out of a separate buffer of packed bits
+    stream->row = malloc(stream->row_samples * stream->sample_bytes +
+                         (stream->hdr.file_type == 4 ? stream->row_bytes : 0));
+    if (stream->row == NULL) {
+        fprintf(stderr, "Error: ppm_stream_feed: Unable to allocate row buffer\n");
+        return -1;
+    }
+    stream->packed = stream->row;
+    if (stream->hdr.file_type == 4) {
+        stream->packed = stream->row + stream->row_samples;
+    }
+    return 0;
+}
+
+
+/*******************************************************//**
+ * Streaming decoder
+ * ********************************************************/
+
+/**
+ * Creates an incremental decoder
+ * @param on_row called with each completed row of pixels
+ * @param user passed through to on_row
+ * @return the decoder, or NULL if it couldn't be allocated
+ */
+ppm_stream *ppm_stream_create(ppm_row_callback on_row, void *user) {
+    ppm_stream *stream = calloc(1, sizeof(ppm_stream));
+    if (stream == NULL) {
+        fprintf(stderr, "Error: ppm_stream_create: Unable to allocate decoder\n");
+        return NULL;
+    }
+    stream->on_row = on_row;
+    stream->user = user;
+    header_parser_init(&stream->parser, &stream->hdr);
+    return stream;
+}
+
+/**
+ * Creates an incremental decoder for the raster of a file whose header has
+ * already been parsed (e.g. by read_header()), so the first byte fed is
+ * the first byte of the raster
+ * @param on_row called with each completed row of pixels
+ * @param user passed through to on_row
+ * @param hdr header of the file
+ * @return the decoder, or NULL on error
+ */
+ppm_stream *ppm_stream_resume(ppm_row_callback on_row, void *user, const header *hdr) {
+    ppm_stream *stream = ppm_stream_create(on_row, user);
+    if (stream == NULL) {
+        return NULL;
+    }
+    stream->hdr = *hdr;
+    stream->hdr.comments = NULL;
+    if (start_raster(stream) < 0) {
+        ppm_stream_destroy(stream);
+        return NULL;
+    }
+    return stream;
+}
+
+/**
+ * Feeds the next bytes of a ppm file to the decoder. Rows are passed to the
+ * row callback as soon as they are complete.
+ * @param stream decoder
+ * @param data next bytes of the file
+ * @param size number of bytes at data
+ * @return 0 on success, -1 on error
+ */
+int ppm_stream_feed(ppm_stream *stream, const void *data, size_t size) {
+    const unsigned char *p = data;
+    const unsigned char *end = p + size;
+    long used;
+
+    while (!stream->have_header && p < end) {
+        int ret_val = header_parser_feed(&stream->parser, *p++);
+        if (ret_val < 0) {
+            return -1;
+        }
+        if (ret_val > 0 && start_raster(stream) < 0) {
+            return -1;
+        }
+    }
+    if (p == end) {
+        return 0;
+    }
+
+    if (stream->hdr.file_type >= 4) {
+        used = feed_p6(stream, p, end);
+    }
+    else if (stream->hdr.file_type == 1) {
+        used = feed_p1(stream, (const char *)p, (const char *)end);
+    }
+    else {
+        used = feed_p3(stream, (const char *)p, (const char *)end);
+    }
+    if (used < 0) {
+        return -1;
+    }
+    p += used;
+
+    // everything after the last row has to be whitespace
+    while (p < end && isspace(*p) && stream->hdr.file_type <= 3) { p++; }
+    if (p < end) {
+        fprintf(stderr, "Error: ppm_stream_feed: Extra image data was found in file\n");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Tells the decoder there are no more bytes and checks that the whole
+ * image was received
+ * @param stream decoder
+ * @return 0 on success, -1 on error
+ */
+int ppm_stream_finish(ppm_stream *stream) {
+    // a sample may end at the very end of the file
+    if (stream->have_header && stream->in_token) {
+        stream->in_token = FALSE;
+        if (add_sample(stream, stream->value) < 0) {
+            return -1;
+        }
+    }
+    if (!stream->have_header || stream->rows_done < stream->hdr.height) {
+        fprintf(stderr, "Error: ppm_stream_finish: Image data is missing or header dimensions are wrong\n");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @param stream decoder
+ * @return the parsed header, or NULL if it hasn't been fed in full yet
+ */
+const header *ppm_stream_header(const ppm_stream *stream) {
+    return stream->have_header ? &stream->hdr : NULL;
+}
+
+/**
+ * Frees a decoder and its working buffer
+ * @param stream decoder
+ */
+void ppm_stream_destroy(ppm_stream *stream) {
+    if (stream != NULL) {
+        free(stream->row);
+        free(stream);
+    }
+}
+
+/**
+ * Feeds a decoder from a file stream using a fixed size read buffer until
+ * the end of the file, then finishes it
+ * @param fh input file pointer (may be a pipe)
+ * @param stream decoder to feed, destroyed before returning
+ * @return 0 on success, -1 on error
+ */
+static int feed_file(FILE *fh, ppm_stream *stream) {
+    unsigned char *buffer = malloc(STREAM_CHUNK);
+    int ret_val = -1;
+    size_t read, total = 0;
+    TRACE_SCOPE(span, "stream_decode");
+
+    if (buffer != NULL && stream != NULL) {
+        ret_val = 0;
+        while (ret_val == 0 && (read = fread(buffer, 1, STREAM_CHUNK, fh)) > 0) {
+            ret_val = ppm_stream_feed(stream, buffer, read);
+            total += read;
+        }
+        if (ret_val == 0 && ferror(fh)) {
+            fprintf(stderr, "Error: ppm_stream_file: fread() returned an error when reading data\n");
+            ret_val = -1;
+        }
+        if (ret_val == 0) {
+            ret_val = ppm_stream_finish(stream);
+        }
+    }
+    ppm_stream_destroy(stream);
+    free(buffer);
+    TRACE_BYTES(span, total);
+    return ret_val;
+}
+
+/**
+ * Decodes a whole ppm file stream row by row using a fixed size read buffer
+ * @param fh input file pointer (may be a pipe)
+ * @param on_row called with each completed row of pixels
+ * @param user passed through to on_row
+ * @return 0 on success, -1 on error
+ */
+int ppm_stream_file(FILE *fh, ppm_row_callback on_row, void *user) {
+    return feed_file(fh, ppm_stream_create(on_row, user));
+}
+
+/**
+ * Decodes the rest of a file stream row by row after its header was read
+ * with read_header()
+ * @param fh input file pointer, positioned at the start of the raster
+ * @param hdr header read from fh
+ * @param on_row called with each completed row of pixels
+ * @param user passed through to on_row
+ * @return 0 on success, -1 on error
+ */
+int ppm_stream_raster(FILE *fh, const header *hdr, ppm_row_callback on_row, void *user) {
+    return feed_file(fh, ppm_stream_resume(on_row, user, hdr));
+}
@@ -0,0 +1,526 @@
+/** raster - draws an image on the CPU the way the shaders do
+ * For machines without a GPU. The image quad spans -1..1 and goes through
+ * the same MVP as on the GPU. Its z is always 0, so MVP maps the quad plane
+ * to the screen by a 3x3 projective transform. Each pixel center is mapped
+ * back through that transform's inverse, which gives the same perspective
+ * correct texture coordinates the GPU would interpolate. The pixel is
+ * covered when the point lands inside the quad in front of the viewer.
+ * Zoomed out, the level of detail comes from the same derivatives the GPU
+ * takes, and trilinear filtering blends the two levels around it.
+ * Coordinates are computed four pixels at a time with SSE2 and texels are
+ * fetched one pixel at a time. The frame is split into horizontal bands
+ * drawn by several threads.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "raster.h"
+#include "trace.h"
+
+#if defined(__GNUC__) && defined(__SSE2__)
+#define RASTER_SSE2
+#include <emmintrin.h>
+#endif
+
+// pixels whose coordinates are computed before their texels are fetched
+#define RASTER_SPAN 64
+// fewest rows worth handing to a thread
+#define RASTER_MIN_BAND 16
+
+// a band of rows of a frame and everything needed to draw them
+typedef struct raster_band_t {
+    framebuffer *fb;
+    float inv[3][3];            // screen (x, y, 1) to homogeneous quad plane point
+    float scale_x, scale_y;     // pixels to normalized device coordinates
+    const image *levels;
+    int level_count;
+    float t_max;                // texture t past which rows aren't decoded yet
+    enum raster_filter filter;
+    int first_row, rows;
+} raster_band;
+
+
+/*******************************************************//**
+ * Framebuffer
+ * ********************************************************/
+
+/**
+ * Sizes a framebuffer, keeping its memory when it's already big enough
+ * @param fb framebuffer, zeroed before the first call
+ * @param width width in pixels
+ * @param height height in pixels
+ * @return 0 on success, -1 on error
+ */
+int framebuffer_resize(framebuffer *fb, int width, int height) {
+    unsigned char *pixels;
+
+    if (width == fb->width && height == fb->height && fb->pixels != NULL)
+        return 0;
+    pixels = realloc(fb->pixels, (size_t)width * height * 4);
+    if (pixels == NULL) {
+        fprintf(stderr, "Error: framebuffer_resize: Unable to allocate %dx%d pixels\n",
+                width, height);
+        return -1;
+    }
+    fb->pixels = pixels;
+    fb->width = width;
+    fb->height = height;
+    return 0;
+}
+
+/**
+ * Releases a framebuffer's pixels
+ * @param fb framebuffer
+ */
+void framebuffer_free(framebuffer *fb) {
+    free(fb->pixels);
+    fb->pixels = NULL;
+    fb->width = fb->height = 0;
+}
+
+/**
+ * Writes a framebuffer as an 8-bit P6 image, top row first. Alpha is
+ * dropped; images with alpha are already blended over the background.
+ * @param fb framebuffer to write
+ * @param path file to write, or "-" for stdout
+ * @return 0 on success, -1 on error
+ */
+int framebuffer_write(const framebuffer *fb, const char *path) {
+    header hdr = { 6, NULL, fb->width, fb->height, 255, PIXEL_RGB };
+    image img;
+    FILE *fh;
+    int x, y;
+    int ret_val;
+
+    img.width = fb->width;
+    img.height = fb->height;
+    img.max_color_val = 255;
+    img.format = PIXEL_RGB;
+    if (alloc_image(&img) < 0)
+        return -1;
+    for (y=0; y<fb->height; y++) {
+        const unsigned char *src = fb->pixels + (size_t)(fb->height - 1 - y) * fb->width * 4;
+        unsigned char *dst = (unsigned char *)img.pixels + (size_t)y * fb->width * 3;
+        for (x=0; x<fb->width; x++) {
+            dst[x * 3] = src[x * 4];
+            dst[x * 3 + 1] = src[x * 4 + 1];
+            dst[x * 3 + 2] = src[x * 4 + 2];
+        }
+    }
+
+    fh = strcmp(path, "-") == 0 ? stdout : fopen(path, "wb");
+    if (fh == NULL) {
+        fprintf(stderr, "Error: framebuffer_write: %s can't be opened\n", path);
+        free_image(&img);
+        return -1;
+    }
+    // write_header() returns the length of the last line it wrote
+    ret_val = write_header(fh, &hdr) < 0 ? -1 : write_p6_data(fh, &img);
+    if (fh == stdout)
+        fflush(fh);
+    else if (fclose(fh) != 0)
+        ret_val = -1;
+    free_image(&img);
+    return ret_val;
+}
+
+/*******************************************************//**
+ * Texel lookup
+ * ********************************************************/
+
+/**
+ * Reads a texel, widening 8-bit samples to the 16-bit range
+ * @param img image to read
+ * @param x column, in range
+ * @param y row, in range
+ * @param texel set to the samples of the pixel
+ */
+static inline void fetch(const image *img, int x, int y, unsigned int *texel) {
+    int channels = PPM_CHANNELS(img->format);
+    size_t offset = ((size_t)y * img->width + x) * channels;
+    int c;
+
+    if (img->bit_depth == 16) {
+        const unsigned short *p = (const unsigned short *)img->pixels + offset;
+        for (c=0; c<channels; c++)
+            texel[c] = p[c];
+    }
+    else {
+        const unsigned char *p = (const unsigned char *)img->pixels + offset;
+        for (c=0; c<channels; c++)
+            texel[c] = p[c] * 257;
+    }
+}
+
+/**
+ * Looks up the texel nearest to a texture coordinate
+ */
+static inline void sample_nearest(const image *img, float s, float t, unsigned int *texel) {
+    int x = (int)(s * img->width);
+    int y = (int)(t * img->height);
+    fetch(img, x < img->width ? x : img->width - 1, y < img->height ? y : img->height - 1, texel);
+}
+
+/**
+ * Blends the four texels around a texture coordinate, clamping to the edge
+ * of the image, with 8-bit weights
+ */
+static inline void sample_bilinear(const image *img, float s, float t, unsigned int *texel) {
+    int channels = PPM_CHANNELS(img->format);
+    float fx = s * img->width - 0.5f, fy = t * img->height - 0.5f;
+    int x0 = (int)(fx + 1) - 1, y0 = (int)(fy + 1) - 1;     // floor for fx, fy > -1
+    unsigned int wx = (unsigned int)((fx - x0) * 256), wy = (unsigned int)((fy - y0) * 256);
+    int x1 = x0 + 1, y1 = y0 + 1;
+    unsigned int p00[4], p01[4], p10[4], p11[4];
+    int c;
+
+    if (x0 < 0) x0 = 0;
+    if (y0 < 0) y0 = 0;
+    if (x1 >= img->width) x1 = img->width - 1;
+    if (y1 >= img->height) y1 = img->height - 1;
+    fetch(img, x0, y0, p00);
+    fetch(img, x1, y0, p01);
+    fetch(img, x0, y1, p10);
+    fetch(img, x1, y1, p11);
+    for (c=0; c<channels; c++) {
+        unsigned int top = p00[c] * (256 - wx) + p01[c] * wx;
+        unsigned int bottom = p10[c] * (256 - wx) + p11[c] * wx;
+        texel[c] = (top * (256 - wy) + bottom * wy + 32768) >> 16;
+    }
+}
+
+/**
+ * Filters trilinearly at a level of detail past 0: blends the bilinear
+ * samples of the two mip levels around it by its fraction, with 8-bit
+ * weights, or samples the last level bilinearly when it's beyond it
+ * @param levels the image followed by its mip levels
+ * @param level_count number of images in levels
+ * @param lod level of detail, log2 of the pixel's size in level 0 texels
+ * @param s texture coordinate
+ * @param t texture coordinate
+ * @param texel set to the filtered samples
+ */
+static inline void sample_trilinear(const image *levels, int level_count, float lod,
+                                    float s, float t, unsigned int *texel) {
+    int channels = PPM_CHANNELS(levels[0].format);
+    int level = (int)lod;
+    unsigned int w = (unsigned int)((lod - level) * 256);
+    unsigned int next[4];
+    int c;
+
+    if (level >= level_count - 1) {
+        sample_bilinear(&levels[level_count - 1], s, t, texel);
+        return;
+    }
+    sample_bilinear(&levels[level], s, t, texel);
+    sample_bilinear(&levels[level + 1], s, t, next);
+    for (c=0; c<channels; c++)
+        texel[c] = (texel[c] * (256 - w) + next[c] * w + 128) >> 8;
+}
+
+/**
+ * Spreads a texel out to RGBA the way the fragment shader does, and blends
+ * images with alpha over the black background like GL_SRC_ALPHA,
+ * GL_ONE_MINUS_SRC_ALPHA
+ * @param out 4 bytes to store the pixel in
+ * @param texel samples in the 16-bit range
+ * @param format pixel format of the texel
+ */
+static inline void shade(unsigned char *out, const unsigned int *texel, enum pixel_format format) {
+    unsigned int rgba[4];
+    int c;
+
+    // round(v * 255 / 65535) without dividing
+    for (c=0; c<PPM_CHANNELS(format); c++)
+        rgba[c] = (texel[c] + 128 - ((texel[c] + 128) >> 8)) >> 8;
+    switch (format) {
+        case PIXEL_GRAY:
+            out[0] = out[1] = out[2] = rgba[0];
+            out[3] = 255;
+            return;
+        case PIXEL_GRAY_ALPHA:
+            rgba[3] = rgba[1];
+            rgba[1] = rgba[2] = rgba[0];
+            break;
+        case PIXEL_RGB:
+            out[0] = rgba[0];
+            out[1] = rgba[1];
+            out[2] = rgba[2];
+            out[3] = 255;
+            return;
+        case PIXEL_RGBA:
+            break;
+    }
+    // v * a / 255 without dividing, rounded the way Mesa's blender does
+    for (c=0; c<4; c++) {
+        unsigned int v = rgba[c] * rgba[3];
+        out[c] = (v + 128 + (v >> 8)) >> 8;
+    }
+}
+
+
+/*******************************************************//**
+ * Scanlines
+ * ********************************************************/
+
+/**
+ * Picks the mip level whose texels are closest to a pixel in size, i.e.
+ * round(log2(rho)) where rho^2 is given, from the float's exponent
+ */
+static inline int pick_level(float rho2, int level_count) {
+    unsigned int bits;
+    int e;
+
+    memcpy(&bits, &rho2, sizeof(bits));
+    e = (int)((bits >> 23) & 255) - 127;
+    e = e < 0 ? 0 : (e + 1) >> 1;
+    return e < level_count ? e : level_count - 1;
+}
+
+/**
+ * Computes the squared size of a pixel's footprint in level 0 texels,
+ * from the derivatives of the inverse mapping at a quad point
+ */
+static inline float footprint(const raster_band *band, float x, float y, float rcp) {
+    const float (*m)[3] = band->inv;
+    float w = band->levels[0].width, h = band->levels[0].height;
+    // d(x/W) = (dX - x dW) / W, then normalized device units to pixels to texels
+    float dudx = (m[0][0] - x * m[2][0]) * rcp * band->scale_x * 0.5f * w;
+    float dvdx = (m[1][0] - y * m[2][0]) * rcp * band->scale_x * 0.5f * h;
+    float dudy = (m[0][1] - x * m[2][1]) * rcp * band->scale_y * 0.5f * w;
+    float dvdy = (m[1][1] - y * m[2][1]) * rcp * band->scale_y * 0.5f * h;
+    float rx = dudx * dudx + dvdx * dvdx, ry = dudy * dudy + dvdy * dvdy;
+    return rx > ry ? rx : ry;
+}
+
+/**
+ * Maps a run of pixels of a row back to texture coordinates
+ * @param band band being drawn
+ * @param px first pixel of the run
+ * @param n pixels in the run, at most RASTER_SPAN
+ * @param row X, Y and W of the row's pixels at x = 0 (without the x term)
+ * @param s set to each pixel's s, or -1 where the quad doesn't cover it
+ * @param t set to each pixel's t
+ * @param rho2 set to each pixel's squared footprint when there are mip
+ *             levels to pick from
+ * @return number of covered pixels
+ */
+static int map_span(const raster_band *band, int px, int n, const float *row,
+                    float *s, float *t, float *rho2) {
+    const float (*m)[3] = band->inv;
+    boolean levels = band->filter != RASTER_NEAREST && band->level_count > 1;
+    int covered = 0;
+    int k = 0;
+
+#ifdef RASTER_SSE2
+    const __m128 one = _mm_set1_ps(1), half = _mm_set1_ps(0.5f), zero = _mm_setzero_ps();
+    const __m128 outside = _mm_set1_ps(-1), t_max = _mm_set1_ps(band->t_max);
+    for (; k + 4 <= n; k += 4) {
+        __m128 pos = _mm_add_ps(_mm_set1_ps((float)(px + k)), _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f));
+        __m128 nx = _mm_sub_ps(_mm_mul_ps(pos, _mm_set1_ps(band->scale_x)), one);
+        __m128 X = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[0][0]), nx), _mm_set1_ps(row[0]));
+        __m128 Y = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[1][0]), nx), _mm_set1_ps(row[1]));
+        __m128 W = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[2][0]), nx), _mm_set1_ps(row[2]));
+        __m128 rcp = _mm_div_ps(one, W);
+        __m128 x = _mm_mul_ps(X, rcp), y = _mm_mul_ps(Y, rcp);
+        __m128 vs = _mm_mul_ps(_mm_add_ps(x, one), half);
+        __m128 vt = _mm_mul_ps(_mm_sub_ps(one, y), half);
+        __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpgt_ps(W, zero), _mm_cmpge_ps(vs, zero)),
+                                   _mm_and_ps(_mm_cmplt_ps(vs, one),
+                                              _mm_and_ps(_mm_cmpge_ps(vt, zero),
+                                                         _mm_cmplt_ps(vt, t_max))));
+        int mask = _mm_movemask_ps(inside);
+        _mm_storeu_ps(s + k, _mm_or_ps(_mm_and_ps(inside, vs), _mm_andnot_ps(inside, outside)));
+        _mm_storeu_ps(t + k, vt);
+        if (mask == 0)
+            continue;
+        covered += __builtin_popcount(mask);
+        if (levels) {
+            float xs[4], ys[4], rcps[4];
+            int j;
+            _mm_storeu_ps(xs, x);
+            _mm_storeu_ps(ys, y);
+            _mm_storeu_ps(rcps, rcp);
+            for (j=0; j<4; j++)
+                rho2[k + j] = footprint(band, xs[j], ys[j], rcps[j]);
+        }
+    }
+#endif
+    for (; k<n; k++) {
+        float nx = (px + k + 0.5f) * band->scale_x - 1;
+        float W = m[2][0] * nx + row[2];
+        float rcp = 1 / W;
+        float x = (m[0][0] * nx + row[0]) * rcp, y = (m[1][0] * nx + row[1]) * rcp;
+        float vs = (x + 1) * 0.5f, vt = (1 - y) * 0.5f;
+
+        t[k] = vt;
+        if (!(W > 0 && vs >= 0 && vs < 1 && vt >= 0 && vt < band->t_max)) {
+            s[k] = -1;
+            continue;
+        }
+        s[k] = vs;
+        covered++;
+        if (levels)
+            rho2[k] = footprint(band, x, y, rcp);
+    }
+    return covered;
+}
+
+/**
+ * Draws one row of the frame
+ * @param band band the row is in
+ * @param py row, counted from the bottom
+ */
+static void draw_row(const raster_band *band, int py) {
+    const float (*m)[3] = band->inv;
+    const image *base = &band->levels[0];
+    framebuffer *fb = band->fb;
+    unsigned char *out = fb->pixels + (size_t)py * fb->width * 4;
+    float ny = (py + 0.5f) * band->scale_y - 1;
+    float row[3] = { m[0][1] * ny + m[0][2], m[1][1] * ny + m[1][2], m[2][1] * ny + m[2][2] };
+    float s[RASTER_SPAN], t[RASTER_SPAN], rho2[RASTER_SPAN];
+    unsigned int texel[4];
+    int px, k;
+
+    for (px=0; px<fb->width; px+=RASTER_SPAN) {
+        int n = fb->width - px < RASTER_SPAN ? fb->width - px : RASTER_SPAN;
+        unsigned char *p = out + (size_t)px * 4;
+
+        if (map_span(band, px, n, row, s, t, rho2) == 0) {
+            memset(p, 0, (size_t)n * 4);
+            continue;
+        }
+        for (k=0; k<n; k++, p+=4) {
+            if (s[k] < 0) {
+                memset(p, 0, 4);
+                continue;
+            }
+            if (band->filter == RASTER_BILINEAR)
+                sample_bilinear(&band->levels[band->level_count > 1
+                                              ? pick_level(rho2[k], band->level_count) : 0],
+                                s[k], t[k], texel);
+            // magnified, the tiles sample GL_NEAREST
+            else if (band->filter == RASTER_TRILINEAR && band->level_count > 1 && rho2[k] > 1)
+                sample_trilinear(band->levels, band->level_count, 0.5f * log2f(rho2[k]), s[k],
+                                 t[k], texel);
+            else
+                sample_nearest(base, s[k], t[k], texel);
+            shade(p, texel, base->format);
+        }
+    }
+}
+
+/**
+ * Draws a band of rows (thread entry point)
+ */
+static void *draw_band(void *arg) {
+    raster_band *band = arg;
+    int py;
+
+    for (py=band->first_row; py<band->first_row + band->rows; py++)
+        draw_row(band, py);
+    return NULL;
+}
+
+
+/*******************************************************//**
+ * Frames
+ * ********************************************************/
+
+/**
+ * Inverts the transform from the quad plane to the screen that MVP makes
+ * of a quad at z = 0
+ * @param inv set to the inverse
+ * @param mvp transformation the image is drawn with
+ * @return 0 on success, -1 if the quad is seen edge on or scaled to nothing
+ */
+static int invert_quad(float inv[3][3], mat4x4 mvp) {
+    // clip x, y and w from quad x, y and 1; mvp is column major
+    double m[3][3] = {
+            { mvp[0][0], mvp[1][0], mvp[3][0] },
+            { mvp[0][1], mvp[1][1], mvp[3][1] },
+            { mvp[0][3], mvp[1][3], mvp[3][3] }
+    };
+    double det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+                 m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+                 m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+    int i, j;
+
+    if (det > -1e-12 && det < 1e-12)
+        return -1;
+    // the inverse is the adjugate over the determinant
+    for (i=0; i<3; i++) {
+        for (j=0; j<3; j++) {
+            int r0 = (j + 1) % 3, r1 = (j + 2) % 3, c0 = (i + 1) % 3, c1 = (i + 2) % 3;
+            inv[i][j] = (m[r0][c0] * m[r1][c1] - m[r0][c1] * m[r1][c0]) / det;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Clears the framebuffer and draws an image into it with a transformation,
+ * giving the same picture as the shaders and the tiles drawing the image's
+ * quad on the GPU: identical where it's magnified, but for pixels landing
+ * right on a texel edge, and within a few steps per channel where it's
+ * minified, since GPUs take the level of detail per 2x2 block of pixels
+ * @param fb framebuffer to draw into
+ * @param mvp transformation the image is drawn with
+ * @param levels the image followed by its mip levels, if any
+ * @param level_count number of images in levels, at least 1
+ * @param rows rows of the image decoded so far; the rest aren't drawn
+ * @param filter how texels are looked up
+ */
+void raster_draw_image(framebuffer *fb, mat4x4 mvp, const image *levels, int level_count,
+                       int rows, enum raster_filter filter) {
+    raster_band bands[RASTER_THREADS];
+    pthread_t threads[RASTER_THREADS];
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int n = (fb->height + RASTER_MIN_BAND - 1) / RASTER_MIN_BAND;
+    int rows_per_band, started, i;
+    TRACE_SCOPE(span, "raster");
+    TRACE_BYTES(span, (size_t)fb->width * fb->height * 4);
+
+    if (n > RASTER_THREADS)
+        n = RASTER_THREADS;
+    if (cores > 0 && n > cores)
+        n = (int)cores;
+    if (n < 1)
+        n = 1;
+    rows_per_band = (fb->height + n - 1) / n;
+    n = fb->height > 0 ? (fb->height + rows_per_band - 1) / rows_per_band : 0;
+
+    bands[0].fb = fb;
+    bands[0].scale_x = 2.0f / fb->width;
+    bands[0].scale_y = 2.0f / fb->height;
+    bands[0].levels = levels;
+    bands[0].level_count = level_count;
+    bands[0].t_max = (float)rows / levels[0].height;
+    bands[0].filter = filter;
+    if (rows <= 0 || invert_quad(bands[0].inv, mvp) < 0) {
+        memset(fb->pixels, 0, (size_t)fb->width * fb->height * 4);
+        return;
+    }
+
+    for (i=0; i<n; i++) {
+        bands[i] = bands[0];
+        bands[i].first_row = i * rows_per_band;
+        bands[i].rows = fb->height - bands[i].first_row < rows_per_band
+                            ? fb->height - bands[i].first_row : rows_per_band;
+    }
+    for (started=1; started<n; started++) {
+        if (pthread_create(&threads[started], NULL, draw_band, &bands[started]) != 0)
+            break;
+    }
+    draw_band(&bands[0]);
+    // draw the bands whose threads couldn't be started here
+    for (i=started; i<n; i++)
+        draw_band(&bands[i]);
+    for (i=1; i<started; i++)
+        pthread_join(threads[i], NULL);
+}
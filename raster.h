@@ -0,0 +1,30 @@
+/* raster header file - draws an image on the CPU the way the shaders do */
+#ifndef RASTER_H
+#define RASTER_H
+
+#include "linmath.h"
+#include "ppmrw.h"
+
+// most threads a frame is split between
+#define RASTER_THREADS 8
+
+// how texels are looked up
+enum raster_filter {
+    RASTER_NEAREST,         // GL_NEAREST on level 0, like the GL path without mipmaps
+    RASTER_BILINEAR,        // GL_LINEAR on the nearest mip level (GL_LINEAR_MIPMAP_NEAREST)
+    RASTER_TRILINEAR        // GL_NEAREST magnified, GL_LINEAR_MIPMAP_LINEAR minified, like the tiles
+};
+
+// RGBA pixels drawn on the CPU, bottom row first like glReadPixels() returns
+typedef struct framebuffer_t {
+    int width, height;
+    unsigned char *pixels;  // width * height * 4 bytes
+} framebuffer;
+
+int framebuffer_resize(framebuffer *fb, int width, int height);
+void framebuffer_free(framebuffer *fb);
+int framebuffer_write(const framebuffer *fb, const char *path);
+void raster_draw_image(framebuffer *fb, mat4x4 mvp, const image *levels, int level_count,
+                       int rows, enum raster_filter filter);
+
+#endif
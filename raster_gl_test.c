@@ -0,0 +1,260 @@
+/** raster_gl_test - compares the software rasterizer with the GL path
+ * usage: raster_gl_test <ezview> [directory]
+ *
+ * Writes small synthetic images, draws each one with a few views through
+ * ezview --render-to, once with shaders and tiles in an offscreen context
+ * and once with --software, and compares the frames. Magnified views that
+ * are only scaled and moved have to match exactly. Rotated ones may differ
+ * where a pixel lands right on a texel edge, and minified ones by a few
+ * steps per channel, since GPUs take the level of detail per 2x2 block of
+ * pixels. Exits with 0 when every view is within its bounds, 1 when one
+ * isn't and 77 (skipped) when there's no GL context to compare with.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "ppmrw.h"
+
+#define SKIPPED 77
+// size of the test images; both fit in one tile, so there are no seams
+#define IMAGE_WIDTH 600
+#define IMAGE_HEIGHT 400
+#define FRAME_SIZE "320x240"
+
+// an image to draw
+typedef struct test_image_t {
+    const char *name;
+    int depth;              // samples per pixel, 2 for gray and alpha or 3 for RGB
+} test_image;
+
+// a view and how far the two frames may be apart with it
+typedef struct test_view_t {
+    const char *name;
+    const char *args[8];    // view arguments for ezview, NULL terminated
+    int max_diff;           // largest difference of a sample...
+    double max_pixels;      // ...in all but this fraction of the pixels
+} test_view;
+
+static const test_image images[] = {
+    { "rgb", 3 },
+    { "gray_alpha", 2 }
+};
+
+static const test_view views[] = {
+    { "magnified", { "--scale", "3", "--translate", "0.1,-0.05", NULL }, 0, 0 },
+    { "magnified, rotated", { "--scale", "3", "--rotate", "0.3", "--shear", "0.1,0", NULL },
+      0, 0.002 },
+    { "magnified, tilted", { "--scale", "4", "--tilt", "0.1,0.05", NULL }, 0, 0.002 },
+    { "minified", { "--scale", "0.4", NULL }, 5, 0 },
+    { "minified, rotated", { "--scale", "0.3", "--rotate", "0.5", NULL }, 5, 0 }
+};
+
+/**
+ * Writes a test image with detail at every scale: gradients, stripes and
+ * a fine checkerboard
+ * @param path file to write
+ * @param depth samples per pixel, 2 or 3
+ * @return 0 on success, -1 on error
+ */
+static int write_image(const char *path, int depth) {
+    FILE *fh = fopen(path, "wb");
+    int x, y;
+
+    if (fh == NULL) {
+        perror("Error: write_image");
+        return -1;
+    }
+    if (depth == 3) {
+        fprintf(fh, "P6\n%d %d\n255\n", IMAGE_WIDTH, IMAGE_HEIGHT);
+    }
+    else {
+        fprintf(fh, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH 2\nMAXVAL 255\nTUPLTYPE GRAYSCALE_ALPHA\nENDHDR\n",
+                IMAGE_WIDTH, IMAGE_HEIGHT);
+    }
+    for (y=0; y<IMAGE_HEIGHT; y++) {
+        for (x=0; x<IMAGE_WIDTH; x++) {
+            unsigned char pixel[3];
+            pixel[0] = (unsigned char)(x * 255 / IMAGE_WIDTH);
+            pixel[1] = (unsigned char)((x / 9 + y / 7) % 2 ? 220 : 30);
+            pixel[2] = (unsigned char)(((x ^ y) & 1) * 160 + y * 95 / IMAGE_HEIGHT);
+            if (depth == 2) {
+                pixel[0] = pixel[1] / 2 + pixel[2] / 2;
+                pixel[1] = (unsigned char)(y * 255 / IMAGE_HEIGHT);
+            }
+            fwrite(pixel, 1, depth, fh);
+        }
+    }
+    if (fclose(fh) != 0) {
+        perror("Error: write_image");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Draws an image into a file with ezview --render-to
+ * @param ezview path of the ezview binary
+ * @param input image to draw
+ * @param output file to write the frame to
+ * @param view view to draw the image with
+ * @param software TRUE to draw on the CPU
+ * @return 0 on success, -1 on error
+ */
+static int render(const char *ezview, const char *input, const char *output,
+                  const test_view *view, boolean software) {
+    const char *argv[24];
+    int argc = 0, status, i;
+    pid_t pid;
+
+    argv[argc++] = ezview;
+    argv[argc++] = "--render-to";
+    argv[argc++] = output;
+    argv[argc++] = "--size";
+    argv[argc++] = FRAME_SIZE;
+    if (software) {
+        argv[argc++] = "--software";
+    }
+    for (i=0; view->args[i] != NULL; i++) {
+        argv[argc++] = view->args[i];
+    }
+    argv[argc++] = input;
+    argv[argc] = NULL;
+
+    pid = fork();
+    if (pid < 0) {
+        perror("Error: render");
+        return -1;
+    }
+    if (pid == 0) {
+        execv(ezview, (char *const *)argv);
+        perror("Error: render");
+        _exit(127);
+    }
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Reads a frame written by ezview
+ * @param path file to read
+ * @param img set to the frame
+ * @return 0 on success, -1 on error
+ */
+static int read_frame(const char *path, image *img) {
+    FILE *fh = fopen(path, "rb");
+    header hdr;
+    int ret_val;
+
+    if (fh == NULL) {
+        fprintf(stderr, "Error: read_frame: %s can't be opened\n", path);
+        return -1;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    ret_val = read_header(fh, &hdr);
+    if (ret_val == 0) {
+        ret_val = read_pnm_data(fh, &hdr, img);
+    }
+    fclose(fh);
+    return ret_val;
+}
+
+/**
+ * Compares the GL and software frames of one image and view
+ * @return 0 if they're within the view's bounds, -1 otherwise
+ */
+static int compare(const char *image_name, const test_view *view, const image *gl,
+                   const image *sw) {
+    size_t pixels = (size_t)gl->width * gl->height, differing = 0, beyond = 0, i;
+    const unsigned char *a = (const unsigned char *)gl->pixels;
+    const unsigned char *b = (const unsigned char *)sw->pixels;
+    int largest = 0, c;
+    boolean ok;
+
+    if (gl->width != sw->width || gl->height != sw->height) {
+        fprintf(stderr, "Error: compare: %s, %s: frames are %dx%d and %dx%d\n", image_name,
+                view->name, gl->width, gl->height, sw->width, sw->height);
+        return -1;
+    }
+    for (i=0; i<pixels; i++) {
+        int worst = 0;
+        for (c=0; c<3; c++) {
+            int diff = abs(a[i * 3 + c] - b[i * 3 + c]);
+            worst = diff > worst ? diff : worst;
+        }
+        if (worst > 0) {
+            differing++;
+        }
+        if (worst > view->max_diff) {
+            beyond++;
+        }
+        largest = worst > largest ? worst : largest;
+    }
+    ok = beyond <= view->max_pixels * pixels;
+    printf("%-4s %-10s %-20s %6zu of %zu pixels differ, %zu by more than %d, at most by %d\n",
+           ok ? "ok" : "FAIL", image_name, view->name, differing, pixels, beyond, view->max_diff,
+           largest);
+    return ok ? 0 : -1;
+}
+
+int main(int argc, char *argv[]) {
+    const char *dir = argc > 2 ? argv[2] : getenv("TMPDIR");
+    char input[MAX_SIZE], gl_path[MAX_SIZE], sw_path[MAX_SIZE];
+    int failed = 0;
+    size_t i, j;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: raster_gl_test <ezview> [directory]\n");
+        return 1;
+    }
+    if (dir == NULL || dir[0] == '\0') {
+        dir = "/tmp";
+    }
+    snprintf(gl_path, sizeof(gl_path), "%s/raster_gl_test_%d_gl.ppm", dir, (int)getpid());
+    snprintf(sw_path, sizeof(sw_path), "%s/raster_gl_test_%d_sw.ppm", dir, (int)getpid());
+
+    for (i=0; i<sizeof(images) / sizeof(images[0]); i++) {
+        snprintf(input, sizeof(input), "%s/raster_gl_test_%d_%s.pnm", dir, (int)getpid(),
+                 images[i].name);
+        if (write_image(input, images[i].depth) < 0) {
+            return 1;
+        }
+        for (j=0; j<sizeof(views) / sizeof(views[0]); j++) {
+            image gl, sw;
+
+            if (render(argv[1], input, gl_path, &views[j], FALSE) < 0) {
+                printf("skipped: no GL context to draw %s with\n", images[i].name);
+                unlink(input);
+                return SKIPPED;
+            }
+            if (render(argv[1], input, sw_path, &views[j], TRUE) < 0) {
+                fprintf(stderr, "Error: main: --software failed on %s\n", images[i].name);
+                failed++;
+                continue;
+            }
+            if (read_frame(gl_path, &gl) < 0) {
+                failed++;
+                continue;
+            }
+            if (read_frame(sw_path, &sw) < 0) {
+                free_image(&gl);
+                failed++;
+                continue;
+            }
+            if (compare(images[i].name, &views[j], &gl, &sw) < 0) {
+                failed++;
+            }
+            free_image(&gl);
+            free_image(&sw);
+        }
+        unlink(input);
+    }
+    unlink(gl_path);
+    unlink(sw_path);
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,239 @@
+/** replay - scripted key presses and views for repeatable benchmarks
+ * A script has one event per line: the time in seconds since the replay
+ * started, then what happens. Blank lines and lines starting with # are
+ * skipped.
+ *
+ *     0.0  view scale=0.5 rotate=0.2 translate=0.1,0 shear=0,0 tilt=0,0
+ *     0.5  key r
+ *     1.0  key =
+ *     4.0  end
+ *
+ * Keys are pressed through the same callback as the keyboard; a view sets
+ * the parts of the transformation it names and leaves the rest alone.
+ * Without an end line the replay ends once the last event has been drawn.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <GLFW/glfw3.h>
+
+#include "replay.h"
+
+// named keys a script can press, besides the letters
+typedef struct key_name_t {
+    const char *name;
+    int key;
+} key_name;
+
+static const key_name key_names[] = {
+    { "-", GLFW_KEY_MINUS },
+    { "=", GLFW_KEY_EQUAL },
+    { "enter", GLFW_KEY_ENTER },
+    { "space", GLFW_KEY_SPACE },
+    { "escape", GLFW_KEY_ESCAPE },
+    { "left", GLFW_KEY_LEFT },
+    { "right", GLFW_KEY_RIGHT },
+    { "up", GLFW_KEY_UP },
+    { "down", GLFW_KEY_DOWN },
+    { "pageup", GLFW_KEY_PAGE_UP },
+    { "pagedown", GLFW_KEY_PAGE_DOWN },
+};
+
+
+/*******************************************************//**
+ * Parsing
+ * ********************************************************/
+
+/**
+ * @return the GLFW key code of a key's name in a script, -1 if there's no
+ *         such key
+ */
+static int parse_key(const char *name) {
+    size_t i;
+    if (name[0] >= 'a' && name[0] <= 'z' && name[1] == '\0')
+        return GLFW_KEY_A + (name[0] - 'a');
+    for (i=0; i<sizeof(key_names) / sizeof(key_names[0]); i++) {
+        if (strcmp(key_names[i].name, name) == 0)
+            return key_names[i].key;
+    }
+    return -1;
+}
+
+/**
+ * Reads the settings of a view line, like "scale=0.5 translate=0.1,0"
+ * @param settings text after "view"
+ * @param event event to fill in
+ * @return 0 on success, -1 on error
+ */
+static int parse_view(char *settings, replay_event *event) {
+    char *setting;
+
+    event->fields = 0;
+    for (setting=strtok(settings, " \t\r\n"); setting != NULL; setting=strtok(NULL, " \t\r\n")) {
+        if (sscanf(setting, "rotate=%f", &event->rotate) == 1)
+            event->fields |= VIEW_ROTATE;
+        else if (sscanf(setting, "scale=%f", &event->scale) == 1)
+            event->fields |= VIEW_SCALE;
+        else if (sscanf(setting, "translate=%f,%f", &event->x_pos, &event->y_pos) == 2)
+            event->fields |= VIEW_TRANSLATE;
+        else if (sscanf(setting, "shear=%f,%f", &event->shear_x, &event->shear_y) == 2)
+            event->fields |= VIEW_SHEAR;
+        else if (sscanf(setting, "tilt=%f,%f", &event->x_tilt, &event->y_tilt) == 2)
+            event->fields |= VIEW_TILT;
+        else
+            return -1;
+    }
+    return event->fields != 0 ? 0 : -1;
+}
+
+/**
+ * Reads one line of a script
+ * @param line text of the line
+ * @param event event to fill in
+ * @return 1 if the line held an event, 0 if it was blank or a comment,
+ *         -1 on error
+ */
+static int parse_line(char *line, replay_event *event) {
+    char type[16];
+    int length = 0;
+
+    while (*line == ' ' || *line == '\t')
+        line++;
+    if (*line == '\0' || *line == '\n' || *line == '\r' || *line == '#')
+        return 0;
+    memset(event, 0, sizeof(replay_event));
+    if (sscanf(line, "%lf %15s %n", &event->time, type, &length) < 2 || event->time < 0)
+        return -1;
+    line += length;
+
+    if (strcmp(type, "key") == 0) {
+        char name[16];
+        event->type = REPLAY_KEY;
+        if (sscanf(line, "%15s", name) != 1 || (event->key = parse_key(name)) < 0)
+            return -1;
+        return 1;
+    }
+    if (strcmp(type, "view") == 0) {
+        event->type = REPLAY_VIEW;
+        return parse_view(line, event) < 0 ? -1 : 1;
+    }
+    if (strcmp(type, "end") == 0) {
+        event->type = REPLAY_END;
+        return 1;
+    }
+    return -1;
+}
+
+/**
+ * Reads a script
+ * @param script script to fill in
+ * @param path file the script is in
+ * @return 0 on success, -1 on error
+ */
+int replay_load(replay_script *script, const char *path) {
+    FILE *fh = fopen(path, "r");
+    char line[MAX_SIZE];
+    int capacity = 0, number = 0, ret_val = 0;
+
+    memset(script, 0, sizeof(replay_script));
+    if (fh == NULL) {
+        fprintf(stderr, "Error: replay_load: %s can't be opened\n", path);
+        return -1;
+    }
+    while (ret_val == 0 && fgets(line, sizeof(line), fh) != NULL) {
+        replay_event event;
+        int parsed = parse_line(line, &event);
+
+        number++;
+        if (parsed == 0)
+            continue;
+        if (parsed < 0) {
+            fprintf(stderr, "Error: replay_load: %s line %d can't be understood\n", path, number);
+            ret_val = -1;
+        }
+        else if (script->count > 0 && event.time < script->events[script->count - 1].time) {
+            fprintf(stderr, "Error: replay_load: %s line %d is earlier than the line before\n",
+                    path, number);
+            ret_val = -1;
+        }
+        else if (script->count == capacity) {
+            int grown_capacity = capacity == 0 ? 64 : capacity * 2;
+            replay_event *grown = realloc(script->events, sizeof(replay_event) * grown_capacity);
+            if (grown == NULL) {
+                fprintf(stderr, "Error: replay_load: Unable to allocate memory\n");
+                ret_val = -1;
+            }
+            else {
+                script->events = grown;
+                capacity = grown_capacity;
+            }
+        }
+        if (ret_val == 0) {
+            script->events[script->count++] = event;
+            // whatever follows the end is never reached
+            if (event.type == REPLAY_END)
+                break;
+        }
+    }
+    if (ret_val == 0 && ferror(fh)) {
+        fprintf(stderr, "Error: replay_load: Problem reading %s\n", path);
+        ret_val = -1;
+    }
+    if (ret_val == 0 && script->count == 0) {
+        fprintf(stderr, "Error: replay_load: %s has no events\n", path);
+        ret_val = -1;
+    }
+    fclose(fh);
+    if (ret_val < 0)
+        replay_free(script);
+    return ret_val;
+}
+
+
+/*******************************************************//**
+ * Replaying
+ * ********************************************************/
+
+/**
+ * Starts the clock the events' times count from
+ * @param script script to start
+ * @param now current time in seconds
+ */
+void replay_start(replay_script *script, double now) {
+    script->start = now;
+    script->next = 0;
+    script->frames = 0;
+    script->finish = 0;
+}
+
+/**
+ * Hands out the next event that is due. Call repeatedly until it returns
+ * NULL to get every event that is due.
+ * @param script script being replayed
+ * @param now current time in seconds
+ * @return the event, NULL if none is due
+ */
+const replay_event *replay_next(replay_script *script, double now) {
+    if (script->start == 0 || script->next == script->count ||
+        script->events[script->next].time > now - script->start)
+        return NULL;
+    return &script->events[script->next++];
+}
+
+/**
+ * @return TRUE once every event has been handed out
+ */
+boolean replay_finished(const replay_script *script) {
+    return script->start != 0 && script->next == script->count;
+}
+
+/**
+ * Releases a script
+ * @param script script to free
+ */
+void replay_free(replay_script *script) {
+    free(script->events);
+    script->events = NULL;
+    script->count = 0;
+}
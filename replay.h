@@ -0,0 +1,51 @@
+/* replay header file - scripted key presses and views for repeatable benchmarks */
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include "ppmrw.h"
+
+// what a line of a script does
+enum replay_type {
+    REPLAY_KEY,         // presses a key, as if on the keyboard
+    REPLAY_VIEW,        // sets the view outright
+    REPLAY_END          // ends the replay
+};
+
+// parts of the view a REPLAY_VIEW event sets; the rest are left alone
+enum replay_view_field {
+    VIEW_ROTATE = 1,
+    VIEW_SCALE = 2,
+    VIEW_TRANSLATE = 4,
+    VIEW_SHEAR = 8,
+    VIEW_TILT = 16
+};
+
+// one line of a script
+typedef struct replay_event_t {
+    double time;            // seconds after the replay starts
+    enum replay_type type;
+    int key;                // GLFW key code of a REPLAY_KEY
+    int fields;             // replay_view_field bits of a REPLAY_VIEW
+    float rotate, scale;
+    float x_pos, y_pos;
+    float shear_x, shear_y;
+    float x_tilt, y_tilt;
+} replay_event;
+
+// a script being replayed
+typedef struct replay_script_t {
+    replay_event *events;   // in time order; only the last can be a REPLAY_END
+    int count;
+    int next;               // first event not handed out yet
+    double start;           // when the replay started, 0 before it has
+    double finish;          // when the last event was drawn, 0 before
+    int frames;             // frames drawn since the start
+} replay_script;
+
+int replay_load(replay_script *script, const char *path);
+void replay_start(replay_script *script, double now);
+const replay_event *replay_next(replay_script *script, double now);
+boolean replay_finished(const replay_script *script);
+void replay_free(replay_script *script);
+
+#endif
@@ -0,0 +1,719 @@
+/** slides - the images of a slideshow
+ * Each image is decoded on its own worker thread as soon as its header has
+ * been read, so rows can be shown as they arrive. The neighbours of the
+ * image on screen are decoded ahead of time, and decoded images and their
+ * tiles stay cached until they exceed the memory budgets, least recently
+ * shown first, so flipping back and forth doesn't decode anything again.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <GLFW/glfw3.h>
+
+#include "slides.h"
+#include "trace.h"
+
+// file name extensions of the images a directory is searched for
+static const char *image_extensions[] = { ".ppm", ".pgm", ".pbm", ".pam", ".pnm" };
+
+
+/*******************************************************//**
+ * Background decoding
+ * ********************************************************/
+
+/**
+ * @return a monotonic timestamp in seconds
+ */
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Row callback for the decoder: stores a row and makes it visible to the
+ * render loop
+ * @return 0 to keep decoding, 1 once the viewer is closing
+ */
+static int store_row(void *user, const header *hdr, int row, const void *pixels) {
+    loader *load = user;
+    boolean cancel;
+
+    memcpy((unsigned char *)load->img.pixels + row * load->row_bytes, pixels, load->row_bytes);
+    pthread_mutex_lock(&load->lock);
+    load->img.max_color_val = hdr->max_color_val;
+    load->rows_ready = row + 1;
+    cancel = load->cancel;
+    pthread_mutex_unlock(&load->lock);
+    return cancel ? 1 : 0;
+}
+
+/**
+ * Hashes a run of bytes, 32 at a time in four independent lanes so the
+ * multiplies overlap. Not meant to resist deliberate collisions, only to
+ * tell rewritten rows apart.
+ * @return 64-bit hash of the bytes
+ */
+static unsigned long long hash_bytes(const unsigned char *p, size_t length) {
+    const unsigned long long prime = 0x9E3779B185EBCA87ULL;
+    unsigned long long lanes[4] = { 1, 2, 3, 4 };
+    unsigned long long word, h = length;
+    size_t i;
+    int k;
+
+    for (i=0; i + 32 <= length; i += 32) {
+        for (k=0; k<4; k++) {
+            memcpy(&word, p + i + k * 8, 8);
+            lanes[k] = (lanes[k] ^ word) * prime;
+            lanes[k] ^= lanes[k] >> 29;
+        }
+    }
+    for (; i<length; i++)
+        h = (h ^ p[i]) * prime;
+    for (k=0; k<4; k++)
+        h = (h ^ lanes[k]) * prime;
+    return h ^ (h >> 32);
+}
+
+/**
+ * Hashes every BAND_ROWS rows of a decoded image, so the next version of
+ * the file can be compared with it after its pixels are gone
+ * @param load loader whose raster is fully decoded
+ * @return 0 on success, -1 on error
+ */
+static int hash_bands(loader *load) {
+    int band;
+    TRACE_SCOPE(span, "hash_bands");
+    TRACE_BYTES(span, load->img.height * load->row_bytes);
+
+    load->bands = (load->img.height + BAND_ROWS - 1) / BAND_ROWS;
+    load->band_hashes = malloc(sizeof(unsigned long long) * load->bands);
+    // no bands to compare with, so a reload counts every row as changed
+    if (load->band_hashes == NULL) {
+        load->bands = 0;
+        return -1;
+    }
+    for (band=0; band<load->bands; band++) {
+        int rows = load->img.height - band * BAND_ROWS;
+        if (rows > BAND_ROWS)
+            rows = BAND_ROWS;
+        load->band_hashes[band] =
+                hash_bytes((unsigned char *)load->img.pixels + band * BAND_ROWS * load->row_bytes,
+                           rows * load->row_bytes);
+    }
+    return 0;
+}
+
+/**
+ * Decodes the raster of the image being loaded (thread entry point)
+ */
+static void *load_image(void *arg) {
+    loader *load = arg;
+    int ret_val;
+    double start;
+
+    trace_thread_name("loader");
+    ret_val = ppm_stream_raster(load->fh, &load->hdr, store_row, load);
+
+    pthread_mutex_lock(&load->lock);
+    load->status = (ret_val < 0 && !load->cancel) ? -1 : 0;
+    load->done = TRUE;
+    load->finished = now();
+    pthread_mutex_unlock(&load->lock);
+    // wake the render loop so the last rows show up right away
+    glfwPostEmptyEvent();
+    if (ret_val < 0)
+        return NULL;
+
+    // without hashes a reload just uploads every row
+    if (load->hash_bands && hash_bands(load) < 0)
+        fprintf(stderr, "Warning: Unable to hash the image\n");
+
+    // the viewer works without mipmaps, it just aliases when zoomed out
+    start = now();
+    if (mip_pyramid_build(&load->mips, &load->img) < 0)
+        fprintf(stderr, "Warning: Unable to build mipmaps\n");
+    else
+        printf("Mipmaps built in %.1f ms\n", (now() - start) * 1000);
+    pthread_mutex_lock(&load->lock);
+    load->mips_ready = TRUE;
+    pthread_mutex_unlock(&load->lock);
+    glfwPostEmptyEvent();
+    return NULL;
+}
+
+/**
+ * Allocates the pixels of an image whose header has been read and starts
+ * decoding its raster on a worker thread
+ * @param load loader with fh and hdr filled in
+ * @return 0 on success, -1 on error
+ */
+static int start_loader(loader *load) {
+    load->img.width = load->hdr.width;
+    load->img.height = load->hdr.height;
+    load->img.max_color_val = load->hdr.max_color_val;
+    load->img.format = load->hdr.format;
+    if (alloc_image(&load->img) < 0)
+        return -1;
+    load->row_bytes = (size_t)load->img.width * PPM_CHANNELS(load->img.format) *
+                      (load->img.bit_depth / 8);
+    load->rows_ready = 0;
+    load->done = FALSE;
+    load->cancel = FALSE;
+    load->status = 0;
+    load->mips.levels = 0;
+    load->mips_ready = FALSE;
+    load->band_hashes = NULL;
+    load->bands = 0;
+    pthread_mutex_init(&load->lock, NULL);
+    if (pthread_create(&load->thread, NULL, load_image, load) != 0) {
+        fprintf(stderr, "Error: start_loader: Unable to start decoder thread\n");
+        pthread_mutex_destroy(&load->lock);
+        free_image(&load->img);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Stops the decoder if it's still running and waits for it to exit
+ * @param load loader started with start_loader()
+ */
+static void stop_loader(loader *load) {
+    pthread_mutex_lock(&load->lock);
+    load->cancel = TRUE;
+    pthread_mutex_unlock(&load->lock);
+    pthread_join(load->thread, NULL);
+    pthread_mutex_destroy(&load->lock);
+    mip_pyramid_free(&load->mips);
+    free(load->band_hashes);
+    load->band_hashes = NULL;
+}
+
+
+/*******************************************************//**
+ * Slides
+ * ********************************************************/
+
+/**
+ * Reads the header of a slide's image and starts decoding the rest
+ * @param show slideshow the slide is in
+ * @param s slide that isn't open
+ * @return 0 on success, -1 on error (the slide is marked as failed)
+ */
+static int open_slide(const slideshow *show, slide *s) {
+    loader *load = &s->load;
+    TRACE_SCOPE(span, "open_slide");
+
+    load->fh = strcmp(s->path, "-") == 0 ? stdin : fopen(s->path, "rb");
+    if (load->fh == NULL) {
+        fprintf(stderr, "Error: open_slide: %s can't be opened\n", s->path);
+        s->failed = TRUE;
+        return -1;
+    }
+    s->start_time = now();
+    load->hash_bands = show->watch;
+    if (read_header(load->fh, &load->hdr) < 0 || start_loader(load) < 0) {
+        fprintf(stderr, "Error: open_slide: Problem reading %s\n", s->path);
+        if (load->fh != stdin)
+            fclose(load->fh);
+        s->failed = TRUE;
+        return -1;
+    }
+    s->opened = TRUE;
+    s->rows_uploaded = 0;
+    s->loaded = FALSE;
+    s->mipmapped = FALSE;
+    return 0;
+}
+
+/**
+ * Stops a reload and throws away what it decoded, keeping the slide's
+ * current image
+ * @param s slide being reloaded
+ */
+static void drop_reload(slide *s) {
+    stop_loader(&s->reload);
+    free_image(&s->reload.img);
+    fclose(s->reload.fh);
+    s->reloading = FALSE;
+}
+
+/**
+ * Stops decoding a slide and releases its pixels and tiles. It is opened
+ * again the next time it's needed.
+ * @param s open slide
+ */
+static void close_slide(slide *s) {
+    if (s->reloading)
+        drop_reload(s);
+    stop_loader(&s->load);
+    free_image(&s->load.img);
+    if (s->load.fh != stdin)
+        fclose(s->load.fh);
+    if (s->has_tiles)
+        tile_cache_free(&s->tiles);
+    s->opened = FALSE;
+    s->has_tiles = FALSE;
+}
+
+/**
+ * Swaps a finished reload in for a slide's image. Only the bands whose
+ * hashes changed are copied into the resident tiles, if it has any; the
+ * rest of the textures are left as they are.
+ * @param s slide whose reload has decoded its raster and built its pyramid
+ */
+static void finish_reload(slide *s) {
+    loader *load = &s->load, *next = &s->reload;
+    unsigned long long *hashes = next->band_hashes;
+    int bands = next->bands;
+    size_t uploaded = s->has_tiles ? s->tiles.upload_bytes : 0;
+    int changed_rows = 0;
+    int band = 0, end;
+
+    // take the new pixels over before stop_loader() frees what it owns
+    free_image(&load->img);
+    mip_pyramid_free(&load->mips);
+    load->img = next->img;
+    load->mips = next->mips;
+    load->mips.level[0] = load->img;
+    next->mips.levels = 0;
+    next->band_hashes = NULL;
+    stop_loader(next);
+    fclose(next->fh);
+    s->reloading = FALSE;
+
+    // tiles.img already points at load->img; refresh runs of changed bands
+    if (s->has_tiles)
+        s->tiles.mips = load->mips.levels > 1 ? &load->mips : NULL;
+    while (band < bands) {
+        int first_row = band * BAND_ROWS, rows;
+        if (band < load->bands && hashes[band] == load->band_hashes[band]) {
+            band++;
+            continue;
+        }
+        for (end=band+1; end<bands; end++) {
+            if (end < load->bands && hashes[end] == load->band_hashes[end])
+                break;
+        }
+        rows = (end - band) * BAND_ROWS;
+        if (first_row + rows > load->img.height)
+            rows = load->img.height - first_row;
+        if (s->has_tiles)
+            tile_cache_refresh(&s->tiles, first_row, rows);
+        changed_rows += rows;
+        band = end;
+    }
+    // without hashes there is nothing to compare with, so everything changed
+    if (hashes == NULL) {
+        if (s->has_tiles)
+            tile_cache_refresh(&s->tiles, 0, load->img.height);
+        changed_rows = load->img.height;
+    }
+    printf("Reloaded in %.1f ms, %d of %d rows changed, uploaded %.1f MB\n",
+           (now() - s->reload_time) * 1000, changed_rows, load->img.height,
+           ((s->has_tiles ? s->tiles.upload_bytes : 0) - uploaded) / 1e6);
+    free(load->band_hashes);
+    load->band_hashes = hashes;
+    load->bands = bands;
+
+    if (s->has_tiles && tile_cache_pin(&s->tiles) == 0) {
+        mip_pyramid_free(&load->mips);
+        free_image(&load->img);
+    }
+}
+
+/**
+ * Estimates the memory a slide's decoded image takes, counting the mipmap
+ * pyramid (a third of the image) while the pixels are still held
+ */
+static size_t slide_cpu_bytes(const slide *s) {
+    const image *img = &s->load.img;
+    if (!s->opened || img->pixels == NULL)
+        return 0;
+    return (size_t)img->width * img->height * PPM_CHANNELS(img->format) *
+           (img->bit_depth / 8) / 3 * 4;
+}
+
+/**
+ * @return the texture memory a slide's tiles take
+ */
+static size_t slide_gpu_bytes(const slide *s) {
+    return s->has_tiles ? s->tiles.resident_bytes : 0;
+}
+
+
+/*******************************************************//**
+ * Slide list
+ * ********************************************************/
+
+/**
+ * Appends an image to the slideshow
+ * @param show slideshow
+ * @param path path of the image, taken over by the slideshow
+ * @return 0 on success, -1 on error
+ */
+static int add_slide(slideshow *show, char *path) {
+    slide *slides = realloc(show->slides, sizeof(slide) * (show->count + 1));
+    if (slides == NULL) {
+        fprintf(stderr, "Error: add_slide: Unable to allocate %d slides\n", show->count + 1);
+        free(path);
+        return -1;
+    }
+    show->slides = slides;
+    memset(&slides[show->count], 0, sizeof(slide));
+    slides[show->count].path = path;
+    show->count++;
+    return 0;
+}
+
+/**
+ * @return TRUE if a file name ends in one of image_extensions
+ */
+static boolean is_image_name(const char *name) {
+    size_t length = strlen(name);
+    size_t i;
+
+    for (i=0; i<sizeof(image_extensions) / sizeof(image_extensions[0]); i++) {
+        size_t ext = strlen(image_extensions[i]);
+        if (length > ext && strcasecmp(name + length - ext, image_extensions[i]) == 0)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/**
+ * Appends the images in a directory to the slideshow in name order
+ * @param show slideshow
+ * @param dir path of the directory
+ * @return 0 on success, -1 on error
+ */
+static int add_directory(slideshow *show, const char *dir) {
+    DIR *d = opendir(dir);
+    struct dirent *entry;
+    char **names = NULL;
+    int count = 0, i;
+    int ret_val = 0;
+
+    if (d == NULL) {
+        fprintf(stderr, "Error: add_directory: %s can't be opened\n", dir);
+        return -1;
+    }
+    while ((entry = readdir(d)) != NULL) {
+        char **grown;
+        if (!is_image_name(entry->d_name))
+            continue;
+        grown = realloc(names, sizeof(char *) * (count + 1));
+        if (grown == NULL) {
+            ret_val = -1;
+            break;
+        }
+        names = grown;
+        names[count] = malloc(strlen(dir) + strlen(entry->d_name) + 2);
+        if (names[count] == NULL) {
+            ret_val = -1;
+            break;
+        }
+        sprintf(names[count++], "%s/%s", dir, entry->d_name);
+    }
+    closedir(d);
+    if (ret_val < 0)
+        fprintf(stderr, "Error: add_directory: Unable to list %s\n", dir);
+
+    qsort(names, count, sizeof(char *), compare_names);
+    for (i=0; i<count; i++) {
+        if (ret_val == 0)
+            ret_val = add_slide(show, names[i]);
+        else
+            free(names[i]);
+    }
+    free(names);
+    return ret_val;
+}
+
+
+/*******************************************************//**
+ * Slideshow
+ * ********************************************************/
+
+/**
+ * Builds the list of slides from the file and directory names given on the
+ * command line. Nothing is opened until slideshow_show() is called; the
+ * budgets, tile size and prefetch distance are left for the caller to set.
+ * @param show slideshow to initialize
+ * @param names image files and directories of images, or just "-" for stdin
+ * @param count number of names
+ * @return 0 on success, -1 on error
+ */
+int slideshow_init(slideshow *show, char **names, int count) {
+    struct stat st;
+    int i;
+
+    memset(show, 0, sizeof(slideshow));
+    for (i=0; i<count; i++) {
+        char *path;
+        if (strcmp(names[i], "-") == 0) {
+            // stdin can only be read once, so it can't be reopened after eviction
+            if (count > 1) {
+                fprintf(stderr, "Error: slideshow_init: - can't be mixed with other images\n");
+                slideshow_free(show);
+                return -1;
+            }
+        }
+        else if (stat(names[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+            if (add_directory(show, names[i]) < 0) {
+                slideshow_free(show);
+                return -1;
+            }
+            continue;
+        }
+        path = strdup(names[i]);
+        if (path == NULL || add_slide(show, path) < 0) {
+            slideshow_free(show);
+            return -1;
+        }
+    }
+    if (show->count == 0) {
+        fprintf(stderr, "Error: slideshow_init: No images found\n");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Puts a slide on screen, starting to decode it if it isn't cached
+ * @param show slideshow
+ * @param index slide to show
+ */
+void slideshow_show(slideshow *show, int index) {
+    slide *s = &show->slides[index];
+
+    show->current = index;
+    s->last_shown = ++show->shows;
+    if (!s->opened && !s->failed)
+        open_slide(show, s);
+}
+
+/**
+ * Starts decoding the slides around the current one, nearest first, that
+ * aren't cached yet. The slideshow wraps around at both ends.
+ * @param show slideshow
+ */
+void slideshow_prefetch(slideshow *show) {
+    int distance, side;
+
+    for (distance=1; distance<=show->prefetch && 2 * distance < show->count + 1; distance++) {
+        for (side=1; side>=-1; side-=2) {
+            int index = ((show->current + side * distance) % show->count + show->count) % show->count;
+            slide *s = &show->slides[index];
+            if (!s->opened && !s->failed)
+                open_slide(show, s);
+        }
+    }
+}
+
+/**
+ * Hands the current slide's progress to its tiles: newly decoded rows and,
+ * once decoding is done, the mipmap pyramid. Needs the GL context, and
+ * sets up the slide's tiles the first time it's shown. A software
+ * slideshow has no tiles and only keeps track of the progress.
+ * @param show slideshow
+ * @param changed set to TRUE if the slide would now look different
+ * @return 0 on success, -1 if the current slide couldn't be read
+ */
+int slideshow_update(slideshow *show, boolean *changed) {
+    slide *s = slideshow_current(show);
+    int rows_ready;
+    boolean done, mips_ready;
+    int status;
+    double finished;
+
+    if (s->failed)
+        return -1;
+    if (!s->has_tiles && !show->software) {
+        if (tile_cache_init(&s->tiles, &s->load.img, show->tile_size, show->gpu_budget,
+                            show->force_8bit) < 0) {
+            s->failed = TRUE;
+            close_slide(s);
+            return -1;
+        }
+        s->has_tiles = TRUE;
+        s->rows_uploaded = 0;
+        s->loaded = FALSE;
+        s->mipmapped = FALSE;
+        *changed = TRUE;
+    }
+    if (s->reloading) {
+        pthread_mutex_lock(&s->reload.lock);
+        done = s->reload.done;
+        status = s->reload.status;
+        mips_ready = s->reload.mips_ready;
+        pthread_mutex_unlock(&s->reload.lock);
+        if (done && status < 0) {
+            fprintf(stderr, "Warning: %s couldn't be reloaded, keeping the last version\n",
+                    s->path);
+            drop_reload(s);
+        }
+        else if (mips_ready) {
+            finish_reload(s);
+            *changed = TRUE;
+        }
+    }
+    if (s->mipmapped)
+        return 0;
+
+    pthread_mutex_lock(&s->load.lock);
+    rows_ready = s->load.rows_ready;
+    done = s->load.done;
+    status = s->load.status;
+    finished = s->load.finished;
+    mips_ready = s->load.mips_ready;
+    pthread_mutex_unlock(&s->load.lock);
+
+    // stream whatever rows the decoder has finished into the tiles
+    if (rows_ready > s->rows_uploaded) {
+        if (s->has_tiles)
+            tile_cache_rows_ready(&s->tiles, rows_ready);
+        s->rows_uploaded = rows_ready;
+        *changed = TRUE;
+    }
+    if (done && !s->loaded) {
+        if (status < 0) {
+            fprintf(stderr, "Error: slideshow_update: Problem reading %s\n", s->path);
+            close_slide(s);
+            s->failed = TRUE;
+            return -1;
+        }
+        printf("Image decoded in %.1f ms\n", (finished - s->start_time) * 1000);
+        s->loaded = TRUE;
+    }
+
+    // switch to trilinear filtering once the pyramid is built
+    if (mips_ready && s->has_tiles) {
+        if (s->load.mips.levels > 1)
+            tile_cache_set_mipmaps(&s->tiles, &s->load.mips);
+        // when every tile fits in the budget nothing is ever re-uploaded,
+        // so the CPU copy of the pixels can go
+        if (tile_cache_pin(&s->tiles) == 0) {
+            mip_pyramid_free(&s->load.mips);
+            free_image(&s->load.img);
+        }
+        if (s->tiles.upload_seconds > 0)
+            printf("Uploaded %.1f MB of textures at %.0f MB/s\n", s->tiles.upload_bytes / 1e6,
+                   s->tiles.upload_bytes / 1e6 / s->tiles.upload_seconds);
+    }
+    if (mips_ready) {
+        s->mipmapped = TRUE;
+        *changed = TRUE;
+    }
+    return 0;
+}
+
+/**
+ * Decodes the current slide's file again after it has been rewritten. The
+ * new version is decoded in the background while the old one stays on
+ * screen; slideshow_update() then swaps it in, uploading only the bands of
+ * rows that changed. An image that isn't fully shown yet, or whose size or
+ * format changed, is loaded again from scratch instead. The slide's tiles
+ * may have to be set up again by the next slideshow_update().
+ * @param show slideshow
+ */
+void slideshow_reload(slideshow *show) {
+    slide *s = slideshow_current(show);
+    loader *next = &s->reload;
+    const image *img = &s->load.img;
+
+    if (strcmp(s->path, "-") == 0)
+        return;
+    if (s->reloading)
+        drop_reload(s);
+    if (s->opened && s->mipmapped) {
+        next->fh = fopen(s->path, "rb");
+        if (next->fh == NULL || read_header(next->fh, &next->hdr) < 0) {
+            fprintf(stderr, "Warning: %s can't be reloaded\n", s->path);
+            if (next->fh != NULL)
+                fclose(next->fh);
+            return;
+        }
+        // img's pixels may be freed, but its size and format are still there
+        if (next->hdr.width == img->width && next->hdr.height == img->height &&
+            next->hdr.format == img->format &&
+            PPM_SAMPLE_BYTES(next->hdr.max_color_val) == img->bit_depth / 8) {
+            next->hash_bands = TRUE;
+            s->reload_time = now();
+            if (start_loader(next) == 0)
+                s->reloading = TRUE;
+            else
+                fclose(next->fh);
+            return;
+        }
+        fclose(next->fh);
+    }
+    if (s->opened)
+        close_slide(s);
+    s->failed = FALSE;
+    open_slide(show, s);
+}
+
+/**
+ * Closes the least recently shown slides until the cached images fit in
+ * the budgets. The current slide and the ones being prefetched around it
+ * are kept even if they alone are over budget.
+ * @param show slideshow
+ */
+void slideshow_trim(slideshow *show) {
+    for (;;) {
+        size_t cpu_bytes = 0, gpu_bytes = 0;
+        int oldest = -1;
+        int i;
+
+        for (i=0; i<show->count; i++) {
+            slide *s = &show->slides[i];
+            int distance = abs(i - show->current);
+            if (!s->opened)
+                continue;
+            cpu_bytes += slide_cpu_bytes(s);
+            gpu_bytes += slide_gpu_bytes(s);
+            if (distance > show->count / 2)
+                distance = show->count - distance;
+            if (distance > show->prefetch &&
+                (oldest < 0 || s->last_shown < show->slides[oldest].last_shown))
+                oldest = i;
+        }
+        if ((cpu_bytes <= show->cpu_budget && gpu_bytes <= show->gpu_budget) || oldest < 0)
+            return;
+        close_slide(&show->slides[oldest]);
+    }
+}
+
+/**
+ * @return the slide on screen
+ */
+slide *slideshow_current(slideshow *show) {
+    return &show->slides[show->current];
+}
+
+/**
+ * Closes every slide and releases the list
+ * @param show slideshow
+ */
+void slideshow_free(slideshow *show) {
+    int i;
+
+    for (i=0; i<show->count; i++) {
+        if (show->slides[i].opened)
+            close_slide(&show->slides[i]);
+        free(show->slides[i].path);
+    }
+    free(show->slides);
+    show->slides = NULL;
+    show->count = 0;
+}
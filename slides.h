@@ -0,0 +1,76 @@
+/* slides header file - the images of a slideshow, decoded ahead and cached */
+#ifndef SLIDES_H
+#define SLIDES_H
+
+#include <stdio.h>
+#include <pthread.h>
+
+#include "ppmrw.h"
+#include "tiles.h"
+
+// rows hashed together to find the parts of a reloaded image that changed
+#define BAND_ROWS 16
+
+// image being decoded on a worker thread while the window is up
+typedef struct loader_t {
+    FILE *fh;
+    header hdr;
+    image img;              // pixels land here a row at a time
+    size_t row_bytes;
+    pthread_t thread;
+    pthread_mutex_t lock;   // guards the fields below
+    int rows_ready;         // rows of img decoded so far
+    boolean done;           // the raster has been decoded (or failed)
+    boolean cancel;         // set by the main thread to stop the worker
+    int status;             // 0 on success, -1 on a decode error
+    double finished;        // when the raster was done, in seconds
+    mip_pyramid mips;       // built after decoding, valid once mips_ready is set
+    boolean mips_ready;
+    boolean hash_bands;     // fill band_hashes before building the pyramid
+    unsigned long long *band_hashes;    // one per BAND_ROWS rows, or NULL
+    int bands;
+} loader;
+
+// one image of a slideshow and, while it's cached, its pixels and tiles
+typedef struct slide_t {
+    char *path;             // "-" for stdin
+    boolean opened;         // load has been started
+    boolean failed;         // the image couldn't be read
+    loader load;
+    double start_time;      // when load was started, in seconds
+    boolean has_tiles;      // tiles has been set up; only for shown slides
+    tile_cache tiles;
+    int rows_uploaded;      // rows of the image handed to tiles (or drawable)
+    boolean loaded;         // the end of the decode has been handled
+    boolean mipmapped;      // the pyramid has been handed to tiles
+    unsigned long last_shown;
+    boolean reloading;      // reload is decoding a new version of the file
+    loader reload;
+    double reload_time;     // when reload was started, in seconds
+} slide;
+
+// a list of images, one of them on screen
+typedef struct slideshow_t {
+    slide *slides;
+    int count;
+    int current;            // index of the slide on screen
+    unsigned long shows;    // slides shown so far, orders the LRU
+    int prefetch;           // slides on each side of current decoded ahead
+    int tile_size;
+    size_t cpu_budget;      // most memory the cached images may use
+    size_t gpu_budget;      // most texture memory the cached images may use
+    boolean force_8bit;
+    boolean watch;          // hash the images so reloads only upload what changed
+    boolean software;       // drawn on the CPU: no tiles, and the pixels are kept
+} slideshow;
+
+int slideshow_init(slideshow *show, char **names, int count);
+void slideshow_show(slideshow *show, int index);
+void slideshow_prefetch(slideshow *show);
+int slideshow_update(slideshow *show, boolean *changed);
+void slideshow_reload(slideshow *show);
+void slideshow_trim(slideshow *show);
+slide *slideshow_current(slideshow *show);
+void slideshow_free(slideshow *show);
+
+#endif
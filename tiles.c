@@ -0,0 +1,661 @@
+/** tiles - draws an image as a grid of tile textures
+ * Images larger than GL_MAX_TEXTURE_SIZE can't be uploaded as one texture,
+ * and a huge texture wastes memory when only a corner is on screen. The
+ * image is split into fixed-size tiles instead; only tiles that intersect
+ * the viewport are uploaded, and the least recently seen ones are evicted
+ * when the resident tiles would exceed a GPU memory budget.
+ *
+ * Once the whole image is decoded, a mipmap pyramid is built on the CPU
+ * (GL 2.0 has no glGenerateMipmap without extensions) and every tile gets
+ * its levels, so zoomed out views are drawn with trilinear filtering
+ * instead of aliasing.
+ *
+ * Pixels are uploaded through two pixel buffer objects used in turn: rows
+ * are copied into one while the driver transfers the other, so uploads
+ * don't stall on the GPU.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "tiles.h"
+#include "matsimd.h"
+#include "trace.h"
+
+// texture formats indexed by the number of channels in an image
+static const GLenum texture_formats[] = { 0, GL_RED, GL_RG, GL_RGB, GL_RGBA };
+static const GLenum texture_formats8[] = { 0, GL_R8, GL_RG8, GL_RGB8, GL_RGBA8 };
+static const GLenum texture_formats16[] = { 0, GL_R16, GL_RG16, GL_RGB16, GL_RGBA16 };
+
+
+/*******************************************************//**
+ * LRU list of resident tiles
+ * ********************************************************/
+
+/**
+ * Takes a resident tile out of the LRU list
+ */
+static void lru_unlink(tile_cache *cache, int i) {
+    tile *t = &cache->tiles[i];
+    if (t->prev >= 0)
+        cache->tiles[t->prev].next = t->next;
+    else
+        cache->lru_head = t->next;
+    if (t->next >= 0)
+        cache->tiles[t->next].prev = t->prev;
+    else
+        cache->lru_tail = t->prev;
+    t->prev = t->next = -1;
+}
+
+/**
+ * Puts a resident tile at the most recently used end of the LRU list
+ */
+static void lru_push(tile_cache *cache, int i) {
+    tile *t = &cache->tiles[i];
+    t->prev = -1;
+    t->next = cache->lru_head;
+    if (cache->lru_head >= 0)
+        cache->tiles[cache->lru_head].prev = i;
+    cache->lru_head = i;
+    if (cache->lru_tail < 0)
+        cache->lru_tail = i;
+}
+
+/**
+ * Releases the texture of a resident tile
+ */
+static void evict(tile_cache *cache, int i) {
+    tile *t = &cache->tiles[i];
+    lru_unlink(cache, i);
+    glDeleteTextures(1, &t->texture);
+    t->texture = 0;
+    t->rows_uploaded = 0;
+    t->levels = 1;
+    cache->resident_bytes -= t->bytes;
+}
+
+
+/*******************************************************//**
+ * Uploads
+ * ********************************************************/
+
+/**
+ * @return a monotonic timestamp in seconds
+ */
+static double seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Copies a rectangle of pixels into a level of the bound texture. The rows
+ * are packed into the next upload buffer and the texture is filled from
+ * there, so the call returns without waiting for the transfer. If the
+ * buffer can't be mapped, the pixels are uploaded straight from src.
+ * @param cache tile cache
+ * @param level mip level to fill
+ * @param allocate TRUE to (re)create the level at width x height
+ * @param y first row of the level to fill when not allocating
+ * @param width pixels per row
+ * @param height number of rows
+ * @param src first pixel to copy
+ * @param src_width pixels per row of the image src points into
+ */
+static void upload_rect(tile_cache *cache, int level, boolean allocate, int y,
+                        int width, int height, const unsigned char *src, int src_width) {
+    size_t row_bytes = (size_t)width * cache->pixel_bytes;
+    size_t bytes = row_bytes * height;
+    double start = seconds();
+    const void *pixels = NULL;
+    unsigned char *dst;
+    int row;
+    TRACE_SCOPE(span, "upload");
+    TRACE_BYTES(span, bytes);
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, cache->upload_buffers[cache->next_upload]);
+    cache->next_upload = (cache->next_upload + 1) % UPLOAD_BUFFERS;
+    // orphan the old storage so the map doesn't wait for its transfer
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes, NULL, GL_STREAM_DRAW);
+    dst = glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+    if (dst != NULL) {
+        for (row=0; row<height; row++)
+            memcpy(dst + row * row_bytes, src + (size_t)row * src_width * cache->pixel_bytes,
+                   row_bytes);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    }
+    else {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, src_width);
+        pixels = src;
+    }
+
+    if (allocate)
+        glTexImage2D(GL_TEXTURE_2D, level, cache->internal_format, width, height, 0,
+                     cache->format, cache->type, pixels);
+    else
+        glTexSubImage2D(GL_TEXTURE_2D, level, 0, y, width, height, cache->format, cache->type,
+                        pixels);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    cache->upload_bytes += bytes;
+    cache->upload_seconds += seconds() - start;
+}
+
+/**
+ * Copies the decoded rows of a tile that aren't in its texture yet
+ * @param cache tile cache
+ * @param t resident tile
+ */
+static void upload_tile_rows(tile_cache *cache, tile *t) {
+    int rows = cache->rows_ready - t->y;
+    unsigned char *src;
+
+    if (rows > t->height)
+        rows = t->height;
+    if (rows <= t->rows_uploaded)
+        return;
+
+    src = (unsigned char *)cache->img->pixels +
+          ((size_t)(t->y + t->rows_uploaded) * cache->img->width + t->x) * cache->pixel_bytes;
+    glBindTexture(GL_TEXTURE_2D, t->texture);
+    upload_rect(cache, 0, FALSE, t->rows_uploaded, t->width, rows - t->rows_uploaded, src,
+                cache->img->width);
+    t->rows_uploaded = rows;
+}
+
+/**
+ * Counts the mip levels of a texture, down to 1x1
+ */
+static int level_count(int width, int height) {
+    int levels = 1;
+    while (width > 1 || height > 1) {
+        width = width > 1 ? width / 2 : 1;
+        height = height > 1 ? height / 2 : 1;
+        levels++;
+    }
+    return levels;
+}
+
+/**
+ * Computes the GPU memory a tile's texture takes with a number of levels
+ */
+static size_t tile_bytes(const tile_cache *cache, const tile *t, int levels) {
+    int channels = PPM_CHANNELS(cache->img->format);
+    size_t texel = channels * (cache->internal_format == texture_formats16[channels] ? 2 : 1);
+    size_t bytes = 0;
+    int level;
+
+    for (level=0; level<levels; level++) {
+        size_t w = t->width >> level > 0 ? t->width >> level : 1;
+        size_t h = t->height >> level > 0 ? t->height >> level : 1;
+        bytes += w * h * texel;
+    }
+    return bytes;
+}
+
+/**
+ * Counts the levels a tile gets once it's resident: all of them down to
+ * 1x1 when the pyramid is built, otherwise just level 0
+ */
+static int resident_levels(const tile_cache *cache, const tile *t) {
+    int levels = level_count(t->width, t->height);
+    if (cache->mips == NULL)
+        return 1;
+    return levels < cache->mips->levels ? levels : cache->mips->levels;
+}
+
+/**
+ * Evicts the least recently used tiles that weren't visible this frame
+ * until some more bytes fit in the budget
+ * @param cache tile cache
+ * @param bytes bytes about to be added to the resident ones
+ * @param keep tile that mustn't be evicted, or -1
+ * @return 0 if they fit, -1 if the budget is taken by visible tiles
+ */
+static int make_room(tile_cache *cache, size_t bytes, int keep) {
+    while (cache->resident_bytes + bytes > cache->budget && cache->lru_tail >= 0 &&
+           cache->lru_tail != keep && cache->tiles[cache->lru_tail].last_frame != cache->frame) {
+        evict(cache, cache->lru_tail);
+    }
+    if (cache->resident_bytes + bytes > cache->budget) {
+        if (!cache->over_budget)
+            fprintf(stderr, "Warning: GPU budget is too small for the visible tiles\n");
+        cache->over_budget = TRUE;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Sets a tile's minification filter: trilinear over its mip levels when
+ * it has them and they're enabled, otherwise nearest like magnification
+ */
+static void set_min_filter(tile_cache *cache, tile *t) {
+    boolean trilinear = cache->mipmaps && t->levels > 1;
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+                    trilinear ? GL_LINEAR_MIPMAP_LINEAR : GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, t->levels - 1);
+}
+
+/**
+ * Uploads levels 1 and up of a resident tile from the pyramid. Tiles start
+ * at multiples of the tile size, so a tile's level n starts at its level 0
+ * position halved n times in the matching pyramid image.
+ * @param cache tile cache with its pyramid set
+ * @param t resident tile with all of its rows uploaded
+ */
+static void upload_tile_levels(tile_cache *cache, tile *t) {
+    int levels = resident_levels(cache, t);
+    int level;
+
+    glBindTexture(GL_TEXTURE_2D, t->texture);
+    for (level=1; level<levels; level++) {
+        const image *src = &cache->mips->level[level];
+        int width = t->width >> level > 0 ? t->width >> level : 1;
+        int height = t->height >> level > 0 ? t->height >> level : 1;
+        unsigned char *pixels = (unsigned char *)src->pixels +
+                                ((size_t)(t->y >> level) * src->width + (t->x >> level)) *
+                                cache->pixel_bytes;
+        upload_rect(cache, level, TRUE, 0, width, height, pixels, src->width);
+    }
+
+    cache->resident_bytes -= t->bytes;
+    t->levels = levels;
+    t->bytes = tile_bytes(cache, t, levels);
+    cache->resident_bytes += t->bytes;
+    set_min_filter(cache, t);
+}
+
+/**
+ * Gives a tile a texture, evicting the least recently used tiles that
+ * weren't visible this frame until it fits in the budget with all the
+ * levels it will get
+ * @param cache tile cache
+ * @param i index of the tile
+ * @return 0 on success, -1 if the budget is taken by visible tiles
+ */
+static int make_resident(tile_cache *cache, int i) {
+    tile *t = &cache->tiles[i];
+
+    if (make_room(cache, tile_bytes(cache, t, resident_levels(cache, t)), -1) < 0)
+        return -1;
+
+    glGenTextures(1, &t->texture);
+    glBindTexture(GL_TEXTURE_2D, t->texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    // keep neighbouring tiles from bleeding into each other at the seams
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, cache->internal_format, t->width, t->height, 0,
+                 cache->format, cache->type, NULL);
+    t->rows_uploaded = 0;
+    t->levels = 1;
+    t->bytes = tile_bytes(cache, t, 1);
+    set_min_filter(cache, t);
+    cache->resident_bytes += t->bytes;
+    lru_push(cache, i);
+    upload_tile_rows(cache, t);
+    if (cache->mips != NULL)
+        upload_tile_levels(cache, t);
+    return 0;
+}
+
+
+/*******************************************************//**
+ * Visibility
+ * ********************************************************/
+
+/**
+ * Checks whether any part of a tile lands inside the viewport
+ * @param mvp transformation the image is drawn with
+ * @param quad the tile's four vertexes
+ * @return TRUE if the tile may be visible
+ */
+static boolean tile_visible(mat4x4 mvp, const Vertex *quad) {
+    float min_x = 1, min_y = 1, max_x = -1, max_y = -1;
+    vec4 corners[4];
+    int k;
+
+    for (k=0; k<4; k++) {
+        corners[k][0] = quad[k].Position[0];
+        corners[k][1] = quad[k].Position[1];
+        corners[k][2] = 0;
+        corners[k][3] = 1;
+    }
+    mat4x4_transform_points(corners, mvp, (const vec4 *)corners, 4);
+    for (k=0; k<4; k++) {
+        float *clip = corners[k];
+        // behind the viewer the projection flips, so don't cull at all
+        if (clip[3] <= 0)
+            return TRUE;
+        clip[0] /= clip[3];
+        clip[1] /= clip[3];
+        if (k == 0 || clip[0] < min_x) min_x = clip[0];
+        if (k == 0 || clip[0] > max_x) max_x = clip[0];
+        if (k == 0 || clip[1] < min_y) min_y = clip[1];
+        if (k == 0 || clip[1] > max_y) max_y = clip[1];
+    }
+    return max_x >= -1 && min_x <= 1 && max_y >= -1 && min_y <= 1;
+}
+
+
+/*******************************************************//**
+ * Tile cache
+ * ********************************************************/
+
+/**
+ * Splits an image into tiles and builds the vertex buffer that draws them.
+ * No textures are created until tiles become visible. The vertex buffer is
+ * left bound so the caller can set up its vertex attributes.
+ * @param cache tile cache to initialize
+ * @param img image to draw; its pixels may still be decoding
+ * @param tile_size requested width and height of a tile, lowered to
+ *                  GL_MAX_TEXTURE_SIZE if needed
+ * @param budget most bytes of GPU memory the resident tiles may use
+ * @param force_8bit store 16-bit images with 8 bits per channel
+ * @return 0 on success, -1 on error
+ */
+int tile_cache_init(tile_cache *cache, image *img, int tile_size, size_t budget,
+                    boolean force_8bit) {
+    int channels = PPM_CHANNELS(img->format);
+    GLint max_size;
+    int tx, ty, k;
+
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+    if (tile_size > max_size)
+        tile_size = max_size;
+
+    cache->img = img;
+    cache->tile_size = tile_size;
+    cache->tiles_x = (img->width + tile_size - 1) / tile_size;
+    cache->tiles_y = (img->height + tile_size - 1) / tile_size;
+    cache->format = texture_formats[channels];
+    cache->type = img->bit_depth == 16 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_BYTE;
+    cache->internal_format = (img->bit_depth == 16 && !force_8bit) ? texture_formats16[channels]
+                                                                   : texture_formats8[channels];
+    cache->pixel_bytes = (size_t)channels * (img->bit_depth / 8);
+    cache->budget = budget;
+    cache->resident_bytes = 0;
+    cache->lru_head = cache->lru_tail = -1;
+    cache->frame = 0;
+    cache->rows_ready = 0;
+    cache->over_budget = FALSE;
+    cache->mips = NULL;
+    cache->mipmaps = TRUE;
+    cache->next_upload = 0;
+    cache->upload_bytes = 0;
+    cache->upload_seconds = 0;
+
+    cache->tiles = calloc((size_t)cache->tiles_x * cache->tiles_y, sizeof(tile));
+    cache->quads = malloc((size_t)cache->tiles_x * cache->tiles_y * 4 * sizeof(Vertex));
+    if (cache->tiles == NULL || cache->quads == NULL) {
+        fprintf(stderr, "Error: tile_cache_init: Unable to allocate %dx%d tiles\n",
+                cache->tiles_x, cache->tiles_y);
+        free(cache->tiles);
+        free(cache->quads);
+        return -1;
+    }
+
+    for (ty=0; ty<cache->tiles_y; ty++) {
+        for (tx=0; tx<cache->tiles_x; tx++) {
+            int i = ty * cache->tiles_x + tx;
+            tile *t = &cache->tiles[i];
+            Vertex *quad = &cache->quads[i * 4];
+            float left, right, top, bottom;
+
+            t->x = tx * tile_size;
+            t->y = ty * tile_size;
+            t->width = img->width - t->x < tile_size ? img->width - t->x : tile_size;
+            t->height = img->height - t->y < tile_size ? img->height - t->y : tile_size;
+            t->bytes = tile_bytes(cache, t, 1);
+            t->levels = 1;
+            t->prev = t->next = -1;
+
+            // the image spans -1..1 with its first row at the top
+            left = -1 + 2.0f * t->x / img->width;
+            right = -1 + 2.0f * (t->x + t->width) / img->width;
+            top = 1 - 2.0f * t->y / img->height;
+            bottom = 1 - 2.0f * (t->y + t->height) / img->height;
+            Vertex corners[4] = {
+                    {{right, bottom}, {1, 1}},
+                    {{right, top},    {1, 0}},
+                    {{left, top},     {0, 0}},
+                    {{left, bottom},  {0, 1}}
+            };
+            for (k=0; k<4; k++)
+                quad[k] = corners[k];
+        }
+    }
+
+    glGenBuffers(UPLOAD_BUFFERS, cache->upload_buffers);
+    glGenBuffers(1, &cache->vertex_buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, cache->vertex_buffer);
+    glBufferData(GL_ARRAY_BUFFER, (size_t)cache->tiles_x * cache->tiles_y * 4 * sizeof(Vertex),
+                 cache->quads, GL_STATIC_DRAW);
+    return 0;
+}
+
+/**
+ * Tells the cache how many rows of the image have been decoded and copies
+ * the new ones into the tiles that are already resident
+ * @param cache tile cache
+ * @param rows rows of the image decoded so far
+ */
+void tile_cache_rows_ready(tile_cache *cache, int rows) {
+    int i;
+
+    cache->rows_ready = rows;
+    for (i=cache->lru_head; i>=0; i=cache->tiles[i].next)
+        upload_tile_rows(cache, &cache->tiles[i]);
+}
+
+/**
+ * Switches the cache to another fully decoded image of the same size and
+ * format, such as the next frame of a sequence. The resident tiles are
+ * refilled with glTexSubImage2D, so no textures are reallocated.
+ * @param cache tile cache without a mipmap pyramid
+ * @param img image to draw from now on; must outlive its use by the cache
+ */
+void tile_cache_replace(tile_cache *cache, image *img) {
+    int i;
+
+    cache->img = img;
+    for (i=cache->lru_head; i>=0; i=cache->tiles[i].next)
+        cache->tiles[i].rows_uploaded = 0;
+    tile_cache_rows_ready(cache, img->height);
+}
+
+/**
+ * Copies a band of rows that changed in the image into the resident tiles
+ * it crosses, along with the rows of their mip levels the band feeds into.
+ * Tiles that aren't resident pick the change up when they're uploaded.
+ * @param cache tile cache whose image (and pyramid, if any) already holds
+ *              the new pixels
+ * @param first_row first row of the band
+ * @param rows rows in the band
+ */
+void tile_cache_refresh(tile_cache *cache, int first_row, int rows) {
+    int end_row = first_row + rows;
+    int i, level;
+
+    for (i=cache->lru_head; i>=0; i=cache->tiles[i].next) {
+        tile *t = &cache->tiles[i];
+        if (t->y >= end_row || t->y + t->height <= first_row)
+            continue;
+
+        glBindTexture(GL_TEXTURE_2D, t->texture);
+        for (level=0; level<t->levels; level++) {
+            // a row of level n averages rows 2r and 2r+1 of level n - 1
+            const image *src = level == 0 ? cache->img : &cache->mips->level[level];
+            int tile_y = t->y >> level;
+            int height = t->height >> level > 0 ? t->height >> level : 1;
+            int y0 = first_row >> level;
+            int y1 = ((end_row - 1) >> level) + 1;
+            unsigned char *pixels;
+
+            if (level > 0 && cache->mips == NULL)
+                break;
+            if (y0 < tile_y)
+                y0 = tile_y;
+            if (y1 > tile_y + height)
+                y1 = tile_y + height;
+            if (y0 >= y1)
+                continue;
+            pixels = (unsigned char *)src->pixels +
+                     ((size_t)y0 * src->width + (t->x >> level)) * cache->pixel_bytes;
+            upload_rect(cache, level, FALSE, y0 - tile_y,
+                        t->width >> level > 0 ? t->width >> level : 1, y1 - y0, pixels,
+                        src->width);
+        }
+    }
+}
+
+/**
+ * Gives the tiles their mip levels once the whole image is decoded and its
+ * pyramid is built. Resident tiles get theirs right away, most recently
+ * used first, evicting older tiles to make room; any that don't fit keep
+ * only level 0. The others get theirs as they become resident.
+ * @param cache tile cache whose rows are all uploaded
+ * @param mips pyramid of the cache's image; must outlive the cache
+ */
+void tile_cache_set_mipmaps(tile_cache *cache, const mip_pyramid *mips) {
+    int i;
+
+    cache->mips = mips;
+    for (i=cache->lru_head; i>=0; i=cache->tiles[i].next) {
+        tile *t = &cache->tiles[i];
+        size_t grow = tile_bytes(cache, t, resident_levels(cache, t)) - t->bytes;
+        if (make_room(cache, grow, i) == 0)
+            upload_tile_levels(cache, t);
+    }
+}
+
+/**
+ * Switches between trilinear filtering over the mip levels and nearest
+ * filtering of level 0 when minifying, e.g. to compare the two
+ * @param cache tile cache
+ * @param use TRUE to sample the mip levels
+ */
+void tile_cache_use_mipmaps(tile_cache *cache, boolean use) {
+    int i;
+
+    cache->mipmaps = use;
+    for (i=cache->lru_head; i>=0; i=cache->tiles[i].next) {
+        glBindTexture(GL_TEXTURE_2D, cache->tiles[i].texture);
+        set_min_filter(cache, &cache->tiles[i]);
+    }
+}
+
+/**
+ * Makes every tile resident, with its mip levels, if they all fit in the
+ * budget. From then on nothing is evicted, so the caller may free the
+ * pixels of the image and its pyramid.
+ * @param cache tile cache whose rows are all uploaded and pyramid is set
+ * @return 0 if every tile is resident for good, -1 if they don't all fit
+ */
+int tile_cache_pin(tile_cache *cache) {
+    size_t total = 0;
+    int i;
+
+    for (i=0; i<cache->tiles_x * cache->tiles_y; i++) {
+        tile *t = &cache->tiles[i];
+        total += tile_bytes(cache, t, cache->mips != NULL ? level_count(t->width, t->height) : 1);
+    }
+    if (total > cache->budget)
+        return -1;
+
+    for (i=0; i<cache->tiles_x * cache->tiles_y; i++) {
+        if (cache->tiles[i].texture == 0 && make_resident(cache, i) < 0)
+            return -1;
+    }
+    cache->mips = NULL;
+    return 0;
+}
+
+/**
+ * Draws the tiles that intersect the viewport, uploading the ones that
+ * aren't resident yet. Uses the currently bound program, whose texture
+ * sampler reads unit 0.
+ * @param cache tile cache
+ * @param mvp transformation the image is drawn with
+ */
+void tile_cache_draw(tile_cache *cache, mat4x4 mvp) {
+    int i;
+
+    cache->frame++;
+    glActiveTexture(GL_TEXTURE0);
+    glBindBuffer(GL_ARRAY_BUFFER, cache->vertex_buffer);
+    for (i=0; i<cache->tiles_x * cache->tiles_y; i++) {
+        tile *t = &cache->tiles[i];
+        if (!tile_visible(mvp, cache->quads + i * 4))
+            continue;
+
+        t->last_frame = cache->frame;
+        if (t->texture == 0) {
+            if (make_resident(cache, i) < 0)
+                continue;
+        }
+        else {
+            lru_unlink(cache, i);
+            lru_push(cache, i);
+        }
+        glBindTexture(GL_TEXTURE_2D, t->texture);
+        glDrawArrays(GL_QUADS, i * 4, 4);
+    }
+}
+
+/**
+ * Releases every tile texture and the vertex buffer
+ * @param cache tile cache
+ */
+void tile_cache_free(tile_cache *cache) {
+    while (cache->lru_head >= 0)
+        evict(cache, cache->lru_head);
+    glDeleteBuffers(UPLOAD_BUFFERS, cache->upload_buffers);
+    glDeleteBuffers(1, &cache->vertex_buffer);
+    free(cache->tiles);
+    free(cache->quads);
+    cache->tiles = NULL;
+    cache->quads = NULL;
+}
+
+
+/*******************************************************//**
+ * Mipmap pyramid
+ * ********************************************************/
+
+/**
+ * Builds the mipmap pyramid of an image on the CPU, halving it with a box
+ * filter until it is 1x1. Each level is filtered by several threads.
+ * @param pyr pyramid to fill in
+ * @param img fully decoded image, used as level 0
+ * @return 0 on success, -1 on error (pyr is left with just level 0)
+ */
+int mip_pyramid_build(mip_pyramid *pyr, image *img) {
+    TRACE_SCOPE(span, "mipmaps");
+    pyr->level[0] = *img;
+    pyr->levels = 1;
+    while (pyr->levels < MIP_MAX_LEVELS) {
+        const image *prev = &pyr->level[pyr->levels - 1];
+        if (prev->width == 1 && prev->height == 1)
+            break;
+        if (image_downsample(prev, &pyr->level[pyr->levels]) < 0) {
+            mip_pyramid_free(pyr);
+            return -1;
+        }
+        pyr->levels++;
+    }
+    return 0;
+}
+
+/**
+ * Releases the levels of a pyramid, leaving level 0 alone
+ * @param pyr pyramid built with mip_pyramid_build()
+ */
+void mip_pyramid_free(mip_pyramid *pyr) {
+    while (pyr->levels > 1)
+        free_image(&pyr->level[--pyr->levels]);
+}
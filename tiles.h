@@ -0,0 +1,77 @@
+/* tiles header file - images drawn as a grid of separately resident textures */
+#ifndef TILES_H
+#define TILES_H
+
+#include "glinclude.h"
+
+#include "linmath.h"
+#include "ppmrw.h"
+
+// most levels a mipmap pyramid can have, enough for any image size
+#define MIP_MAX_LEVELS 32
+// pixel buffers uploads alternate between
+#define UPLOAD_BUFFERS 2
+
+typedef struct {
+    float Position[2];
+    float TexCoord[2];
+} Vertex;
+
+// one tile of an image and, while resident, its texture
+typedef struct tile_t {
+    int x, y, width, height;    // pixels of the image it covers
+    GLuint texture;             // 0 while not resident
+    int rows_uploaded;          // rows of the tile copied into the texture
+    int levels;                 // mip levels in the texture, 1 until a pyramid is set
+    size_t bytes;               // GPU memory used when resident
+    int prev, next;             // LRU list links, -1 at the ends
+    unsigned long last_frame;   // last frame the tile was visible in
+} tile;
+
+// an image and its successively halved copies, down to 1x1
+typedef struct mip_pyramid_t {
+    int levels;                     // number of images in level
+    image level[MIP_MAX_LEVELS];    // level[0] is the source image and isn't owned
+} mip_pyramid;
+
+// all tiles of an image plus the LRU list of the resident ones
+typedef struct tile_cache_t {
+    image *img;
+    int tile_size;
+    int tiles_x, tiles_y;
+    tile *tiles;                // tiles_x * tiles_y tiles, row by row
+    GLenum internal_format;     // texture formats shared by all tiles
+    GLenum format;
+    GLenum type;
+    size_t pixel_bytes;         // bytes per pixel in img
+    size_t budget;              // most GPU memory resident tiles may use
+    size_t resident_bytes;
+    int lru_head, lru_tail;     // most and least recently used resident tiles
+    unsigned long frame;        // frames drawn so far
+    int rows_ready;             // rows of img decoded so far
+    boolean over_budget;        // a visible tile didn't fit in the budget
+    const mip_pyramid *mips;    // NULL until the pyramid has been built
+    boolean mipmaps;            // sample the mip levels when minifying
+    GLuint upload_buffers[UPLOAD_BUFFERS];
+    int next_upload;            // upload buffer to fill next
+    size_t upload_bytes;        // pixels copied into textures so far
+    double upload_seconds;      // time spent copying them
+    Vertex *quads;              // four vertexes per tile, kept for culling
+    GLuint vertex_buffer;       // the same quads on the GPU
+} tile_cache;
+
+int tile_cache_init(tile_cache *cache, image *img, int tile_size, size_t budget,
+                    boolean force_8bit);
+void tile_cache_rows_ready(tile_cache *cache, int rows);
+void tile_cache_replace(tile_cache *cache, image *img);
+void tile_cache_refresh(tile_cache *cache, int first_row, int rows);
+void tile_cache_set_mipmaps(tile_cache *cache, const mip_pyramid *mips);
+void tile_cache_use_mipmaps(tile_cache *cache, boolean use);
+int tile_cache_pin(tile_cache *cache);
+void tile_cache_draw(tile_cache *cache, mat4x4 mvp);
+void tile_cache_free(tile_cache *cache);
+
+int mip_pyramid_build(mip_pyramid *pyr, image *img);
+void mip_pyramid_free(mip_pyramid *pyr);
+
+#endif
@@ -0,0 +1,259 @@
+/** trace - times the stages of loading and drawing
+ * Spans are recorded with the thread that ran them and written, when the
+ * program exits, in the Chrome trace event format that chrome://tracing and
+ * Perfetto load. Every span is also added to a per-stage total, so a one
+ * line summary of where the time went, and at what rate pixels moved
+ * through each stage, can be printed without opening the trace.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "trace.h"
+
+// stages the summary keeps totals for
+#define TRACE_MAX_STAGES 64
+// threads that can be given a name
+#define TRACE_MAX_THREADS 64
+
+// a finished span
+typedef struct trace_event_t {
+    const char *name;
+    int thread;
+    double start, duration; // microseconds
+    size_t bytes;
+} trace_event;
+
+// totals for all spans with the same name
+typedef struct trace_stage_t {
+    const char *name;
+    int count;
+    double duration;        // microseconds
+    size_t bytes;
+} trace_stage;
+
+// set while recording; written before any other thread starts
+static int enabled = 0;
+static char *trace_path = NULL;
+static double origin;       // when recording started, in microseconds
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;   // guards the fields below
+static trace_event *events = NULL;
+static int event_count = 0, event_capacity = 0, dropped = 0;
+static trace_stage stages[TRACE_MAX_STAGES];
+static int stage_count = 0;
+static const char *thread_names[TRACE_MAX_THREADS + 1];
+static int thread_count = 0;
+
+// small id of the calling thread, 0 until it records something
+static __thread int thread_id = 0;
+
+/**
+ * @return a monotonic timestamp in microseconds
+ */
+static double micros(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/**
+ * Gives the calling thread its id the first time it needs one; the lock
+ * must be held
+ */
+static int current_thread(void) {
+    if (thread_id == 0)
+        thread_id = ++thread_count;
+    return thread_id;
+}
+
+/**
+ * Finds the totals of a stage, adding it the first time it's seen; the lock
+ * must be held
+ * @return the stage, NULL if there are too many
+ */
+static trace_stage *find_stage(const char *name) {
+    int i;
+    for (i=0; i<stage_count; i++) {
+        if (stages[i].name == name || strcmp(stages[i].name, name) == 0)
+            return &stages[i];
+    }
+    if (stage_count == TRACE_MAX_STAGES)
+        return NULL;
+    stages[stage_count].name = name;
+    return &stages[stage_count++];
+}
+
+/**
+ * Starts recording spans. Call before any thread that records spans starts.
+ * @param path trace file written by trace_stop()
+ * @return 0 on success, -1 on error
+ */
+int trace_start(const char *path) {
+#ifndef EZVIEW_TRACE
+    (void)path;
+    fprintf(stderr, "Error: trace_start: Built without EZVIEW_TRACE\n");
+    return -1;
+#else
+    trace_path = strdup(path);
+    if (trace_path == NULL) {
+        fprintf(stderr, "Error: trace_start: Unable to allocate memory\n");
+        return -1;
+    }
+    origin = micros();
+    enabled = 1;
+    trace_thread_name("main");
+    return 0;
+#endif
+}
+
+/**
+ * Names the calling thread in the trace
+ * @param name a string literal
+ */
+void trace_thread_name(const char *name) {
+    if (!enabled)
+        return;
+    pthread_mutex_lock(&lock);
+    if (current_thread() <= TRACE_MAX_THREADS)
+        thread_names[thread_id] = name;
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Starts timing a stage; use TRACE_BEGIN() rather than calling this
+ * @param name a string literal naming the stage
+ * @return the span to hand to trace_end()
+ */
+trace_span trace_begin(const char *name) {
+    trace_span span;
+    span.name = name;
+    span.bytes = 0;
+    span.start = enabled ? micros() - origin : -1;
+    return span;
+}
+
+/**
+ * Finishes timing a stage and records it; use TRACE_END() or TRACE_SCOPE()
+ * rather than calling this
+ * @param span span returned by trace_begin()
+ */
+void trace_end(trace_span *span) {
+    double duration;
+    trace_stage *stage;
+
+    if (span->start < 0 || !enabled)
+        return;
+    duration = micros() - origin - span->start;
+
+    pthread_mutex_lock(&lock);
+    // trace_stop() may have run since the check above
+    if (!enabled) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    if (event_count == event_capacity && event_capacity < TRACE_MAX_EVENTS) {
+        int capacity = event_capacity == 0 ? 4096 : event_capacity * 2;
+        trace_event *grown = realloc(events, sizeof(trace_event) * capacity);
+        if (grown != NULL) {
+            events = grown;
+            event_capacity = capacity;
+        }
+    }
+    if (event_count < event_capacity) {
+        trace_event *e = &events[event_count++];
+        e->name = span->name;
+        e->thread = current_thread();
+        e->start = span->start;
+        e->duration = duration;
+        e->bytes = span->bytes;
+    }
+    else
+        dropped++;
+    stage = find_stage(span->name);
+    if (stage != NULL) {
+        stage->count++;
+        stage->duration += duration;
+        stage->bytes += span->bytes;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Writes the recorded spans to the trace file
+ * @return 0 on success, -1 on error
+ */
+static int write_trace(void) {
+    FILE *fh = fopen(trace_path, "w");
+    int i, ret_val;
+
+    if (fh == NULL) {
+        fprintf(stderr, "Error: write_trace: %s can't be opened\n", trace_path);
+        return -1;
+    }
+    fprintf(fh, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (i=1; i<=thread_count && i<=TRACE_MAX_THREADS; i++) {
+        if (thread_names[i] != NULL)
+            fprintf(fh, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                        "\"args\":{\"name\":\"%s\"}},\n", i, thread_names[i]);
+    }
+    for (i=0; i<event_count; i++) {
+        const trace_event *e = &events[i];
+        fprintf(fh, "{\"name\":\"%s\",\"cat\":\"ezview\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                    "\"pid\":1,\"tid\":%d,\"args\":{\"bytes\":%zu}},\n",
+                e->name, e->start, e->duration, e->thread, e->bytes);
+    }
+    // the last event ends with a comma, so close with one that's harmless
+    fprintf(fh, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"ezview\"}}\n"
+                "]}\n");
+    ret_val = ferror(fh) ? -1 : 0;
+    if (fclose(fh) != 0 || ret_val < 0) {
+        fprintf(stderr, "Error: write_trace: Problem writing %s\n", trace_path);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Prints the time spent in each stage, and for stages that move pixels the
+ * rate they moved them at, on one line
+ */
+static void print_summary(void) {
+    int i;
+
+    fprintf(stderr, "Stages:");
+    for (i=0; i<stage_count; i++) {
+        const trace_stage *s = &stages[i];
+        fprintf(stderr, "%s %s %dx %.1f ms", i > 0 ? "," : "", s->name, s->count,
+                s->duration / 1e3);
+        if (s->bytes > 0 && s->duration > 0)
+            fprintf(stderr, " %.1f MB %.0f MB/s", s->bytes / 1e6, s->bytes / s->duration);
+    }
+    fprintf(stderr, "\n");
+}
+
+/**
+ * Stops recording, writes the trace file and prints the summary. Suits
+ * atexit(); does nothing unless trace_start() succeeded.
+ */
+void trace_stop(void) {
+    if (!enabled)
+        return;
+    pthread_mutex_lock(&lock);
+    enabled = 0;
+    if (write_trace() == 0)
+        fprintf(stderr, "Wrote %d trace events to %s\n", event_count, trace_path);
+    if (dropped > 0)
+        fprintf(stderr, "Warning: %d spans past the first %d were left out of the trace\n",
+                dropped, TRACE_MAX_EVENTS);
+    print_summary();
+    free(events);
+    events = NULL;
+    event_count = event_capacity = 0;
+    free(trace_path);
+    trace_path = NULL;
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,39 @@
+/* trace header file - times the stages of loading and drawing as Chrome trace events */
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+
+// spans kept for the trace file; later ones are only counted in the summary
+#define TRACE_MAX_EVENTS (1 << 20)
+
+// a stage being timed, from TRACE_BEGIN() to TRACE_END() or to the end of
+// the block TRACE_SCOPE() was in
+typedef struct trace_span_t {
+    const char *name;       // a string literal, so it outlives the span
+    double start;           // microseconds since trace_start(), -1 when not tracing
+    size_t bytes;           // pixel data the stage read or wrote, 0 if that doesn't apply
+} trace_span;
+
+// Builds without EZVIEW_TRACE compile the spans out entirely; with it, a
+// span costs one branch until --trace turns recording on.
+#ifdef EZVIEW_TRACE
+#define TRACE_BEGIN(span, name) trace_span span = trace_begin(name)
+#define TRACE_END(span, n) ((span).bytes = (n), trace_end(&(span)))
+#define TRACE_SCOPE(span, name) \
+        trace_span span __attribute__((cleanup(trace_end))) = trace_begin(name)
+#define TRACE_BYTES(span, n) ((span).bytes = (n))
+#else
+#define TRACE_BEGIN(span, name) ((void)0)
+#define TRACE_END(span, n) ((void)0)
+#define TRACE_SCOPE(span, name) ((void)0)
+#define TRACE_BYTES(span, n) ((void)0)
+#endif
+
+int trace_start(const char *path);
+void trace_thread_name(const char *name);
+trace_span trace_begin(const char *name);
+void trace_end(trace_span *span);
+void trace_stop(void);
+
+#endif
@@ -0,0 +1,117 @@
+/** transform - the view transformation, recomposed only where it changed
+ * The view is rotation, then shear, then scale, then translation and
+ * tilt. The product of the stages up to each one is kept; setting new
+ * parameters marks the earliest stage that changed as dirty, and getting
+ * the transformation multiplies out only that stage and the ones after
+ * it. A frame where nothing moved costs a comparison and a copy.
+ */
+
+#include <string.h>
+
+#include "transform.h"
+#include "matsimd.h"
+
+/**
+ * Builds the matrix of one stage of the view
+ * @param stage stage to build
+ * @param p parameters of the view
+ * @param m set to the stage's matrix
+ */
+static void stage_matrix(int stage, const view_params *p, mat4x4 m) {
+    mat4x4_identity(m);
+    if (stage == STAGE_ROTATE)
+        mat4x4_rotate_Z(m, m, p->rotation);
+    else if (stage == STAGE_SHEAR) {
+        m[0][1] = p->shear_x;
+        m[1][0] = p->shear_y;
+    }
+    else if (stage == STAGE_SCALE) {
+        m[0][0] = p->scale;
+        m[1][1] = p->scale;
+        // flattens the image onto the z = 0 plane
+        m[2][2] = 0;
+    }
+    else {
+        m[0][3] = p->x_tilt;
+        m[1][3] = p->y_tilt;
+        m[3][0] = p->x_pos;
+        m[3][1] = p->y_pos;
+    }
+}
+
+/**
+ * @return the earliest stage whose parameters differ, VIEW_STAGES if none do
+ */
+static int first_change(const view_params *a, const view_params *b) {
+    if (a->rotation != b->rotation)
+        return STAGE_ROTATE;
+    if (a->shear_x != b->shear_x || a->shear_y != b->shear_y)
+        return STAGE_SHEAR;
+    if (a->scale != b->scale)
+        return STAGE_SCALE;
+    if (a->x_pos != b->x_pos || a->y_pos != b->y_pos ||
+        a->x_tilt != b->x_tilt || a->y_tilt != b->y_tilt)
+        return STAGE_TRANSLATE;
+    return VIEW_STAGES;
+}
+
+/**
+ * Starts a view at the identity; everything is composed on first use
+ * @param view view to initialize
+ */
+void view_transform_init(view_transform *view) {
+    memset(view, 0, sizeof(view_transform));
+    view->params.scale = 1;
+    view->first_dirty = STAGE_ROTATE;
+}
+
+/**
+ * Sets the parameters of the view, marking the stages that changed
+ * @param view view to update
+ * @param params new parameters
+ */
+void view_transform_set(view_transform *view, const view_params *params) {
+    int stage = first_change(&view->params, params);
+    if (stage < view->first_dirty)
+        view->first_dirty = stage;
+    view->params = *params;
+}
+
+/**
+ * Gets the view transformation, recomposing the stages that are dirty
+ * @param view view to get
+ * @param mvp set to the transformation
+ */
+void view_transform_get(view_transform *view, mat4x4 mvp) {
+    int stage;
+
+    for (stage=view->first_dirty; stage<VIEW_STAGES; stage++) {
+        mat4x4 m;
+        stage_matrix(stage, &view->params, m);
+        if (stage == STAGE_ROTATE)
+            mat4x4_dup(view->product[stage], m);
+        else
+            mat4x4_mul_simd(view->product[stage], m, view->product[stage - 1]);
+        view->recomposed++;
+    }
+    view->first_dirty = VIEW_STAGES;
+    mat4x4_dup(mvp, view->product[VIEW_STAGES - 1]);
+}
+
+/**
+ * Composes a view from scratch with the scalar linmath functions, as every
+ * frame used to; what view_transform_get() is measured and checked against
+ * @param params parameters of the view
+ * @param mvp set to the transformation
+ */
+void compose_view(const view_params *params, mat4x4 mvp) {
+    mat4x4 m;
+    int stage;
+
+    mat4x4_identity(mvp);
+    mat4x4_rotate_Z(mvp, mvp, params->rotation);
+    for (stage=STAGE_SHEAR; stage<VIEW_STAGES; stage++) {
+        stage_matrix(stage, params, m);
+        mat4x4_mul(mvp, m, mvp);
+    }
+}
@@ -0,0 +1,39 @@
+/* transform header file - the view transformation, recomposed only where it changed */
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include "linmath.h"
+
+// the parts of the view, in the order they are applied to the image
+enum view_stage {
+    STAGE_ROTATE,
+    STAGE_SHEAR,
+    STAGE_SCALE,
+    STAGE_TRANSLATE,        // translation and tilt
+    VIEW_STAGES
+};
+
+// everything the view transformation is built from
+typedef struct view_params_t {
+    float rotation;         // radians
+    float shear_x, shear_y;
+    float scale;
+    float x_pos, y_pos;
+    float x_tilt, y_tilt;
+} view_params;
+
+// the view transformation with the partial products it was built from, so
+// a change to a late stage (say the translation) doesn't redo the early ones
+typedef struct view_transform_t {
+    view_params params;             // what the stages were last built from
+    mat4x4 product[VIEW_STAGES];    // the stages up to and including each, composed
+    int first_dirty;                // earliest stage to recompose, VIEW_STAGES when none
+    unsigned long recomposed;       // stages recomposed so far, for benchmarks
+} view_transform;
+
+void view_transform_init(view_transform *view);
+void view_transform_set(view_transform *view, const view_params *params);
+void view_transform_get(view_transform *view, mat4x4 mvp);
+void compose_view(const view_params *params, mat4x4 mvp);
+
+#endif
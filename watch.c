@@ -0,0 +1,191 @@
+/** watch - notices when a file is rewritten
+ * On Linux the file's directory is watched with inotify, so a file that is
+ * replaced by renaming a new one over it (as many renderers save) is still
+ * caught, and in-place writes are only reported once the writer closes the
+ * file. Elsewhere the file is polled with stat() and reported once its
+ * size and modification time have held still for a poll.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <GLFW/glfw3.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "watch.h"
+
+
+/*******************************************************//**
+ * Watcher thread
+ * ********************************************************/
+
+/**
+ * @return TRUE if two stat() results look like different versions of a file
+ */
+static boolean stat_differs(const struct stat *a, const struct stat *b) {
+    return a->st_ino != b->st_ino || a->st_size != b->st_size || a->st_mtime != b->st_mtime;
+}
+
+/**
+ * Records that the file changed and wakes the render loop
+ */
+static void report_change(file_watch *watch) {
+    pthread_mutex_lock(&watch->lock);
+    watch->changed = TRUE;
+    pthread_mutex_unlock(&watch->lock);
+    glfwPostEmptyEvent();
+}
+
+#ifdef __linux__
+/**
+ * Reads the pending inotify events
+ * @return TRUE if one of them is about the watched file
+ */
+static boolean read_events(file_watch *watch) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    boolean hit = FALSE;
+    ssize_t length = read(watch->fd, buf, sizeof(buf));
+    char *p;
+
+    for (p=buf; length > 0 && p < buf + length; ) {
+        const struct inotify_event *event = (const struct inotify_event *)p;
+        if (event->len > 0 && strcmp(event->name, watch->name) == 0)
+            hit = TRUE;
+        p += sizeof(struct inotify_event) + event->len;
+    }
+    return hit;
+}
+#endif
+
+/**
+ * Waits for changes to the file until the watch is stopped (thread entry
+ * point)
+ */
+static void *watch_file(void *arg) {
+    file_watch *watch = arg;
+    struct pollfd fds[2];
+    struct stat sample = watch->last, st;
+
+    fds[0].fd = watch->stop[0];
+    fds[0].events = POLLIN;
+    fds[1].fd = watch->fd;
+    fds[1].events = POLLIN;
+    for (;;) {
+        int ready = poll(fds, watch->fd >= 0 ? 2 : 1, watch->fd >= 0 ? -1 : WATCH_POLL_MS);
+        if (ready < 0 && errno != EINTR)
+            break;
+        if (ready > 0 && (fds[0].revents & POLLIN))
+            break;
+#ifdef __linux__
+        if (watch->fd >= 0) {
+            if (ready > 0 && (fds[1].revents & POLLIN) && read_events(watch))
+                report_change(watch);
+            continue;
+        }
+#endif
+        // a file that is still being written keeps changing between polls
+        if (stat(watch->path, &st) < 0)
+            continue;
+        if (stat_differs(&st, &watch->last) && !stat_differs(&st, &sample)) {
+            watch->last = st;
+            report_change(watch);
+        }
+        sample = st;
+    }
+    return NULL;
+}
+
+
+/*******************************************************//**
+ * Watch
+ * ********************************************************/
+
+/**
+ * Starts watching a file for rewrites
+ * @param watch watch to initialize
+ * @param path file to watch
+ * @return 0 on success, -1 on error
+ */
+int watch_start(file_watch *watch, const char *path) {
+    const char *slash = strrchr(path, '/');
+
+    memset(watch, 0, sizeof(file_watch));
+    watch->fd = -1;
+    if (stat(path, &watch->last) < 0) {
+        fprintf(stderr, "Error: watch_start: %s can't be found\n", path);
+        return -1;
+    }
+    watch->path = strdup(path);
+    watch->name = strdup(slash != NULL ? slash + 1 : path);
+    watch->dir = slash == NULL ? strdup(".") : slash == path ? strdup("/")
+                                                             : strndup(path, slash - path);
+    if (watch->path == NULL || watch->name == NULL || watch->dir == NULL || pipe(watch->stop) < 0) {
+        fprintf(stderr, "Error: watch_start: Unable to watch %s\n", path);
+        free(watch->path);
+        free(watch->name);
+        free(watch->dir);
+        return -1;
+    }
+
+#ifdef __linux__
+    // fall back to polling if inotify is out of instances or watches
+    watch->fd = inotify_init1(IN_CLOEXEC);
+    if (watch->fd >= 0 &&
+        inotify_add_watch(watch->fd, watch->dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        close(watch->fd);
+        watch->fd = -1;
+    }
+#endif
+
+    pthread_mutex_init(&watch->lock, NULL);
+    if (pthread_create(&watch->thread, NULL, watch_file, watch) != 0) {
+        fprintf(stderr, "Error: watch_start: Unable to start watcher thread\n");
+        pthread_mutex_destroy(&watch->lock);
+        close(watch->stop[0]);
+        close(watch->stop[1]);
+        if (watch->fd >= 0)
+            close(watch->fd);
+        free(watch->path);
+        free(watch->name);
+        free(watch->dir);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Checks for a rewrite of the file, and forgets it once reported
+ * @param watch watch started with watch_start()
+ * @return TRUE if the file changed since the last call
+ */
+boolean watch_changed(file_watch *watch) {
+    boolean changed;
+
+    pthread_mutex_lock(&watch->lock);
+    changed = watch->changed;
+    watch->changed = FALSE;
+    pthread_mutex_unlock(&watch->lock);
+    return changed;
+}
+
+/**
+ * Stops watching and releases the watch
+ * @param watch watch started with watch_start()
+ */
+void watch_stop(file_watch *watch) {
+    // a pipe with room for a byte can't fail to take one
+    if (write(watch->stop[1], "", 1) == 1)
+        pthread_join(watch->thread, NULL);
+    pthread_mutex_destroy(&watch->lock);
+    close(watch->stop[0]);
+    close(watch->stop[1]);
+    if (watch->fd >= 0)
+        close(watch->fd);
+    free(watch->path);
+    free(watch->name);
+    free(watch->dir);
+}
@@ -0,0 +1,30 @@
+/* watch header file - notices when a file is rewritten */
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "ppmrw.h"
+
+// how often the file is checked where there's no inotify, in milliseconds
+#define WATCH_POLL_MS 250
+
+// a file watched on a background thread
+typedef struct file_watch_t {
+    char *dir;              // directory holding the file
+    char *name;             // file name within dir
+    char *path;
+    int fd;                 // inotify instance, -1 when polling
+    struct stat last;       // polling: what the file looked like when last reported
+    int stop[2];            // pipe written to stop the thread
+    pthread_t thread;
+    pthread_mutex_t lock;   // guards changed
+    boolean changed;        // the file was rewritten since watch_changed() was called
+} file_watch;
+
+int watch_start(file_watch *watch, const char *path);
+boolean watch_changed(file_watch *watch);
+void watch_stop(file_watch *watch);
+
+#endif